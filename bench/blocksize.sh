@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+
+# Block size benchmark
+# Writes a corpus of small files to a disk formatted with each block size
+# and reports the space reserved, the slack and the write and read speed.
+# Without a corpus directory, 500 random files of 1 to 64KiB are used.
+#
+# Usage: bench/blocksize.sh [corpus_dir]
+
+BMFS=${BMFS:-$(pwd)/bin/bmfs}
+WORK=$(mktemp -d)
+TIMEFORMAT=%R
+
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -n "$1" ]; then
+	CORPUS=$(cd "$1" && pwd)
+else
+	CORPUS="$WORK/corpus"
+	mkdir -p "$CORPUS"
+	for ((i = 0; i < 500; i++)); do
+		head -c $(( (RANDOM % 64 + 1) * 1024 - RANDOM % 1024 )) /dev/urandom > "$CORPUS/asset$i.bin"
+	done
+fi
+
+cd "$CORPUS" || exit 1
+FILES=(*)
+DATA=$(cat "${FILES[@]}" | wc -c)
+
+printf "%10s %14s %14s %8s %14s %14s\n" "Block" "Data (KiB)" "Reserved (KiB)" "Slack" "Write (MiB/s)" "Read (MiB/s)"
+for BS in 4096 16384 65536 262144 1048576 2097152; do
+	# Room for the reserved areas plus every file with one spare block
+	SIZE=$(( (4194304 + (DATA / BS + 2 * ${#FILES[@]}) * BS) / 1048576 + 1 ))
+	rm -f "$WORK/disk.img"
+	dd if=/dev/zero of="$WORK/disk.img" bs=1048576 count=0 seek=$SIZE 2> /dev/null
+	"$BMFS" "$WORK/disk.img" format --block-size=$BS > /dev/null
+	"$BMFS" "$WORK/disk.img" extend > /dev/null
+
+	write=$( { time "$BMFS" "$WORK/disk.img" write "${FILES[@]}" > /dev/null ; } 2>&1 )
+	reserved=$("$BMFS" "$WORK/disk.img" list | awk -v bs=$BS '
+		/Reserved \(MiB\)/ { unit = 1024 } /Reserved \(KiB\)/ { unit = 1 }
+		NR > 3 && NF >= 3 { total += $NF * unit } END { print total }')
+
+	rm -rf "$WORK/out" && mkdir "$WORK/out"
+	read=$( { time ( cd "$WORK/out" && "$BMFS" "$WORK/disk.img" extract > /dev/null ) ; } 2>&1 )
+
+	awk -v bs=$BS -v data=$DATA -v res=$reserved -v w=$write -v r=$read 'BEGIN {
+		printf "%9dK %14d %14d %7.1f%% %14.1f %14.1f\n", bs / 1024, data / 1024, res,
+			100 * (res * 1024 - data) / (res * 1024), data / 1048576 / w, data / 1048576 / r }'
+done
@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+
+# Lock contention benchmark
+# Runs N concurrent readers and M concurrent writers against one image and
+# reports the operations per second for readers only, writers only and both.
+#
+# Usage: bench/contention.sh [readers] [writers] [rounds]
+
+READERS=${1:-8}
+WRITERS=${2:-4}
+ROUNDS=${3:-10}
+BMFS=${BMFS:-$(pwd)/bin/bmfs}
+WORK=$(mktemp -d)
+TIMEFORMAT=%R
+
+trap 'rm -rf "$WORK"' EXIT
+
+cd "$WORK" || exit 1
+"$BMFS" disk.img initialize 512M > /dev/null || exit 1
+head -c 4194304 /dev/urandom > golden.bin
+"$BMFS" disk.img write golden.bin > /dev/null
+for ((w = 0; w < WRITERS; w++)); do
+	mkdir -p "w$w"
+	head -c 1048576 /dev/urandom > "w$w/out$w.bin"
+	"$BMFS" disk.img create "out$w.bin" 2 > /dev/null
+done
+for ((r = 0; r < READERS; r++)); do
+	mkdir -p "r$r"
+done
+
+reader() {
+	cd "r$1" && for ((i = 0; i < ROUNDS; i++)); do
+		"$BMFS" ../disk.img read golden.bin > /dev/null
+	done
+}
+
+writer() {
+	cd "w$1" && for ((i = 0; i < ROUNDS; i++)); do
+		"$BMFS" ../disk.img write "out$1.bin" > /dev/null
+	done
+}
+
+phase() {
+	local readers=$1 writers=$2 elapsed ops
+	elapsed=$( { time {
+		for ((r = 0; r < readers; r++)); do reader $r & done
+		for ((w = 0; w < writers; w++)); do writer $w & done
+		wait
+	} ; } 2>&1 )
+	ops=$(( (readers + writers) * ROUNDS ))
+	printf "%-8s readers=%-3d writers=%-3d ops=%-5d time=%6ss ops/s=%s\n" "$3" "$readers" "$writers" "$ops" "$elapsed" \
+		"$(awk -v o="$ops" -v t="$elapsed" 'BEGIN { if (t > 0) printf "%.1f", o / t; else print "inf" }')"
+}
+
+phase "$READERS" 0 "read"
+phase 0 "$WRITERS" "write"
+phase "$READERS" "$WRITERS" "mixed"
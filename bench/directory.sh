@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+
+# Extended directory scaling benchmark
+# Fills an extended directory with N files and reports how long create,
+# lookup (read of an empty file) and list take as the directory grows.
+# The image is a sparse file sized so every file gets one 2MiB block.
+#
+# Usage: bench/directory.sh [files] [steps]
+
+FILES=${1:-10000}
+STEPS=${2:-10}
+BMFS=${BMFS:-$(pwd)/bin/bmfs}
+WORK=$(mktemp -d)
+TIMEFORMAT=%R
+
+trap 'rm -rf "$WORK"' EXIT
+
+cd "$WORK" || exit 1
+dd if=/dev/zero of=disk.img bs=1048576 count=0 seek=$(( (FILES + 4) * 2 )) 2> /dev/null || exit 1
+"$BMFS" disk.img format > /dev/null
+"$BMFS" disk.img extend || exit 1
+
+per_op() {
+	awk -v t="$1" -v n="$2" 'BEGIN { printf "%.3f", t * 1000 / n }'
+}
+
+printf "%8s %14s %14s %14s\n" "Files" "Create (ms)" "Lookup (ms)" "List (ms)"
+created=0
+step=$(( FILES / STEPS ))
+while (( created < FILES )); do
+	elapsed=$( { time {
+		for ((i = created; i < created + step; i++)); do
+			"$BMFS" disk.img create "file$i" 2 > /dev/null
+		done
+	} ; } 2>&1 )
+	created=$(( created + step ))
+	create=$(per_op "$elapsed" "$step")
+
+	elapsed=$( { time {
+		for ((i = 0; i < 20; i++)); do
+			"$BMFS" disk.img read "file$(( created - 1 - i ))" > /dev/null
+		done
+	} ; } 2>&1 )
+	lookup=$(per_op "$elapsed" 20)
+
+	elapsed=$( { time "$BMFS" disk.img list > /dev/null ; } 2>&1 )
+	list=$(per_op "$elapsed" 1)
+
+	printf "%8d %14s %14s %14s\n" "$created" "$create" "$lookup" "$list"
+done
@@ -1,5 +1,6 @@
 #!/usr/bin/env bash
 
 mkdir -p bin
-gcc -o bin/bmfs src/bmfs.c -Wall -W -pedantic -std=c99
-gcc -o bin/bmfslite src/bmfslite.c -Wall -W -pedantic -std=c99
+gcc -o bin/bmfs src/bmfs.c -Wall -W -pedantic -std=c99 -O2 -pthread
+gcc -o bin/bmfslite src/bmfslite.c -Wall -W -pedantic -std=c99 -O2
+gcc -o bin/bmfsbench src/bmfsbench.c -Wall -W -pedantic -std=c99 -O2 -pthread
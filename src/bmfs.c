@@ -3,39 +3,116 @@
 /* v1.3 (2023 10 30) */
 
 /* Global includes */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <errno.h>
 #include <math.h>
-
-/* Typedefs */
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef uint64_t u64;
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "bmfscore.h"
+#include "bmfsproto.h"
+#include "bmfsstripe.h"
 
 /* Global defines */
-struct BMFSEntry
+// Progress of a drop-behind copy through one file
+struct BMFSStream
+{
+	FILE *f;
+	u64 start;	// First byte still in the page cache
+	u64 end;	// Last byte copied so far
+	int writing;
+};
+
+// A file in a build manifest and where it goes
+struct BMFSBuildFile
+{
+	char *path;
+	char name[32];
+	unsigned long long size;
+	unsigned long long reserve;	// Bytes to reserve, 0 for the default
+	unsigned long long at;		// Starting block, 0 to let the build choose
+	unsigned long long blocks;
+	int slot;
+};
+
+// Both ends of a copy between the disk and a local file
+struct BMFSCopy
 {
-	char FileName[32];
-	u64 StartingBlock;
-	u64 ReservedBlocks;
-	u64 FileSize;
-	u64 Unused;
+	struct BMFSStream disk;
+	struct BMFSStream file;
 };
 
 /* Global constants */
 // Min disk size is 6MiB (three blocks of 2MiB each.)
 const unsigned int minimumDiskSize = (6 * 1024 * 1024);
-// Block size is 2MiB
-const unsigned int blockSize = 2 * 1024 * 1024;
+// Default block size is 2MiB, smaller power-of-two sizes down to 4KiB can be
+// chosen when a disk is formatted
+const unsigned int defaultBlockSize = 2 * 1024 * 1024;
+const unsigned int minimumBlockSize = 4 * 1024;
+// The first and last 2MiB of the disk are reserved for the file system
+const unsigned int reservedSize = 2 * 1024 * 1024;
+// The extended directory lives in the second half of block 0, after any
+// boot loader and kernel, and grows one 4KiB block (64 entries) at a time
+const unsigned int extendedDirectoryOffset = 1024 * 1024;
+const unsigned int maxExtendedBlocks = 256;
+// Offsets of the extended directory fields in the DiskInfo sector
+#define DISKINFO_EXTENDED_OFFSET 16
+#define DISKINFO_EXTENDED_BLOCKS 24
+#define DISKINFO_BLOCK_SIZE 32
+// Default amount of scratch space used by the tune command is 64MiB
+const unsigned int tuneScratchSize = 64;
+// Orders for serving multi-file reads
+#define ORDER_DISK 0
+#define ORDER_DIRECTORY 1
+// Durability modes for changes to the disk
+#define DURABILITY_NONE 0
+#define DURABILITY_BATCH 1
+#define DURABILITY_STRICT 2
+// Advisory lock types for byte ranges of the disk
+#define BMFS_UNLOCK 0
+#define BMFS_LOCK_READ 1
+#define BMFS_LOCK_WRITE 2
+#define BMFS_LOCK_NOWAIT 4	// Or'd with a lock type, fail instead of waiting
+
+#define maxClients 64
+// Seconds a serve client may take to send a whole request or read a reply
+const unsigned int serveTimeout = 10;
+// Amount of copied data a streaming copy lets sit in the page cache
+const unsigned int streamWindow = 8 * 1024 * 1024;
+// diff compares images and patch ships changes 4KiB at a time
+const unsigned int patchPage = 4096;
+// Starting value of the FNV-1a hashes that patches keep of each run
+const unsigned long long patchHashStart = 14695981039346656037ULL;
 
 /* Global variables */
 FILE *file, *disk;
+struct BMFSStripe *diskStripe = NULL;	// Set while disk is a striped volume or several targets
 unsigned int filesize, disksize, retval;
+unsigned int blockSize = 2 * 1024 * 1024;	// Block size of the disk
+unsigned long long diskBlocks;			// Number of blocks on the disk
+unsigned long long firstDataBlock;		// Blocks after the reserved area at the start
+unsigned long long lastDataBlock;		// Blocks before the reserved area at the end
+int blockSizeOption = 0;
 char tempfilename[32], tempstring[32];
 char *filename, *diskname, *command;
 char fs_tag[] = "BMFS";
@@ -46,35 +123,135 @@ char s_create[] = "create";
 char s_read[] = "read";
 char s_write[] = "write";
 char s_delete[] = "delete";
+char s_tune[] = "tune";
+char s_extract[] = "extract";
+char s_extend[] = "extend";
+char s_to_lite[] = "to-lite";
+char s_from_lite[] = "from-lite";
+char s_build[] = "build";
+char s_sync[] = "sync";
+char s_df[] = "df";
+char s_fsck[] = "fsck";
+char s_serve[] = "serve";
+char s_diff[] = "diff";
+char s_patch[] = "patch";
 struct BMFSEntry entry;
 void *pentry = &entry;
 char *BlockMap;
 char *FileBlocks;
-char Directory[4096];
+struct BMFSDirectory dir;		// Legacy directory followed by any extended directory blocks
+unsigned int ExtendedBlocks;		// Number of extended directory blocks in use
+struct BMFSGeometry volumeGeometry = { 2 * 1024 * 1024, 4096, 2 * 1024 * 1024, 2 * 1024 * 1024 };
 char DiskInfo[512];
+// I/O chunk sizes, loaded from the device profile written by the tune command
+size_t readChunkSize = 2 * 1024 * 1024;
+size_t writeChunkSize = 2 * 1024 * 1024;
+size_t initChunkSize = 50 * 1024;
+int readOrder = ORDER_DISK;
+int streamMode = 0;
+int durabilityMode = DURABILITY_NONE;
+int durabilityReport = 0;
+int syncWatch = 0;
+int jsonOutput = 0;
+int fsckDeep = 0;
+int fsckRepair = 0;
+int workerJobs = 4;				// Workers for fsck --deep, diff and patch
+char *socketPath = NULL;
+char *tracePath = NULL;
+unsigned long long traceSample = 1;
+int lockFailed = 0;			// A lock could not be taken or released
+unsigned int syncCount = 0;
+double syncTime = 0;
 
 /* Built-in functions */
 int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber);
 void bmfs_list(void);
+void bmfs_df(void);
+int bmfs_fsck(void);
+void bmfs_serve(char *path);
+int bmfs_diff(char *newname, char *patchname);
+int bmfs_patch(char *patchname);
 void bmfs_format(void);
 int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel);
+int bmfs_parse_size(char *size, unsigned long long *result);
+int bmfs_build(char *diskname, char *manifest);
 void bmfs_create(char *filename, unsigned long long maxsize);
+void bmfs_create_blocks(char *filename, unsigned long long blocks);
 void bmfs_read(char *filename);
+void bmfs_read_many(char **names, int count);
 void bmfs_write(char *filename);
+void bmfs_write_many(char **names, int count, struct BMFSLiteImage *source);
+void bmfs_to_lite(char *litename, char **names, int count);
+void bmfs_from_lite(char *litename, char **names, int count);
+void bmfs_sync_host(char *hostdir);
+void bmfs_commit_data(void);
+void bmfs_commit_metadata(void);
+void bmfs_durable_sync(void);
 void bmfs_delete(char *filename);
+int bmfs_tune(unsigned long long scratchsize);
+void bmfs_extend(void);
+int bmfs_load_directory(void);
+unsigned long long bmfs_entry_offset(int slot);
+int bmfs_lock_directory(int type);
+void bmfs_geometry(unsigned long long bytes);
+static int bmfs_directory_alloc(unsigned int blocks);
+void bmfs_profile_load(char *diskname);
+int bmfs_options(int argc, char *argv[]);
+int bmfs_profile_save(char *diskname);
+FILE *bmfs_disk_open(char *name, char *mode);
+int bmfs_disk_report(void);
+void bmfs_disk_progress(void);
+int bmfs_disk_read(void *buf, size_t len, unsigned long long offset);
+int bmfs_disk_write(const void *buf, size_t len, unsigned long long offset);
+int bmfs_lock(unsigned long long offset, unsigned long long length, int type);
+static void bmfs_readahead(unsigned long long offset, unsigned long long length);
+void bmfs_sync(FILE *f);
+double bmfs_time(void);
+static void bmfs_stream_begin(struct BMFSStream *stream, FILE *f, unsigned long long offset, int writing);
+static void bmfs_stream_advance(struct BMFSStream *stream, unsigned long long length);
+static void bmfs_stream_end(struct BMFSStream *stream);
+static void bmfs_copy_progress(void *ctx, size_t length, int padding);
+static long long bmfs_page_cache(void);
 
 /* Program code */
 int main(int argc, char *argv[])
 {
+	long long cachebefore = -1;
+	int readonly, status = 0;
+
 	/* Parse arguments */
-	if (argc == 1) // No arguments provided
+	if (getenv("BMFS_STATS") != NULL && bmfs_stats_start(getenv("BMFS_STATS")) != 0)
+	{
+		printf("bmfs error: Unknown BMFS_STATS mode '%s'\n", getenv("BMFS_STATS"));
+		exit(EXIT_FAILURE);
+	}
+	argc = bmfs_options(argc, argv);
+	if (argc < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	else if (argc == 1) // No arguments provided
 	{
 		printf("BareMetal File System Utility v1.3 (2023 10 30)\n");
 		printf("Written by Ian Seyler @ Return Infinity (ian.seyler@returninfinity.com)\n\n");
 		printf("Usage: bmfs disk function file\n\n");
 		printf("Disk:     the name of the disk file\n");
-		printf("Function: list, read, write, create, delete, format, initialize\n");
-		printf("File:     (if applicable)\n");
+		printf("Function: list, read, write, create, delete, format, initialize, tune, extract, extend,\n");
+		printf("          to-lite, from-lite, build, sync, df, fsck, serve, diff, patch\n");
+		printf("File:     (if applicable)\n\n");
+		printf("Options:  --order=disk|directory  order for multi-file reads (default disk)\n");
+		printf("          --stream                drop copied data from the page cache\n");
+		printf("          --durability=none|batch|strict  when changes are flushed (default none)\n");
+		printf("          --block-size=size       block size for initialize and format, 4K to 2M\n");
+		printf("          --watch                 keep syncing as files change (Linux)\n");
+		printf("          --json                  print the df report as JSON\n");
+		printf("          --deep                  fsck also reads the data of every file\n");
+		printf("          --repair                fsck repairs the directory\n");
+		printf("          --jobs=n                number of fsck --deep, diff and patch workers (default 4)\n");
+		printf("          --socket=path           socket for serve (default disk.sock)\n");
+		printf("          --stats[=text|json]     report time, I/O and memory use to stderr\n");
+		printf("          --trace=file            record a Chrome trace of phases, files and I/O\n");
+		printf("          --trace-sample=n        keep one in n block I/O spans in the trace\n");
 		exit(EXIT_SUCCESS);
 	}
 	else if (argc == 2)
@@ -90,6 +267,21 @@ int main(int argc, char *argv[])
 		filename = (argc > 3 ? argv[3] : NULL);
 	}
 
+	if (tracePath != NULL)
+	{
+		if (bmfs_trace_start(tracePath, "bmfs", traceSample) != 0)
+		{
+			printf("bmfs error: Unable to create trace file '%s'\n", tracePath);
+			exit(EXIT_FAILURE);
+		}
+		atexit(bmfs_trace_stop);
+	}
+	if (bmfsStats.Mode != BMFS_STATS_OFF)
+		atexit(bmfs_stats_report);
+	bmfs_stats_phase("open");
+
+	bmfs_profile_load(diskname);
+
 	if (argc > 2 && strcasecmp(s_initialize, command) == 0)
 	{
 		if (argc >= 4)
@@ -110,21 +302,65 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ((disk = fopen(diskname, "r+b")) == NULL)			// Open for read/write in binary mode
+	if (argc > 2 && strcasecmp(s_build, command) == 0)
+	{
+		if (argc >= 4)
+		{
+			exit(bmfs_build(diskname, argv[3]));
+		}
+		else
+		{
+			printf("Usage: bmfs disk %s manifest_file\n", command);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Commands that only look at the disk open it read-only so any number of
+	// them can share it, even when the image itself is read-only
+	readonly = (strcasecmp(s_list, command) == 0 || strcasecmp(s_df, command) == 0 || (strcasecmp(s_fsck, command) == 0 && !fsckRepair) || strcasecmp(s_read, command) == 0 || strcasecmp(s_extract, command) == 0 || strcasecmp(s_to_lite, command) == 0 || strcasecmp(s_diff, command) == 0);
+
+	if ((disk = bmfs_disk_open(diskname, (readonly ? "rb" : "r+b"))) == NULL)	// Open in binary mode
 	{
-		printf("bmfs error: Unable to open disk '%s'\n", diskname);
 		exit(EXIT_FAILURE);
 	}
 	else								// Opened ok, is it a valid BMFS disk?
 	{
+		unsigned long long bytes, size = 0;
+
 		fseek(disk, 0, SEEK_END);
-		disksize = ftell(disk) / 1048576;			// Disk size in MiB
+#ifdef _WIN32
+		bytes = _ftelli64(disk);
+#else
+		bytes = ftello(disk);
+#endif
+		disksize = bytes / 1048576;				// Disk size in MiB
+		if (bmfs_lock_directory(BMFS_LOCK_READ) != 0)		// Hold the metadata while it is loaded
+		{
+			fclose(disk);
+			exit(EXIT_FAILURE);
+		}
 		fseek(disk, 1024, SEEK_SET);				// Seek 1KiB in for disk information
 		retval = fread(DiskInfo, 512, 1, disk);			// Read 512 bytes to the DiskInfo buffer
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		retval = fread(Directory, 4096, 1, disk);		// Read 4096 bytes to the Directory buffer
+		bmfsStats.ImageReads++;
+		bmfsStats.ImageRead += 512;
+		retval = bmfs_load_directory();				// Read the directory, including any extended blocks
+		bmfs_lock_directory(BMFS_UNLOCK);
 		rewind(disk);
 
+		// The block size of the disk is used unless it is being reformatted
+		memcpy(&size, DiskInfo + DISKINFO_BLOCK_SIZE, 8);
+		if (strcasecmp(DiskInfo, fs_tag) == 0 && size != 0 && !(blockSizeOption && strcasecmp(s_format, command) == 0))
+		{
+			if (size < minimumBlockSize || size > defaultBlockSize || (size & (size - 1)) != 0)
+			{
+				printf("bmfs error: Unsupported block size %llu.\n", size);
+				fclose(disk);
+				exit(EXIT_FAILURE);
+			}
+			blockSize = size;
+		}
+		bmfs_geometry(bytes);
+
 		if (strcasecmp(DiskInfo, fs_tag) != 0)			// Is it a BMFS formatted disk?
 		{
 			if (strcasecmp(s_format, command) == 0)
@@ -136,14 +372,63 @@ int main(int argc, char *argv[])
 				printf("bmfs error: Not a valid BMFS drive (Disk is not BMFS formatted).\n");
 			}
 			fclose(disk);
-			return 0;
+			return (strcasecmp(s_fsck, command) == 0 ? 4 : 0);
 		}
 	}
 
+	if (streamMode)
+		cachebefore = bmfs_page_cache();
+
+	bmfs_stats_phase("command");
 	if (strcasecmp(s_list, command) == 0)
 	{
 		bmfs_list();
 	}
+	else if (strcasecmp(s_df, command) == 0)
+	{
+		bmfs_df();
+	}
+	else if (strcasecmp(s_fsck, command) == 0)
+	{
+		status = bmfs_fsck();
+	}
+	else if (strcasecmp(s_serve, command) == 0)
+	{
+		if (socketPath != NULL)
+		{
+			bmfs_serve(socketPath);
+		}
+		else if ((socketPath = bmfs_stats_malloc(strlen(diskname) + 6)) != NULL)
+		{
+			sprintf(socketPath, "%s.sock", diskname);
+			bmfs_serve(socketPath);
+			free(socketPath);
+		}
+	}
+	else if (strcasecmp(s_diff, command) == 0)
+	{
+		if (argc > 4)
+		{
+			status = bmfs_diff(argv[3], argv[4]);
+		}
+		else
+		{
+			printf("Usage: bmfs disk %s new_disk patch_file\n", command);
+			status = 1;
+		}
+	}
+	else if (strcasecmp(s_patch, command) == 0)
+	{
+		if (argc > 3)
+		{
+			status = bmfs_patch(argv[3]);
+		}
+		else
+		{
+			printf("Usage: bmfs disk %s patch_file\n", command);
+			status = 1;
+		}
+	}
 	else if (strcasecmp(s_format, command) == 0)
 	{
 		if (argc > 3)
@@ -176,6 +461,7 @@ int main(int argc, char *argv[])
 				if (filesize >= 1)
 				{
 					bmfs_create(filename, filesize);
+					bmfs_commit_metadata();
 				}
 				else
 				{
@@ -188,7 +474,10 @@ int main(int argc, char *argv[])
 				if (fgets(tempstring, 32, stdin) != NULL)	// Get up to 32 chars from the keyboard
 					filesize = atoi(tempstring);
 				if (filesize >= 1)
+				{
 					bmfs_create(filename, filesize);
+					bmfs_commit_metadata();
+				}
 				else
 					printf("bmfs error: Invalid file size.\n");
 			}
@@ -196,140 +485,943 @@ int main(int argc, char *argv[])
 	}
 	else if (strcasecmp(s_read, command) == 0)
 	{
-		bmfs_read(filename);
+		if (argc > 4)
+			bmfs_read_many(argv + 3, argc - 3);
+		else
+			bmfs_read(filename);
+	}
+	else if (strcasecmp(s_extract, command) == 0)
+	{
+		bmfs_read_many(NULL, 0);
 	}
 	else if (strcasecmp(s_write, command) == 0)
 	{
-		bmfs_write(filename);
+		if (argc > 4)
+			bmfs_write_many(argv + 3, argc - 3, NULL);
+		else
+			bmfs_write(filename);
+	}
+	else if (strcasecmp(s_to_lite, command) == 0 || strcasecmp(s_from_lite, command) == 0)
+	{
+		if (filename == NULL)
+		{
+			printf("Usage: bmfs disk %s lite_disk [file ...]\n", command);
+		}
+		else if (strcasecmp(s_to_lite, command) == 0)
+		{
+			bmfs_to_lite(filename, (argc > 4 ? argv + 4 : NULL), argc - 4);
+		}
+		else
+		{
+			bmfs_from_lite(filename, (argc > 4 ? argv + 4 : NULL), argc - 4);
+		}
+	}
+	else if (strcasecmp(s_sync, command) == 0)
+	{
+		if (filename == NULL)
+			printf("Usage: bmfs disk %s host_directory\n", command);
+		else
+			bmfs_sync_host(filename);
 	}
 	else if (strcasecmp(s_delete, command) == 0)
 	{
 		bmfs_delete(filename);
+		bmfs_commit_metadata();
+	}
+	else if (strcasecmp(s_extend, command) == 0)
+	{
+		bmfs_extend();
+	}
+	else if (strcasecmp(s_tune, command) == 0)
+	{
+		if (argc > 3)
+		{
+			int scratchsize = atoi(argv[3]);
+			if (scratchsize >= 2)
+			{
+				status = bmfs_tune(scratchsize);
+			}
+			else
+			{
+				printf("bmfs error: Invalid scratch size.\n");
+				status = 1;
+			}
+		}
+		else
+		{
+			status = bmfs_tune(tuneScratchSize);
+		}
 	}
 	else
 	{
 		printf("bmfs error: Unknown command\n");
 	}
 
+	if (streamMode && cachebefore >= 0)
+	{
+		long long cacheafter = bmfs_page_cache();
+		printf("Page cache: %lld MiB before, %lld MiB after (%+lld MiB)\n", cachebefore / 1048576, cacheafter / 1048576, (cacheafter - cachebefore) / 1048576);
+	}
+
+	if (durabilityReport)
+	{
+		printf("Durability: %s, %u fsyncs, %.3f ms", (durabilityMode == DURABILITY_STRICT ? "strict" : (durabilityMode == DURABILITY_BATCH ? "batch" : "none")), syncCount, syncTime * 1000);
+		if (syncCount > 0)
+			printf(" (%.3f ms each)", syncTime * 1000 / syncCount);
+		printf("\n");
+	}
+
+	bmfs_stats_phase("close");
+	if ((bmfs_disk_report() != 0 || lockFailed) && status == 0)
+		status = 1;
 	if (disk != NULL)
 	{
 		fclose( disk );
 		disk = NULL;
+		diskStripe = NULL;
 	}
 
-	return 0;
+	return status;
 }
 
 
-int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
+// Strip the global --name=value options out of the argument list
+// Returns the new argument count, or -1 if an option was not valid
+int bmfs_options(int argc, char *argv[])
 {
-	int tint;
+	int tint, count = 1;
 
-	for (tint = 0; tint < 64; tint++)
+	for (tint = 1; tint < argc; tint++)
 	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory
+		if (strncmp(argv[tint], "--", 2) != 0)
+		{
+			argv[count++] = argv[tint];
+		}
+		else if (strcmp(argv[tint], "--order=disk") == 0)
+		{
+			readOrder = ORDER_DISK;
+		}
+		else if (strcmp(argv[tint], "--order=directory") == 0)
 		{
-			tint = 64;
+			readOrder = ORDER_DIRECTORY;
 		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
+		else if (strcmp(argv[tint], "--stream") == 0)
 		{
-			// Ignore
+			streamMode = 1;
 		}
-		else							// Valid entry
+		else if (strncmp(argv[tint], "--durability=", 13) == 0)
 		{
-			if (strcmp(filename, entry.FileName) == 0)
+			if (strcmp(argv[tint] + 13, "none") == 0)
+				durabilityMode = DURABILITY_NONE;
+			else if (strcmp(argv[tint] + 13, "batch") == 0)
+				durabilityMode = DURABILITY_BATCH;
+			else if (strcmp(argv[tint] + 13, "strict") == 0)
+				durabilityMode = DURABILITY_STRICT;
+			else
 			{
-				memcpy(fileentry, pentry, 64);
-				*entrynumber = tint;
-				return 1;
+				printf("bmfs error: Unknown durability mode '%s'\n", argv[tint] + 13);
+				return -1;
+			}
+			durabilityReport = 1;
+		}
+		else if (strcmp(argv[tint], "--watch") == 0)
+		{
+			syncWatch = 1;
+		}
+		else if (strcmp(argv[tint], "--json") == 0)
+		{
+			jsonOutput = 1;
+		}
+		else if (strncmp(argv[tint], "--socket=", 9) == 0)
+		{
+			socketPath = argv[tint] + 9;
+		}
+		else if (strcmp(argv[tint], "--socket") == 0 && tint + 1 < argc)
+		{
+			socketPath = argv[++tint];
+		}
+		else if (strcmp(argv[tint], "--deep") == 0)
+		{
+			fsckDeep = 1;
+		}
+		else if (strcmp(argv[tint], "--repair") == 0)
+		{
+			fsckRepair = 1;
+		}
+		else if (strncmp(argv[tint], "--jobs=", 7) == 0)
+		{
+			workerJobs = atoi(argv[tint] + 7);
+			if (workerJobs < 1)
+			{
+				printf("bmfs error: Number of jobs must be at least 1\n");
+				return -1;
+			}
+		}
+		else if (strcmp(argv[tint], "--stats") == 0)
+		{
+			bmfs_stats_start("text");
+		}
+		else if (strncmp(argv[tint], "--trace=", 8) == 0)
+		{
+			tracePath = argv[tint] + 8;
+		}
+		else if (strcmp(argv[tint], "--trace") == 0 && tint + 1 < argc)
+		{
+			tracePath = argv[++tint];
+		}
+		else if (strncmp(argv[tint], "--trace-sample=", 15) == 0)
+		{
+			traceSample = strtoull(argv[tint] + 15, NULL, 10);
+			if (traceSample == 0)
+			{
+				printf("bmfs error: Trace sample must be at least 1\n");
+				return -1;
+			}
+		}
+		else if (strncmp(argv[tint], "--stats=", 8) == 0)
+		{
+			if (bmfs_stats_start(argv[tint] + 8) != 0)
+			{
+				printf("bmfs error: Unknown statistics format '%s'\n", argv[tint] + 8);
+				return -1;
+			}
+		}
+		else if (strncmp(argv[tint], "--block-size=", 13) == 0)
+		{
+			char *unit;
+			unsigned long long size = strtoull(argv[tint] + 13, &unit, 10);
+			if (toupper(*unit) == 'K')
+				size *= 1024;
+			else if (toupper(*unit) == 'M')
+				size *= 1024 * 1024;
+			if (size < minimumBlockSize || size > defaultBlockSize || (size & (size - 1)) != 0)
+			{
+				printf("bmfs error: Block size must be a power of two from 4K to 2M\n");
+				return -1;
 			}
+			blockSize = size;
+			blockSizeOption = 1;
+		}
+		else
+		{
+			printf("bmfs error: Unknown option '%s'\n", argv[tint]);
+			return -1;
 		}
 	}
-	return 0;
+	argv[count] = NULL;
+	return count;
 }
 
 
-void bmfs_list(void)
+int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
 {
-	int tint;
+	int slot = bmfs_dir_find(&dir, filename);
+
+	if (slot < 0)
+		return 0;
+	memcpy(fileentry, dir.Entries + slot * 64, 64);
+	*entrynumber = slot;
+	return 1;
+}
 
+
+void bmfs_list(void)
+{
 	printf("Disk Size: %d MiB\n", disksize);
-	printf("Name                            |            Size (B)|      Reserved (MiB)\n");
+	if (blockSize != defaultBlockSize)
+	{
+		printf("Block Size: %u KiB\n", blockSize / 1024);
+		printf("Name                            |            Size (B)|      Reserved (KiB)\n");
+	}
+	else
+	{
+		printf("Name                            |            Size (B)|      Reserved (MiB)\n");
+	}
 	printf("==========================================================================\n");
-	for (tint = 0; tint < 64; tint++)				// Max 64 entries
+	bmfs_dir_print(&dir, stdout, (blockSize != defaultBlockSize ? blockSize / 1024 : 2));
+}
+
+
+// Report how the data blocks are used, how the free space is split up, and
+// how much of each file's reservation is unused
+void bmfs_df(void)
+{
+	struct BMFSSpace space;
+	struct BMFSEntry *pEntry;
+	unsigned long long reserved, slack;
+	double fragmentation;
+	char range[48];
+	unsigned int tint, count = 0;
+
+	if (bmfs_dir_space(&dir, firstDataBlock, lastDataBlock, blockSize, &space) != 0)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return;
+	}
+	// 0 when all free space is in one extent, towards 1 as it is split up
+	fragmentation = (space.Free > 0 ? 1.0 - (double)space.Largest / space.Free : 0);
+
+	if (jsonOutput)
+	{
+		printf("{\"disk_size\": %llu, \"block_size\": %u, ", diskBlocks * blockSize, blockSize);
+		printf("\"blocks\": {\"total\": %llu, \"used\": %llu, \"reserved_unwritten\": %llu, \"free\": %llu}, ", (unsigned long long)space.Total, (unsigned long long)space.Written, (unsigned long long)(space.Reserved - space.Written), (unsigned long long)space.Free);
+		printf("\"largest_free_extent\": %llu, \"free_extents\": %llu, \"fragmentation\": %.4f, \"histogram\": [", (unsigned long long)space.Largest, (unsigned long long)space.Extents, fragmentation);
+		for (tint = 0; tint < BMFS_SPACE_BINS; tint++)
+		{
+			if (space.Bins[tint] != 0)
+				printf("%s{\"min_blocks\": %llu, \"max_blocks\": %llu, \"count\": %llu}", (count++ ? ", " : ""), 1ULL << tint, (2ULL << tint) - 1, (unsigned long long)space.Bins[tint]);
+		}
+		printf("], \"files\": [");
+		count = 0;
+	}
+	else
 	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory, bail out
+		printf("Disk Size: %d MiB\n", disksize);
+		printf("Block Size: %u KiB\n", blockSize / 1024);
+		printf("%-24s %12s %20s\n", "Blocks", "Count", "Bytes");
+		printf("%-24s %12llu %20llu\n", "Total", (unsigned long long)space.Total, (unsigned long long)space.Total * blockSize);
+		printf("%-24s %12llu %20llu\n", "Used", (unsigned long long)space.Written, (unsigned long long)space.Written * blockSize);
+		printf("%-24s %12llu %20llu\n", "Reserved, unwritten", (unsigned long long)(space.Reserved - space.Written), (unsigned long long)(space.Reserved - space.Written) * blockSize);
+		printf("%-24s %12llu %20llu\n", "Free", (unsigned long long)space.Free, (unsigned long long)space.Free * blockSize);
+		printf("%-24s %12llu %20llu\n", "Largest free extent", (unsigned long long)space.Largest, (unsigned long long)space.Largest * blockSize);
+		printf("Fragmentation: %.4f (%llu free extents)\n\n", fragmentation, (unsigned long long)space.Extents);
+		printf("%-24s %12s\n", "Free extent (blocks)", "Count");
+		for (tint = 0; tint < BMFS_SPACE_BINS; tint++)
 		{
-			tint = 64;
+			if (space.Bins[tint] != 0)
+			{
+				sprintf(range, (tint == 0 ? "%llu" : "%llu-%llu"), 1ULL << tint, (2ULL << tint) - 1);
+				printf("%-24s %12llu\n", range, (unsigned long long)space.Bins[tint]);
+			}
 		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
+		printf("\nName                            |            Size (B)|        Reserved (B)|           Slack (B)\n");
+		printf("===============================================================================================\n");
+	}
+
+	for (tint = 0; tint < dir.Count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + tint * 64);
+		if (pEntry->FileName[0] == 0x00)			// End of directory
+			break;
+		if (pEntry->FileName[0] == 0x01)			// Unused entry
+			continue;
+		reserved = pEntry->ReservedBlocks * blockSize;
+		slack = (reserved > pEntry->FileSize ? reserved - pEntry->FileSize : 0);
+		if (jsonOutput)
 		{
-			// Ignore
+			printf("%s{\"name\": ", (count++ ? ", " : ""));
+			bmfs_json_string(stdout, pEntry->FileName);
+			printf(", \"size\": %llu, \"reserved\": %llu, \"slack\": %llu}", (unsigned long long)pEntry->FileSize, reserved, slack);
 		}
-		else							// Valid entry
+		else
 		{
-			printf("%-32s %20lld %20lld\n", entry.FileName, (long long int)entry.FileSize, (long long int)(entry.ReservedBlocks*2));
+			printf("%-32s %20llu %20llu %20llu\n", pEntry->FileName, (unsigned long long)pEntry->FileSize, reserved, slack);
 		}
 	}
+	if (jsonOutput)
+		printf("]}\n");
 }
 
 
-void bmfs_format(void)
+// A range of file data for the deep check to read
+struct BMFSFsckPiece
 {
-	memset(DiskInfo, 0, 512);
-	memset(Directory, 0, 4096);
-	memcpy(DiskInfo, fs_tag, 4);					// Add the 'BMFS' tag
-	fseek(disk, 1024, SEEK_SET);					// Seek 1KiB in for disk information
-	fwrite(DiskInfo, 512, 1, disk);					// Write 512 bytes for the DiskInfo
-	fseek(disk, 4096, SEEK_SET);					// Seek 4KiB in for directory
-	fwrite(Directory, 4096, 1, disk);				// Write 4096 bytes for the Directory
+	int file;			// Index into the list of files
+	unsigned long long offset;	// Byte offset in the file
+	unsigned long long length;
+};
+
+// A file checked by fsck --deep
+struct BMFSFsckFile
+{
+	int slot;
+	unsigned long long start;	// Byte offset of the file on the disk
+	unsigned long long size;	// FileSize
+	int unreadable;
+	int padding;			// Nonzero bytes after FileSize in the last block
+};
+
+// Work shared by the deep check workers
+struct BMFSFsckScan
+{
+	struct BMFSFsckFile *files;
+	struct BMFSFsckPiece *pieces;
+	int count;			// Number of pieces
+	int next;			// Next piece to hand out
+	unsigned long long bytes;	// Bytes and calls read by all workers
+	unsigned long long reads;
+	unsigned long long allocations;	// Buffers of all workers, counted once they finish
+	unsigned long long allocated;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+#endif
+};
+
+
+// Report a problem found by fsck and whether it was repaired
+static void bmfs_fsck_problem(int slot, const char *problem, int repaired, int *found, int *fixed)
+{
+	if (slot >= 0)
+		printf("Entry %d: %s%s\n", slot, problem, (repaired ? " (repaired)" : ""));
+	else
+		printf("%s%s\n", problem, (repaired ? " (repaired)" : ""));
+	(*found)++;
+	if (repaired)
+		(*fixed)++;
 }
 
 
-int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel)
+// Read pieces of file data until there are none left, checking that they
+// can be read and that the bytes after the end of each file are zero
+static void *bmfs_fsck_worker(void *arg)
 {
-	unsigned long long diskSize = 0;
-	unsigned long long writeSize = 0;
-	const char *bootFileType = NULL;
-	size_t bufferSize = 50 * 1024;
-	char * buffer = NULL;
-	FILE *mbrFile = NULL;
-	FILE *bootFile = NULL;
-	FILE *kernelFile = NULL;
-	int diskSizeFactor = 0;
-	size_t chunkSize = 0;
-	int ret = 0;
-	size_t i;
+	struct BMFSFsckScan *scan = arg;
+	struct BMFSFsckPiece *piece;
+	struct BMFSFsckFile *file;
+	unsigned long long done, chunk, position, bytes = 0, reads = 0, tint;
+	char *buffer;
+	int index, unreadable, padding;
 
-	// Determine how the second file will be described in output messages.
-	// If a kernel file is specified too, then assume the second file is the
-	// boot loader.  If no kernel file is specified, assume the boot loader
-	// and kernel are combined into one system file.
-	if (boot != NULL)
+	// bmfsStats is not shared between threads, so this is counted later
+	buffer = malloc(readChunkSize);
+	while (buffer != NULL)
 	{
-		bootFileType = "boot loader";
-		if (kernel == NULL)
+#ifndef _WIN32
+		pthread_mutex_lock(&scan->mutex);
+#endif
+		index = scan->next++;
+#ifndef _WIN32
+		pthread_mutex_unlock(&scan->mutex);
+#endif
+		if (index >= scan->count)
+			break;
+		piece = &scan->pieces[index];
+		file = &scan->files[piece->file];
+		unreadable = padding = 0;
+		for (done = 0; done < piece->length && !unreadable; done += chunk)
 		{
-			bootFileType = "system";
+			chunk = piece->length - done;
+			if (chunk > readChunkSize)
+				chunk = readChunkSize;
+#ifdef _WIN32
+			unreadable = (bmfs_disk_read(buffer, chunk, file->start + piece->offset + done) != 0);
+#else
+			if (diskStripe != NULL)
+				unreadable = (bmfs_stripe_io(diskStripe, buffer, chunk, file->start + piece->offset + done, 0) != 0);
+			else
+				unreadable = (pread(fileno(disk), buffer, chunk, file->start + piece->offset + done) != (ssize_t)chunk);
+#endif
+			bytes += chunk;
+			reads++;
+			// Only the last block of a file has bytes past FileSize
+			position = piece->offset + done;
+			if (!unreadable && position + chunk > file->size)
+			{
+				for (tint = (file->size > position ? file->size - position : 0); tint < chunk && !padding; tint++)
+					padding = (buffer[tint] != 0);
+			}
 		}
+#ifndef _WIN32
+		pthread_mutex_lock(&scan->mutex);
+#endif
+		file->unreadable |= unreadable;
+		file->padding |= padding;
+#ifndef _WIN32
+		pthread_mutex_unlock(&scan->mutex);
+#endif
 	}
+#ifndef _WIN32
+	pthread_mutex_lock(&scan->mutex);
+#endif
+	scan->bytes += bytes;
+	scan->reads += reads;
+	scan->allocations++;
+	scan->allocated += readChunkSize;
+#ifndef _WIN32
+	pthread_mutex_unlock(&scan->mutex);
+#endif
+	free(buffer);
+	return NULL;
+}
 
-	// Validate the disk size string and convert it to an integer value.
-	for (i = 0; size[i] != '\0' && ret == 0; ++i)
+
+// Read the data of every file with a number of workers
+// Returns the number of files with problems, or -1 if it could not run
+static int bmfs_fsck_deep(int *found)
+{
+	struct BMFSFsckScan scan;
+	struct BMFSEntry *pEntry;
+	unsigned long long length, offset, pieceSize = 64 * 1024 * 1024;
+	double start = bmfs_time(), elapsed;
+	int filecount = 0, jobs = workerJobs, bad = 0, tint;
+#ifndef _WIN32
+	pthread_t *threads;
+#endif
+
+	memset(&scan, 0, sizeof(scan));
+	if (bmfs_dir_extents(&dir) != 0)
+		return -1;
+	scan.files = bmfs_stats_malloc((dir.ExtentCount + 1) * sizeof(struct BMFSFsckFile));
+	// Large files are split so the workers share them
+	scan.count = 0;
+	for (tint = 0; tint < (int)dir.ExtentCount; tint++)
 	{
-		char ch = size[i];
-		if (isdigit(ch))
+		pEntry = (struct BMFSEntry *)(dir.Entries + dir.ExtentIndex[tint] * 64);
+		scan.count += (int)(((pEntry->FileSize + blockSize - 1) / blockSize * blockSize + pieceSize - 1) / pieceSize);
+	}
+	scan.pieces = bmfs_stats_malloc((scan.count + 1) * sizeof(struct BMFSFsckPiece));
+	if (scan.files == NULL || scan.pieces == NULL)
+	{
+		free(scan.files);
+		free(scan.pieces);
+		return -1;
+	}
+
+	// Hand out the pieces in disk order so the workers sweep the disk together
+	scan.count = 0;
+	for (tint = 0; tint < (int)dir.ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + dir.ExtentIndex[tint] * 64);
+		scan.files[filecount].slot = dir.ExtentIndex[tint];
+		scan.files[filecount].start = pEntry->StartingBlock * blockSize;
+		scan.files[filecount].size = pEntry->FileSize;
+		scan.files[filecount].unreadable = 0;
+		scan.files[filecount].padding = 0;
+		length = (pEntry->FileSize + blockSize - 1) / blockSize * blockSize;
+		for (offset = 0; offset < length; offset += pieceSize)
 		{
-			unsigned int n = ch - '0';
-			if (diskSize * 10 > diskSize ) // Make sure we don't overflow
-			{
-				diskSize *= 10;
-				diskSize += n;
-			}
-			else if (diskSize == 0) // First loop iteration
-			{
+			scan.pieces[scan.count].file = filecount;
+			scan.pieces[scan.count].offset = offset;
+			scan.pieces[scan.count].length = (length - offset < pieceSize ? length - offset : pieceSize);
+			scan.count++;
+		}
+		filecount++;
+	}
+
+#ifdef _WIN32
+	jobs = 1;
+	bmfs_fsck_worker(&scan);
+#else
+	fflush(disk);
+#ifdef __linux__
+	posix_fadvise(fileno(disk), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if (jobs > scan.count)
+		jobs = (scan.count > 0 ? scan.count : 1);
+	pthread_mutex_init(&scan.mutex, NULL);
+	threads = bmfs_stats_malloc(jobs * sizeof(pthread_t));
+	for (tint = 0; threads != NULL && tint < jobs; tint++)
+	{
+		if (pthread_create(&threads[tint], NULL, bmfs_fsck_worker, &scan) != 0)
+			break;
+	}
+	if (threads == NULL || tint == 0)
+		bmfs_fsck_worker(&scan);
+	jobs = (threads == NULL || tint == 0 ? 1 : tint);
+	while (threads != NULL && tint-- > 0)
+		pthread_join(threads[tint], NULL);
+	free(threads);
+	pthread_mutex_destroy(&scan.mutex);
+	bmfsStats.ImageReads += scan.reads;
+	bmfsStats.ImageRead += scan.bytes;
+#endif
+	bmfsStats.Allocations += scan.allocations;
+	bmfsStats.AllocatedBytes += scan.allocated;
+
+	for (tint = 0; tint < filecount; tint++)
+	{
+		if (scan.files[tint].unreadable)
+			printf("File '%s': data could not be read\n", dir.Entries + scan.files[tint].slot * 64);
+		if (scan.files[tint].padding)
+			printf("File '%s': bytes after the end of the file are not zero\n", dir.Entries + scan.files[tint].slot * 64);
+		if (scan.files[tint].unreadable || scan.files[tint].padding)
+			bad++;
+	}
+	elapsed = bmfs_time() - start;
+	printf("Read %llu MiB of data from %d files with %d workers in %.3f seconds (%.1f MiB/s)\n", scan.bytes / 1048576, filecount, jobs, elapsed, (elapsed > 0 ? scan.bytes / 1048576.0 / elapsed : 0));
+	*found += bad;
+	free(scan.files);
+	free(scan.pieces);
+	return bad;
+}
+
+
+// Check the directory against the disk, and with --deep the file data too
+// Entries are checked as if the earlier problems were repaired, so the deep
+// check only reads data inside the disk
+// Returns 0 if the disk is clean, 1 if every problem was repaired, 4 if
+// problems are left, or 8 if the directory could not be locked for repairs
+int bmfs_fsck(void)
+{
+	struct BMFSEntry *pEntry, *pPrev;
+	unsigned long long offset = 0, blocks = 0, written, prevEnd;
+	unsigned int tint, end;
+	int found = 0, fixed = 0, changed = 0, prev;
+	char *stale;
+
+	// Repairs work on the directory as it is once no one else can change it
+	if (fsckRepair)
+	{
+		if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+			return 8;
+		bmfs_disk_read(DiskInfo, 512, 1024);
+		bmfs_load_directory();
+	}
+
+	// The extended directory is ignored if its header does not make sense
+	memcpy(&offset, DiskInfo + DISKINFO_EXTENDED_OFFSET, 8);
+	memcpy(&blocks, DiskInfo + DISKINFO_EXTENDED_BLOCKS, 8);
+	if ((offset != 0 || blocks != 0) && (offset != extendedDirectoryOffset || blocks > maxExtendedBlocks))
+		bmfs_fsck_problem(-1, "Extended directory header is not valid", 0, &found, &fixed);
+
+	// Each entry on its own
+	end = dir.Count;
+	for (tint = 0; tint < dir.Count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + tint * 64);
+		if (pEntry->FileName[0] == 0x00)			// End of directory
+		{
+			end = tint;
+			break;
+		}
+		if (pEntry->FileName[0] == 0x01)			// Unused entry
+			continue;
+		if (memchr(pEntry->FileName, 0, 32) == NULL)
+		{
+			bmfs_fsck_problem(tint, "File name is not terminated", fsckRepair, &found, &fixed);
+			pEntry->FileName[0] = 0x01;
+			changed = 1;
+			continue;
+		}
+		if (pEntry->StartingBlock < firstDataBlock || pEntry->StartingBlock >= lastDataBlock)
+		{
+			bmfs_fsck_problem(tint, "Starts outside the data area of the disk", fsckRepair, &found, &fixed);
+			pEntry->FileName[0] = 0x01;
+			changed = 1;
+			continue;
+		}
+		if (pEntry->ReservedBlocks > lastDataBlock - pEntry->StartingBlock)
+		{
+			bmfs_fsck_problem(tint, "Reservation runs past the end of the disk", fsckRepair, &found, &fixed);
+			pEntry->ReservedBlocks = lastDataBlock - pEntry->StartingBlock;
+			changed = 1;
+		}
+		if (pEntry->FileSize > pEntry->ReservedBlocks * blockSize)
+		{
+			bmfs_fsck_problem(tint, "File size is larger than its reservation", fsckRepair, &found, &fixed);
+			pEntry->FileSize = pEntry->ReservedBlocks * blockSize;
+			pEntry->Unused = 0;
+			changed = 1;
+		}
+	}
+
+	// Anything after the end marker would come back as entries when the
+	// marker moves, so that space must be zero
+	for (tint = end + 1; tint < dir.Count; tint++)
+	{
+		for (stale = dir.Entries + tint * 64; stale < dir.Entries + tint * 64 + 64 && *stale == 0; stale++)
+			;
+		if (stale < dir.Entries + tint * 64 + 64)
+		{
+			bmfs_fsck_problem(tint, "Data after the end of directory marker", fsckRepair, &found, &fixed);
+			memset(dir.Entries + tint * 64, 0, 64);
+			changed = 1;
+		}
+	}
+
+	// Names must be unique, the index finds the first of a name
+	bmfs_dir_drop(&dir);
+	for (tint = 0; tint < end; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + tint * 64);
+		if (pEntry->FileName[0] != 0x01 && bmfs_dir_find(&dir, pEntry->FileName) != (int)tint)
+		{
+			bmfs_fsck_problem(tint, "File name is used by an earlier entry", fsckRepair, &found, &fixed);
+			pEntry->FileName[0] = 0x01;
+			changed = 1;
+		}
+	}
+
+	// Reservations must not overlap, checked in order of starting block
+	bmfs_dir_drop(&dir);
+	if (bmfs_dir_extents(&dir) != 0)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return 4;
+	}
+	prev = -1;
+	prevEnd = 0;
+	for (tint = 0; tint < dir.ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + dir.ExtentIndex[tint] * 64);
+		if (prev >= 0 && pEntry->StartingBlock < prevEnd)
+		{
+			// Shrink the earlier file if its data ends before this one,
+			// otherwise drop this one
+			pPrev = (struct BMFSEntry *)(dir.Entries + prev * 64);
+			written = (pPrev->FileSize + blockSize - 1) / blockSize;
+			bmfs_fsck_problem(dir.ExtentIndex[tint], "Overlaps the reservation of an earlier file", fsckRepair, &found, &fixed);
+			changed = 1;
+			if (pPrev->StartingBlock + written <= pEntry->StartingBlock)
+			{
+				pPrev->ReservedBlocks = pEntry->StartingBlock - pPrev->StartingBlock;
+			}
+			else
+			{
+				pEntry->FileName[0] = 0x01;
+				continue;
+			}
+		}
+		if (prev < 0 || pEntry->StartingBlock + pEntry->ReservedBlocks > prevEnd)
+		{
+			prev = dir.ExtentIndex[tint];
+			prevEnd = pEntry->StartingBlock + pEntry->ReservedBlocks;
+		}
+	}
+	bmfs_dir_drop(&dir);
+
+	if (fsckRepair && changed)
+	{
+		bmfs_disk_write(dir.Entries, 4096, 4096);
+		if (ExtendedBlocks > 0)
+			bmfs_disk_write(dir.Entries + 4096, ExtendedBlocks * 4096, extendedDirectoryOffset);
+	}
+	if (fsckRepair)
+	{
+		bmfs_lock_directory(BMFS_UNLOCK);
+		if (changed)
+			bmfs_commit_metadata();
+	}
+
+	if (fsckDeep && bmfs_fsck_deep(&found) < 0)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return 4;
+	}
+
+	if (found == 0)
+	{
+		printf("No problems found.\n");
+		return 0;
+	}
+	printf("%d problem%s found, %d repaired.\n", found, (found == 1 ? "" : "s"), fixed);
+	return (fixed == found ? 1 : 4);
+}
+
+
+void bmfs_format(void)
+{
+	unsigned long long size;
+
+	if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+		return;
+	if (ExtendedBlocks > 0 && bmfs_directory_alloc(ExtendedBlocks) == 0)
+	{
+		// Clear the extended directory so it can be enabled again later
+		memset(dir.Entries + 4096, 0, ExtendedBlocks * 4096);
+		bmfs_disk_write(dir.Entries + 4096, ExtendedBlocks * 4096, extendedDirectoryOffset);
+	}
+	bmfs_directory_alloc(0);
+	memset(DiskInfo, 0, 512);
+	memset(dir.Entries, 0, 4096);
+	memcpy(DiskInfo, fs_tag, 4);					// Add the 'BMFS' tag
+	size = blockSize;
+	memcpy(DiskInfo + DISKINFO_BLOCK_SIZE, &size, 8);		// Record the block size
+	fseek(disk, 1024, SEEK_SET);					// Seek 1KiB in for disk information
+	fwrite(DiskInfo, 512, 1, disk);					// Write 512 bytes for the DiskInfo
+	fseek(disk, 4096, SEEK_SET);					// Seek 4KiB in for directory
+	fwrite(dir.Entries, 4096, 1, disk);				// Write 4096 bytes for the Directory
+	bmfsStats.ImageWrites += 2;
+	bmfsStats.ImageWritten += 512 + 4096;
+	bmfsStats.DirectoryWrites += 2;
+	bmfs_lock_directory(BMFS_UNLOCK);
+}
+
+
+// Size the in-memory directory for the legacy directory plus a number of
+// extended directory blocks
+static int bmfs_directory_alloc(unsigned int blocks)
+{
+	char *newdir;
+
+	newdir = bmfs_stats_realloc(dir.Entries, (1 + blocks) * 4096);
+	if (newdir == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for directory.\n");
+		return -1;
+	}
+	if (dir.Entries == NULL)
+		memset(newdir, 0, 4096);
+	if (blocks > ExtendedBlocks)
+		memset(newdir + (1 + ExtendedBlocks) * 4096, 0, (blocks - ExtendedBlocks) * 4096);
+	dir.Entries = newdir;
+	ExtendedBlocks = blocks;
+	dir.Count = 64 * (1 + blocks);
+	bmfs_dir_drop(&dir);
+	return 0;
+}
+
+
+// Read the directory from the disk, including any extended directory blocks
+// The indexes are only rebuilt if the directory has changed
+int bmfs_load_directory(void)
+{
+	unsigned long long offset = 0, blocks = 0;
+	char *fresh;
+	size_t size;
+
+	if (strcasecmp(DiskInfo, fs_tag) == 0)
+	{
+		memcpy(&offset, DiskInfo + DISKINFO_EXTENDED_OFFSET, 8);
+		memcpy(&blocks, DiskInfo + DISKINFO_EXTENDED_BLOCKS, 8);
+	}
+	if (offset != extendedDirectoryOffset || blocks > maxExtendedBlocks)
+		blocks = 0;
+
+	size = (1 + blocks) * 4096;
+	fresh = bmfs_stats_malloc(size);
+	if (fresh == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for directory.\n");
+		return -1;
+	}
+	memset(fresh, 0, size);
+	bmfs_disk_read(fresh, 4096, 4096);
+	if (blocks > 0)
+		bmfs_disk_read(fresh + 4096, blocks * 4096, extendedDirectoryOffset);
+
+	if (dir.Entries == NULL || blocks != ExtendedBlocks || memcmp(fresh, dir.Entries, size) != 0)
+	{
+		free(dir.Entries);
+		dir.Entries = fresh;
+		ExtendedBlocks = blocks;
+		dir.Count = 64 * (1 + blocks);
+		bmfs_dir_drop(&dir);
+	}
+	else
+	{
+		free(fresh);
+	}
+	return 0;
+}
+
+
+// Byte offset of a directory entry on the disk
+unsigned long long bmfs_entry_offset(int slot)
+{
+	if (slot < 64)
+		return 4096 + slot * 64;
+	return extendedDirectoryOffset + (unsigned long long)(slot - 64) * 64;
+}
+
+
+// Lock the disk information and the whole directory, including the space
+// the extended directory can grow into
+int bmfs_lock_directory(int type)
+{
+	return bmfs_lock(1024, extendedDirectoryOffset + maxExtendedBlocks * 4096 - 1024, type);
+}
+
+
+// Work out where data blocks can go on a disk of the given size
+void bmfs_geometry(unsigned long long bytes)
+{
+	volumeGeometry.BlockSize = blockSize;
+	diskBlocks = bytes / blockSize;
+	firstDataBlock = bmfs_first_block(&volumeGeometry);
+	lastDataBlock = bmfs_last_block(&volumeGeometry, bytes);
+}
+
+
+// Add another block to the extended directory
+static int bmfs_grow_directory(void)
+{
+	unsigned long long offset = 0, blocks;
+
+	memcpy(&offset, DiskInfo + DISKINFO_EXTENDED_OFFSET, 8);
+	if (offset != extendedDirectoryOffset || ExtendedBlocks >= maxExtendedBlocks)
+		return -1;
+	if (bmfs_directory_alloc(ExtendedBlocks + 1) != 0)
+		return -1;
+	blocks = ExtendedBlocks;
+	memcpy(DiskInfo + DISKINFO_EXTENDED_BLOCKS, &blocks, 8);
+	bmfs_disk_write(dir.Entries + ExtendedBlocks * 4096, 4096, extendedDirectoryOffset + (blocks - 1) * 4096);
+	bmfs_disk_write(DiskInfo, 512, 1024);
+	return 0;
+}
+
+
+// Enable the extended directory on a disk
+// The first 4KiB of the directory stays in the original format so the
+// BareMetal kernel can still read the first 64 files
+void bmfs_extend(void)
+{
+	unsigned long long offset = extendedDirectoryOffset, blocks = 0, tint;
+	char *region;
+
+	if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+		return;
+	bmfs_disk_read(DiskInfo, 512, 1024);
+	memcpy(&blocks, DiskInfo + DISKINFO_EXTENDED_OFFSET, 8);
+	if (blocks == extendedDirectoryOffset)
+	{
+		printf("bmfs error: Extended directory is already enabled.\n");
+		bmfs_lock_directory(BMFS_UNLOCK);
+		return;
+	}
+
+	// The space must not be in use by a boot loader or kernel
+	region = bmfs_stats_malloc(maxExtendedBlocks * 4096);
+	if (region == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		bmfs_lock_directory(BMFS_UNLOCK);
+		return;
+	}
+	bmfs_disk_read(region, maxExtendedBlocks * 4096, extendedDirectoryOffset);
+	for (tint = 0; tint < maxExtendedBlocks * 4096; tint++)
+	{
+		if (region[tint] != 0)
+		{
+			printf("bmfs error: Space for the extended directory is in use at offset %llu.\n", extendedDirectoryOffset + tint);
+			free(region);
+			bmfs_lock_directory(BMFS_UNLOCK);
+			return;
+		}
+	}
+	free(region);
+
+	blocks = 0;
+	memcpy(DiskInfo + DISKINFO_EXTENDED_OFFSET, &offset, 8);
+	memcpy(DiskInfo + DISKINFO_EXTENDED_BLOCKS, &blocks, 8);
+	bmfs_disk_write(DiskInfo, 512, 1024);
+	bmfs_lock_directory(BMFS_UNLOCK);
+	printf("Extended directory enabled, up to %u files.\n", 64 + maxExtendedBlocks * 64);
+}
+
+
+// Convert a size string like 128M to bytes
+// Returns 0 on success, 1 if the string is not valid
+int bmfs_parse_size(char *size, unsigned long long *result)
+{
+	unsigned long long diskSize = 0;
+	int diskSizeFactor = 0;
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; size[i] != '\0' && ret == 0; ++i)
+	{
+		char ch = size[i];
+		if (isdigit(ch))
+		{
+			unsigned int n = ch - '0';
+			if (diskSize * 10 > diskSize ) // Make sure we don't overflow
+			{
+				diskSize *= 10;
+				diskSize += n;
+			}
+			else if (diskSize == 0) // First loop iteration
+			{
 				diskSize += n;
 			}
 			else
@@ -396,6 +1488,40 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 		}
 	}
 
+	*result = diskSize;
+	return ret;
+}
+
+
+int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel)
+{
+	unsigned long long diskSize = 0;
+	unsigned long long writeSize = 0;
+	const char *bootFileType = NULL;
+	size_t bufferSize = initChunkSize;
+	char * buffer = NULL;
+	FILE *mbrFile = NULL;
+	FILE *bootFile = NULL;
+	FILE *kernelFile = NULL;
+	size_t chunkSize = 0;
+	int ret = 0;
+
+	// Determine how the second file will be described in output messages.
+	// If a kernel file is specified too, then assume the second file is the
+	// boot loader.  If no kernel file is specified, assume the boot loader
+	// and kernel are combined into one system file.
+	if (boot != NULL)
+	{
+		bootFileType = "boot loader";
+		if (kernel == NULL)
+		{
+			bootFileType = "system";
+		}
+	}
+
+	// Validate the disk size string and convert it to an integer value.
+	ret = bmfs_parse_size(size, &diskSize);
+
 	// Make sure the disk size is large enough.
 	if (ret == 0)
 	{
@@ -442,7 +1568,7 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	// Allocate buffer to use for filling the disk image with zeros.
 	if (ret == 0)
 	{
-		buffer = (char *) malloc(bufferSize);
+		buffer = (char *) bmfs_stats_malloc(bufferSize);
 		if (buffer == NULL)
 		{
 			printf("bmfs error: Failed to allocate buffer\n");
@@ -455,26 +1581,34 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	// actually write to the file.
 	if (ret == 0)
 	{
-		disk = fopen(diskname, "wb");
+		disk = bmfs_disk_open(diskname, "wb");
 		if (disk == NULL)
 		{
-			printf("bmfs error: Unable to open disk '%s'\n", diskname);
 			ret = 1;
 		}
 	}
 
 	// Fill the disk image with zeros.
+	bmfs_stats_phase("zero-fill");
 	if (ret == 0)
 	{
-		double percent;
+		double percent, shown = 0;
 		memset(buffer, 0, bufferSize);
 		writeSize = 0;
 		while (writeSize < diskSize)
 		{
-			percent = writeSize;
-			percent /= diskSize;
-			percent *= 100;
-			printf("Formatting disk: %llu of %llu bytes (%.0f%%)...\r", writeSize, diskSize, percent);
+			// At most twice a second, so the line is not redrawn for every chunk
+			if (writeSize == 0 || bmfs_time() - shown >= 0.5)
+			{
+				shown = bmfs_time();
+				percent = writeSize;
+				percent /= diskSize;
+				percent *= 100;
+				printf("Formatting disk: %llu of %llu bytes (%.0f%%)", writeSize, diskSize, percent);
+				bmfs_disk_progress();
+				printf("...\r");
+				fflush(stdout);
+			}
 			chunkSize = bufferSize;
 			if (chunkSize > diskSize - writeSize)
 			{
@@ -487,19 +1621,26 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 				break;
 			}
 			writeSize += chunkSize;
+			bmfsStats.ImageWrites++;
+			bmfsStats.ImageWritten += chunkSize;
 		}
 		if (ret == 0)
 		{
-			printf("Formatting disk: %llu of %llu bytes (100%%)%9s\n", writeSize, diskSize, "");
+			fflush(disk);
+			printf("Formatting disk: %llu of %llu bytes (100%%)", writeSize, diskSize);
+			bmfs_disk_progress();
+			printf("%9s\n", "");
 		}
 	}
 
 	// Format the disk.
+	bmfs_stats_phase("format");
 	if (ret == 0)
 	{
 		rewind(disk);
 		bmfs_format();
 	}
+	bmfs_stats_phase("boot");
 
 	// Write the master boot record if it was specified by the caller.
 	if (ret == 0 && mbrFile != NULL)
@@ -507,6 +1648,10 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 		fseek(disk, 0, SEEK_SET);
 		if (fread(buffer, 512, 1, mbrFile) == 1)
 		{
+			bmfsStats.HostReads++;
+			bmfsStats.HostRead += 512;
+			bmfsStats.ImageWrites++;
+			bmfsStats.ImageWritten += 512;
 			if (fwrite(buffer, 512, 1, disk) != 1)
 			{
 				printf("bmfs error: Failed to write disk '%s'\n", diskname);
@@ -529,15 +1674,20 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 			chunkSize = fread( buffer, 1, bufferSize, bootFile);
 			if (chunkSize > 0)
 			{
+				bmfsStats.HostReads++;
+				bmfsStats.HostRead += chunkSize;
+				bmfsStats.ImageWrites++;
+				bmfsStats.ImageWritten += chunkSize;
 				if (fwrite(buffer, chunkSize, 1, disk) != 1)
 				{
 					printf("bmfs error: Failed to write disk '%s'\n", diskname);
 					ret = 1;
+					break;
 				}
 			}
 			else
 			{
-				if (ferror(disk))
+				if (ferror(bootFile))
 				{
 					printf("bmfs error: Failed to read file '%s'\n", boot);
 					ret = 1;
@@ -556,15 +1706,20 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 			chunkSize = fread( buffer, 1, bufferSize, kernelFile);
 			if (chunkSize > 0)
 			{
+				bmfsStats.HostReads++;
+				bmfsStats.HostRead += chunkSize;
+				bmfsStats.ImageWrites++;
+				bmfsStats.ImageWritten += chunkSize;
 				if (fwrite(buffer, chunkSize, 1, disk) != 1)
 				{
 					printf("bmfs error: Failed to write disk '%s'\n", diskname);
 					ret = 1;
+					break;
 				}
 			}
 			else
 			{
-				if (ferror(disk))
+				if (ferror(kernelFile))
 				{
 					printf("bmfs error: Failed to read file '%s'\n", kernel);
 					ret = 1;
@@ -587,10 +1742,13 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 	{
 		fclose(kernelFile);
 	}
+	if (bmfs_disk_report() != 0 && ret == 0)
+		ret = 1;
 	if (disk != NULL)
 	{
 		fclose(disk);
 		disk = NULL;
+		diskStripe = NULL;
 	}
 
 	// Free the buffer if it was allocated.
@@ -608,289 +1766,614 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 }
 
 
-// helper function for qsort, sorts by StartingBlock field
-static int StartingBlockCmp(const void *pa, const void *pb)
+
+// Size in bytes of a local file, or -1 if it cannot be opened
+static long long bmfs_build_size(char *path)
 {
-	struct BMFSEntry *ea = (struct BMFSEntry *)pa;
-	struct BMFSEntry *eb = (struct BMFSEntry *)pb;
-	// empty records go to the end
-	if (ea->FileName[0] == 0x01)
-		return 1;
-	if (eb->FileName[0] == 0x01)
+	FILE *f;
+	long long size;
+
+	if ((f = fopen(path, "rb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", path);
 		return -1;
-	// compare non-empty records by their starting blocks number
-	return (ea->StartingBlock - eb->StartingBlock);
+	}
+	fseek(f, 0, SEEK_END);
+#ifdef _WIN32
+	size = _ftelli64(f);
+#else
+	size = ftello(f);
+#endif
+	fclose(f);
+	return size;
 }
 
-void bmfs_create(char *filename, unsigned long long maxsize)
-{
-	struct BMFSEntry tempentry;
-	int slot;
 
-	if (maxsize % 2 != 0)
-		maxsize++;
+// Copy length bytes of a local file to the disk at offset
+// Returns 0 on success
+static int bmfs_build_copy(char *path, unsigned long long offset, unsigned long long length, char *buffer, unsigned long long *written)
+{
+	FILE *f;
+	size_t chunk;
+	int ret = 0;
 
-	if (bmfs_find(filename, &tempentry, &slot) == 0)
+	if ((f = fopen(path, "rb")) == NULL)
 	{
-		unsigned long long blocks_requested = maxsize / 2; // how many blocks to allocate
-		unsigned long long num_blocks = disksize / 2; // number of blocks in the disk
-		char dir_copy[4096]; // copy of directory
-		int num_used_entries = 0; // how many entries of Directory are either used or deleted
-		int first_free_entry = -1; // where to put new entry
-		int tint;
-		struct BMFSEntry *pEntry;
-		unsigned long long new_file_start = 0;
-		unsigned long long prev_file_end = 1;
-
-		// Make a copy of Directory to play with
-		memcpy(dir_copy, Directory, 4096);
-
-		// Calculate number of files
-		for (tint = 0; tint < 64; tint++)
+		printf("bmfs error: Could not open local file '%s'\n", path);
+		return 1;
+	}
+	bmfs_seek(disk, offset);
+	while (ret == 0 && length > 0)
+	{
+		chunk = writeChunkSize;
+		if (length < chunk)
+			chunk = length;
+		if (fread(buffer, chunk, 1, f) != 1)
 		{
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-			if (pEntry->FileName[0] == 0x00) // end of directory
-			{
-				num_used_entries = tint;
-				if (first_free_entry == -1)
-					first_free_entry = tint; // there were no unused entires before, will use this one
-				break;
-			}
-			else if (pEntry->FileName[0] == 0x01) // unused entry
-			{
-				if (first_free_entry == -1)
-					first_free_entry = tint; // will use it for our new file
-			}
+			printf("bmfs error: Failed to read file '%s'\n", path);
+			ret = 1;
 		}
-
-		if (first_free_entry == -1)
+		else if (fwrite(buffer, chunk, 1, disk) != 1)
 		{
-			printf("bmfs error: Cannot create file. No free directory entries.\n");
-			return;
+			printf("bmfs error: Failed to write disk '%s'\n", diskname);
+			ret = 1;
 		}
+		length -= chunk;
+		*written += chunk;
+		bmfsStats.HostReads++;
+		bmfsStats.HostRead += chunk;
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += chunk;
+	}
+	fclose(f);
+	return ret;
+}
 
-		// Find an area with enough free blocks
-		// Sort our copy of the directory by starting block number
-		qsort(dir_copy, num_used_entries, 64, StartingBlockCmp);
-
-		for (tint = 0; tint < num_used_entries + 1; tint++)
-		{
-			// on each iteration of this loop we'll see if a new file can fit
-			// between the end of the previous file (initially == 1)
-			// and the beginning of the current file (or the last data block if there are no more files).
-
-			unsigned long long this_file_start;
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-
-			if (tint == num_used_entries || pEntry->FileName[0] == 0x01)
-				this_file_start = num_blocks - 1; // index of the last block
-			else
-				this_file_start = pEntry->StartingBlock;
-
-			if (this_file_start - prev_file_end >= blocks_requested)
-			{ // fits here
-				new_file_start = prev_file_end;
-				break;
-			}
-
-			if (tint < num_used_entries)
-				prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
-		}
 
-		if (new_file_start == 0)
-		{
-			printf("bmfs error: Cannot create file of size %lld MiB.\n", maxsize);
-			return;
-		}
+// Copy of a string, such as one from a line buffer
+static char *bmfs_strdup(const char *str)
+{
+	char *copy = bmfs_stats_malloc(strlen(str) + 1);
 
-		// Add file record to Directory
-		pEntry = (struct BMFSEntry *)(Directory + first_free_entry * 64);
-		pEntry->StartingBlock = new_file_start;
-		pEntry->ReservedBlocks = blocks_requested;
-		pEntry->FileSize = 0;
-		strcpy(pEntry->FileName, filename);
+	if (copy != NULL)
+		strcpy(copy, str);
+	return copy;
+}
 
-		if (first_free_entry == num_used_entries && num_used_entries + 1 < 64)
-		{
-			// here we used the record that was marked with 0x00,
-			// so make sure to mark the next record with 0x00 if it exists
-			pEntry = (struct BMFSEntry *)(Directory + (num_used_entries + 1) * 64);
-			pEntry->FileName[0] = 0x00;
-		}
 
-		// Flush Directory to disk
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		fwrite(Directory, 4096, 1, disk);			// Write 4096 bytes for the Directory
+// Convert a size in the manifest, like 128M, reporting where a bad one is
+// Returns 0, or 1 if it is not valid
+static int bmfs_build_parse_size(char *arg, unsigned long long *result, const char *what, char *manifest, int lineno)
+{
+	size_t digits = strspn(arg, "0123456789");
 
-//		printf("Complete: file %s starts at block %lld, directory entry #%d.\n", filename, new_file_start, first_free_entry);
+	if (digits == 0 || (arg[digits] != '\0' && (strchr("KMGTPkmgtp", arg[digits]) == NULL || arg[digits + 1] != '\0')))
+	{
+		printf("bmfs error: %s line %d: Invalid %s '%s'\n", manifest, lineno, what, arg);
+		return 1;
 	}
-	else
+	if (bmfs_parse_size(arg, result) != 0)
 	{
-		printf("bmfs error: File already exists.\n");
+		printf("bmfs error: %s line %d: Invalid %s '%s'\n", manifest, lineno, what, arg);
+		return 1;
 	}
+	return 0;
 }
 
-// Read a file from a BMFS volume
-void bmfs_read(char *filename)
+
+// Read one file line of the manifest
+static int bmfs_build_file(struct BMFSBuildFile *bf, char *path, char *manifest, int lineno)
 {
-	struct BMFSEntry tempentry;
-	FILE *tfile;
-	int slot, retval;
-	unsigned long long bytestoread;
-	char *buffer;
+	char *base, *opt, *end;
+	int ret = 0;
 
-	if (0 == bmfs_find(filename, &tempentry, &slot))
+	memset(bf, 0, sizeof(struct BMFSBuildFile));
+	bf->path = bmfs_strdup(path);
+
+	// The name in BMFS defaults to the last part of the path
+	base = path + strlen(path);
+	while (base > path && base[-1] != '/' && base[-1] != '\\')
+		base--;
+	strncpy(bf->name, base, 31);
+	if (strlen(base) > 31)
 	{
-		printf("bmfs error: File not found in BMFS.\n");
+		printf("bmfs error: %s line %d: File name '%s' is too long, use name=\n", manifest, lineno, base);
+		ret = 1;
 	}
-	else
+
+	while (ret == 0 && (opt = strtok(NULL, " \t\r\n")) != NULL)
 	{
-		if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+		if (strncmp(opt, "name=", 5) == 0 && opt[5] != '\0' && strlen(opt + 5) <= 31)
 		{
-			printf("bmfs error: Could not open local file '%s'\n", tempentry.FileName);
+			strcpy(bf->name, opt + 5);
 		}
-		else
+		else if (strncmp(opt, "reserve=", 8) == 0)
 		{
-			bytestoread = tempentry.FileSize;
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
+			ret = bmfs_build_parse_size(opt + 8, &bf->reserve, "reserve size", manifest, lineno);
+		}
+		else if (strncmp(opt, "at=", 3) == 0 && isdigit((unsigned char)opt[3]))
+		{
+			bf->at = strtoull(opt + 3, &end, 10);
+			if (*end != '\0')
 			{
-				while (bytestoread != 0)
-				{
-					if (bytestoread >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, tfile);
-							bytestoread -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, bytestoread, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, bytestoread, 1, tfile);
-							bytestoread = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-				}
+				printf("bmfs error: %s line %d: Invalid block number '%s'\n", manifest, lineno, opt + 3);
+				ret = 1;
 			}
-			fclose(tfile);
+		}
+		else
+		{
+			printf("bmfs error: %s line %d: Invalid file option '%s'\n", manifest, lineno, opt);
+			ret = 1;
 		}
 	}
+	return ret;
 }
 
 
-// Write a file to a BMFS volume
-void bmfs_write(char *filename)
+// Read the build manifest
+// bootchain gets the MBR, boot loader and kernel paths, if given
+static int bmfs_build_parse(char *manifest, struct BMFSBuildFile **files, int *filecount, char **bootchain, unsigned long long *diskSize, int *extend)
 {
-	struct BMFSEntry tempentry;
-	FILE *tfile;
-	int slot, retval;
-	unsigned long long tempfilesize;
-	char *buffer;
+	struct BMFSBuildFile *grown;
+	char line[1024], *key, *arg, *comment;
+	unsigned long long size;
+	int lineno = 0, ret = 0, which;
+	FILE *m;
 
-	if ((tfile = fopen(filename, "rb")) == NULL)
+	if ((m = fopen(manifest, "r")) == NULL)
 	{
-		printf("bmfs error: Could not open local file '%s'\n", filename);
+		printf("bmfs error: Could not open manifest '%s'\n", manifest);
+		return 1;
 	}
-	else
+	while (ret == 0 && fgets(line, sizeof(line), m) != NULL)
 	{
-		// Is there enough room in BMFS?
-		fseek(tfile, 0, SEEK_END);
-		tempfilesize = ftell(tfile);
-		rewind(tfile);
-		if (0 == bmfs_find(filename, &tempentry, &slot))
+		lineno++;
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		key = strtok(line, " \t\r\n");
+		if (key == NULL)
+			continue;
+		arg = strtok(NULL, " \t\r\n");
+		which = (strcasecmp(key, "mbr") == 0 ? 0 : strcasecmp(key, "boot") == 0 ? 1 : strcasecmp(key, "kernel") == 0 ? 2 : -1);
+		if (strcasecmp(key, "extend") == 0)
+		{
+			*extend = 1;
+		}
+		else if (arg == NULL)
+		{
+			printf("bmfs error: %s line %d: '%s' needs a value\n", manifest, lineno, key);
+			ret = 1;
+		}
+		else if (strcasecmp(key, "size") == 0)
 		{
-			if (tempfilesize < blockSize)
+			ret = bmfs_build_parse_size(arg, diskSize, "disk size", manifest, lineno);
+		}
+		else if (strcasecmp(key, "block-size") == 0)
+		{
+			ret = bmfs_build_parse_size(arg, &size, "block size", manifest, lineno);
+			if (ret == 0 && (size < minimumBlockSize || size > defaultBlockSize || (size & (size - 1)) != 0))
 			{
-				bmfs_create(filename, (tempfilesize+blockSize)/blockSize);
+				printf("bmfs error: Block size must be a power of two from 4K to 2M\n");
+				ret = 1;
 			}
-			else
+			if (ret == 0 && !blockSizeOption)	// --block-size wins over the manifest
+				blockSize = size;
+		}
+		else if (which >= 0)
+		{
+			free(bootchain[which]);
+			bootchain[which] = bmfs_strdup(arg);
+		}
+		else if (strcasecmp(key, "file") == 0)
+		{
+			grown = bmfs_stats_realloc(*files, (*filecount + 1) * sizeof(struct BMFSBuildFile));
+			if (grown == NULL)
 			{
-				bmfs_create(filename, ceil((tempfilesize+1048576)/1048576));
+				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+				ret = 1;
+				break;
 			}
-			bmfs_find(filename, &tempentry, &slot);
+			*files = grown;
+			ret = bmfs_build_file(&grown[(*filecount)++], arg, manifest, lineno);
 		}
-		if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
+		else
 		{
-			printf("bmfs error: Not enough reserved space in BMFS.\n");
+			printf("bmfs error: %s line %d: Unknown item '%s'\n", manifest, lineno, key);
+			ret = 1;
 		}
+	}
+	fclose(m);
+	if (ret == 0 && *diskSize < minimumDiskSize)
+	{
+		printf("bmfs error: Disk size must be at least %d bytes (%dMiB)\n", minimumDiskSize, minimumDiskSize / (1024*1024));
+		ret = 1;
+	}
+	return ret;
+}
+
+
+// Lay out every file of the manifest in the directory
+// Files with a starting block go first, the rest take the first gap they
+// fit in, in manifest order
+static int bmfs_build_plan(struct BMFSBuildFile *files, int filecount)
+{
+	struct BMFSBuildFile *bf;
+	unsigned long long start;
+	unsigned int position, end;
+	long long size;
+	int pass, tint, slot;
+
+	for (tint = 0; tint < filecount; tint++)
+	{
+		bf = &files[tint];
+		if ((size = bmfs_build_size(bf->path)) < 0)
+			return 1;
+		bf->size = size;
+		if (bf->reserve > 0)
+			bf->blocks = ((bf->reserve > bf->size ? bf->reserve : bf->size) + blockSize - 1) / blockSize;
 		else
+			bf->blocks = bmfs_reserve_blocks(&volumeGeometry, bf->size);
+		if (bf->blocks == 0)
+			bf->blocks = 1;
+	}
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (tint = 0; tint < filecount; tint++)
 		{
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
+			bf = &files[tint];
+			if ((pass == 0) != (bf->at != 0))
+				continue;
+			if (bmfs_dir_find(&dir, bf->name) >= 0)
 			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+				printf("bmfs error: File '%s' is in the manifest more than once.\n", bf->name);
+				return 1;
+			}
+			if (pass == 0)
+			{
+				start = bf->at;
+				if (bmfs_dir_place_at(&dir, firstDataBlock, lastDataBlock, start, bf->blocks, &position) != 0)
+				{
+					printf("bmfs error: File '%s' cannot be placed at block %llu.\n", bf->name, start);
+					return 1;
+				}
 			}
 			else
 			{
-				while (tempfilesize != 0)
+				start = bmfs_dir_place(&dir, firstDataBlock, lastDataBlock, bf->blocks, BMFS_FIT_FIRST, &position);
+				if (start == 0)
 				{
-					if (tempfilesize >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, tfile);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, tempfilesize, 1, tfile);
-						if (retval == 1)
-						{
-							memset(buffer+(tempfilesize), 0, (blockSize-tempfilesize)); // 0 the rest of the buffer
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
+					printf("bmfs error: Cannot create file of %llu blocks.\n", bf->blocks);
+					return 1;
 				}
 			}
-			// Update directory
-			tempfilesize = ftell(tfile);
-			memcpy(Directory+(slot*64)+48, &tempfilesize, 8);
-			fseek(disk, 4096, SEEK_SET);			// Seek 4KiB in for directory
-			fwrite(Directory, 4096, 1, disk);		// Write new directory to disk
+			slot = bmfs_dir_free_slot(&dir, &end);
+			bmfs_dir_add(&dir, slot, end, position, bf->name, start, bf->blocks);
+			bf->slot = slot;
+			((struct BMFSEntry *)(dir.Entries + slot * 64))->FileSize = bf->size;
 		}
-		fclose(tfile);
 	}
+	return 0;
 }
 
 
-void bmfs_delete(char *filename)
+// Build a new disk image from a manifest
+// Everything is laid out first and then written in one pass in disk order,
+// skipping over space that stays zero so the image can be sparse
+int bmfs_build(char *diskname, char *manifest)
+{
+	struct BMFSBuildFile *files = NULL;
+	struct BMFSEntry *pEntry;
+	char *bootchain[3] = { NULL, NULL, NULL };
+	long long bootsize[3] = { 0, 0, 0 };
+	unsigned long long diskSize = 0, written = 0, offset, blocks = 0;
+	double start, parsed, planned, wrote, synced;
+	char *buffer = NULL;
+	int *source = NULL;
+	int filecount = 0, extend = 0, ret, tint;
+
+	start = bmfs_time();
+	bmfs_stats_phase("parse");
+	ret = bmfs_build_parse(manifest, &files, &filecount, bootchain, &diskSize, &extend);
+	parsed = bmfs_time();
+	bmfs_stats_phase("plan");
+
+	// Plan the layout
+	if (ret == 0)
+	{
+		for (tint = 0; tint < 3 && ret == 0; tint++)
+		{
+			if (bootchain[tint] != NULL && (bootsize[tint] = bmfs_build_size(bootchain[tint])) < 0)
+				ret = 1;
+		}
+		if (ret == 0 && bootchain[0] != NULL && bootsize[0] < 512)
+		{
+			printf("bmfs error: Failed to read file '%s'\n", bootchain[0]);
+			ret = 1;
+		}
+	}
+	if (ret == 0)
+	{
+		if (filecount > 64)
+		{
+			extend = 1;
+			blocks = (filecount - 64 + 63) / 64;
+		}
+		offset = 8192 + bootsize[1] + bootsize[2];
+		if (blocks > maxExtendedBlocks)
+		{
+			printf("bmfs error: Too many files for the directory.\n");
+			ret = 1;
+		}
+		else if (offset > (extend ? extendedDirectoryOffset : reservedSize))
+		{
+			printf("bmfs error: Boot loader and kernel do not fit before %s.\n", (extend ? "the extended directory" : "the first data block"));
+			ret = 1;
+		}
+	}
+	if (ret == 0)
+	{
+		bmfs_geometry(diskSize);
+		ret = (bmfs_directory_alloc(blocks) != 0);
+	}
+	if (ret == 0)
+	{
+		memset(DiskInfo, 0, 512);
+		memcpy(DiskInfo, fs_tag, 4);
+		offset = blockSize;
+		memcpy(DiskInfo + DISKINFO_BLOCK_SIZE, &offset, 8);
+		if (extend)
+		{
+			offset = extendedDirectoryOffset;
+			memcpy(DiskInfo + DISKINFO_EXTENDED_OFFSET, &offset, 8);
+			memcpy(DiskInfo + DISKINFO_EXTENDED_BLOCKS, &blocks, 8);
+		}
+		ret = bmfs_build_plan(files, filecount);
+	}
+	if (ret == 0 && (buffer = bmfs_stats_malloc(writeChunkSize)) == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		ret = 1;
+	}
+	planned = bmfs_time();
+	bmfs_stats_phase("write");
+
+	// Write everything in order of offset
+	if (ret == 0 && (disk = bmfs_disk_open(diskname, "wb")) == NULL)
+	{
+		ret = 1;
+	}
+	if (ret == 0 && bootchain[0] != NULL)
+		ret = bmfs_build_copy(bootchain[0], 0, 512, buffer, &written);
+	if (ret == 0)
+	{
+		bmfs_seek(disk, 1024);
+		fwrite(DiskInfo, 512, 1, disk);
+		bmfs_seek(disk, 4096);
+		fwrite(dir.Entries, 4096, 1, disk);
+		written += 512 + 4096;
+		bmfsStats.ImageWrites += 2;
+		bmfsStats.ImageWritten += 512 + 4096;
+		bmfsStats.DirectoryWrites += 2;
+	}
+	offset = 8192;
+	for (tint = 1; tint < 3 && ret == 0; tint++)	// The kernel directly follows the boot loader
+	{
+		if (bootchain[tint] != NULL)
+			ret = bmfs_build_copy(bootchain[tint], offset, bootsize[tint], buffer, &written);
+		offset += bootsize[tint];
+	}
+	if (ret == 0 && blocks > 0)
+	{
+		bmfs_seek(disk, extendedDirectoryOffset);
+		if (fwrite(dir.Entries + 4096, blocks * 4096, 1, disk) != 1)
+		{
+			printf("bmfs error: Failed to write disk '%s'\n", diskname);
+			ret = 1;
+		}
+		written += blocks * 4096;
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += blocks * 4096;
+		bmfsStats.DirectoryWrites++;
+	}
+	if (ret == 0 && (ret = bmfs_dir_extents(&dir)) == 0 && (source = bmfs_stats_malloc(dir.Count * sizeof(int))) == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		ret = 1;
+	}
+	for (tint = 0; ret == 0 && tint < filecount; tint++)
+		source[files[tint].slot] = tint;
+	for (tint = 0; ret == 0 && tint < (int)dir.ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + dir.ExtentIndex[tint] * 64);
+		ret = bmfs_build_copy(files[source[dir.ExtentIndex[tint]]].path, pEntry->StartingBlock * blockSize, pEntry->FileSize, buffer, &written);
+	}
+	if (ret == 0)
+	{
+		// Set the length of the image without writing the space before it
+		bmfs_seek(disk, diskSize - 1);
+		if (fwrite("", 1, 1, disk) != 1)
+		{
+			printf("bmfs error: Failed to write disk '%s'\n", diskname);
+			ret = 1;
+		}
+		fflush(disk);
+	}
+	wrote = bmfs_time();
+	bmfs_stats_phase("sync");
+	if (ret == 0 && durabilityMode != DURABILITY_NONE)
+		bmfs_sync(disk);
+	synced = bmfs_time();
+	bmfs_stats_phase("close");
+	if (bmfs_disk_report() != 0 && ret == 0)
+		ret = 1;
+	if (disk != NULL)
+	{
+		fclose(disk);
+		disk = NULL;
+		diskStripe = NULL;
+	}
+
+	if (ret == 0)
+	{
+		printf("Disk build complete: %d files, %llu of %llu bytes written.\n", filecount, written, diskSize);
+		printf("Build time: parse %.3f, plan %.3f, write %.3f, sync %.3f, total %.3f seconds.\n", parsed - start, planned - parsed, wrote - planned, synced - wrote, synced - start);
+	}
+
+	for (tint = 0; tint < filecount; tint++)
+		free(files[tint].path);
+	free(files);
+	for (tint = 0; tint < 3; tint++)
+		free(bootchain[tint]);
+	free(source);
+	free(buffer);
+	return ret;
+}
+
+// Create a file, reserving the given number of MiB rounded up to whole blocks
+void bmfs_create(char *filename, unsigned long long maxsize)
+{
+	bmfs_create_blocks(filename, (maxsize * 1048576 + blockSize - 1) / blockSize);
+}
+
+
+void bmfs_create_blocks(char *filename, unsigned long long blocks_requested)
+{
+	struct BMFSEntry tempentry;
+	int slot;
+
+	if (strlen(filename) > 31)
+	{
+		printf("bmfs error: Filename too long.\n");
+		return;
+	}
+
+	// Hold the whole directory while allocating so concurrent creates see
+	// each other, and pick up any entries written since the disk was opened
+	if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+		return;
+	bmfs_disk_read(DiskInfo, 512, 1024);
+	bmfs_load_directory();
+
+	if (bmfs_find(filename, &tempentry, &slot) == 0)
+	{
+		unsigned int num_used_entries; // how many entries of the directory are either used or deleted
+		unsigned int position; // where the new file goes in disk order
+		int first_free_entry; // where to put new entry
+		int changed_entries; // how many entries need to be written back
+		unsigned long long new_file_start;
+
+		first_free_entry = bmfs_dir_free_slot(&dir, &num_used_entries);
+
+		// A full directory can grow if it is extended
+		if (first_free_entry == -1 && bmfs_grow_directory() == 0)
+			first_free_entry = num_used_entries;
+
+		if (first_free_entry == -1 || bmfs_dir_names(&dir) != 0 || bmfs_dir_extents(&dir) != 0)
+		{
+			printf("bmfs error: Cannot create file. No free directory entries.\n");
+			bmfs_lock_directory(BMFS_UNLOCK);
+			return;
+		}
+
+		// Find an area with enough free blocks
+		new_file_start = bmfs_dir_place(&dir, firstDataBlock, lastDataBlock, blocks_requested, BMFS_FIT_FIRST, &position);
+		if (new_file_start == 0)
+		{
+			printf("bmfs error: Cannot create file of %llu blocks.\n", blocks_requested);
+			bmfs_lock_directory(BMFS_UNLOCK);
+			return;
+		}
+
+		// Add file record to the directory, which also updates the indexes
+		changed_entries = bmfs_dir_add(&dir, first_free_entry, num_used_entries, position, filename, new_file_start, blocks_requested);
+
+		// Flush the new entry (and the moved end marker) to disk
+		if (changed_entries == 2 && bmfs_entry_offset(first_free_entry + 1) != bmfs_entry_offset(first_free_entry) + 64)
+		{
+			bmfs_disk_write(dir.Entries + first_free_entry * 64, 64, bmfs_entry_offset(first_free_entry));
+			bmfs_disk_write(dir.Entries + (first_free_entry + 1) * 64, 64, bmfs_entry_offset(first_free_entry + 1));
+		}
+		else
+		{
+			bmfs_disk_write(dir.Entries + first_free_entry * 64, changed_entries * 64, bmfs_entry_offset(first_free_entry));
+		}
+
+//		printf("Complete: file %s starts at block %lld, directory entry #%d.\n", filename, new_file_start, first_free_entry);
+	}
+	else
+	{
+		printf("bmfs error: File already exists.\n");
+	}
+
+	bmfs_lock_directory(BMFS_UNLOCK);
+}
+
+// Copy the contents of a directory entry to a local file of the same name
+static void bmfs_read_entry(int slot)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile;
+	struct BMFSCopy copy;
+	int retval;
+	unsigned long long extent, extentsize;
+	char *buffer;
+	double begin;
+
+	memcpy(&tempentry, dir.Entries+(slot*64), 64);
+
+	// Share the extent with other readers, and pick up the size a writer
+	// may have set since the directory was loaded. The local file is only
+	// created once the lock is held so a failure leaves nothing behind.
+	extent = tempentry.StartingBlock * blockSize;
+	extentsize = tempentry.ReservedBlocks * blockSize;
+	if (bmfs_lock(extent, extentsize, BMFS_LOCK_READ) != 0)
+		return;
+	if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", tempentry.FileName);
+		bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+		return;
+	}
+	bmfs_disk_read(&tempentry, 64, bmfs_entry_offset(slot));
+	if (memcmp(&tempentry, dir.Entries+(slot*64), 48) != 0)
+	{
+		printf("bmfs error: File '%s' was removed while reading.\n", dir.Entries+(slot*64));
+	}
+	else
+	{
+		buffer = bmfs_stats_malloc(readChunkSize);
+		if (buffer == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		}
+		else
+		{
+			begin = bmfs_trace_begin();
+			bmfs_stream_begin(&copy.disk, disk, extent, 0);
+			bmfs_stream_begin(&copy.file, tfile, 0, 1);
+			// The default layout gets its own copy of the loop with the block size folded in
+			if (blockSize == defaultBlockSize)
+				retval = bmfs_copy_out(&bmfsGeometry, disk, &tempentry, tfile, buffer, readChunkSize, bmfs_copy_progress, &copy);
+			else
+				retval = bmfs_copy_out(&volumeGeometry, disk, &tempentry, tfile, buffer, readChunkSize, bmfs_copy_progress, &copy);
+			if (retval != 0)
+				printf("bmfs error: Unexpected read length detected.\n");
+			bmfs_stream_end(&copy.disk);
+			bmfs_stream_end(&copy.file);
+			bmfs_trace_span("file", tempentry.FileName, begin, tempentry.FileSize);
+			free(buffer);
+		}
+	}
+	bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+	fclose(tfile);
+}
+
+
+// Read a file from a BMFS volume
+void bmfs_read(char *filename)
 {
 	struct BMFSEntry tempentry;
-	char delmarker = 0x01;
 	int slot;
 
 	if (0 == bmfs_find(filename, &tempentry, &slot))
@@ -899,11 +2382,2783 @@ void bmfs_delete(char *filename)
 	}
 	else
 	{
-		// Update directory
-		memcpy(Directory+(slot*64), &delmarker, 1);
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		fwrite(Directory, 4096, 1, disk);			// Write new directory to disk
+		bmfs_read_entry(slot);
+	}
+}
+
+
+// Total head travel in bytes to read a list of directory entries in the given order
+static unsigned long long bmfs_seek_distance(int *slots, int count)
+{
+	unsigned long long position = 4096, distance = 0, target;
+	struct BMFSEntry *pEntry;
+	int tint;
+
+	for (tint = 0; tint < count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + slots[tint] * 64);
+		target = pEntry->StartingBlock * blockSize;
+		distance += (target > position ? target - position : position - target);
+		position = target + pEntry->FileSize;
+	}
+	return distance;
+}
+
+
+// Collect the directory slots of the named files, or of every file if names
+// is NULL. Returns the number of slots found, or -1.
+static int bmfs_select(char **names, int count, int **slots)
+{
+	struct BMFSEntry tempentry;
+	int tint, slot, found = 0;
+
+	*slots = bmfs_stats_malloc(dir.Count * sizeof(int));
+	if (*slots == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return -1;
+	}
+
+	if (names == NULL)
+	{
+		for (tint = 0; tint < (int)dir.Count; tint++)
+		{
+			memcpy(pentry, dir.Entries+(tint*64), 64);
+			if (entry.FileName[0] == 0x00)			// End of directory
+				break;
+			if (entry.FileName[0] != 0x01)			// Valid entry
+				(*slots)[found++] = tint;
+		}
+	}
+	else
+	{
+		for (tint = 0; tint < count && found < (int)dir.Count; tint++)
+		{
+			if (bmfs_find(names[tint], &tempentry, &slot) == 0)
+				printf("bmfs error: File '%s' not found in BMFS.\n", names[tint]);
+			else
+				(*slots)[found++] = slot;
+		}
 	}
+	return found;
+}
+
+
+// Read several files from a BMFS volume in one sweep across the disk
+// If names is NULL every file in the directory is read
+void bmfs_read_many(char **names, int count)
+{
+	struct BMFSEntry *pEntry;
+	unsigned long long directorydistance, diskdistance;
+	int *slots;
+	int tint, found;
+
+	bmfs_stats_phase("select");
+	found = bmfs_select(names, count, &slots);
+	if (found < 0)
+		return;
+	bmfs_stats_phase("copy");
+
+	// Serve the requests in one elevator sweep by starting block
+	directorydistance = bmfs_seek_distance(slots, found);
+	if (readOrder == ORDER_DISK)
+		bmfs_dir_sort(&dir, slots, found);
+	diskdistance = bmfs_seek_distance(slots, found);
+
+	for (tint = 0; tint < found; tint++)
+	{
+		// Hint the OS to start fetching the next extent while this one is copied
+		if (tint + 1 < found)
+		{
+			pEntry = (struct BMFSEntry *)(dir.Entries + slots[tint+1] * 64);
+			bmfs_readahead(pEntry->StartingBlock * blockSize, pEntry->FileSize);
+		}
+		bmfs_read_entry(slots[tint]);
+	}
+
+	printf("Read %d files in %s order, seek distance %llu MiB", found, (readOrder == ORDER_DISK ? "disk" : "directory"), diskdistance / 1048576);
+	if (directorydistance > diskdistance)
+		printf(" (%llu MiB avoided)", (directorydistance - diskdistance) / 1048576);
+	printf("\n");
+	free(slots);
+}
+
+
+// Copy size bytes of an open local file into the extent of a file
+// Returns 0 on success
+static int bmfs_write_extent(FILE *tfile, unsigned long long size, struct BMFSEntry *fileentry)
+{
+	struct BMFSCopy copy;
+	char *buffer;
+	double begin;
+	int retval;
+
+	buffer = bmfs_stats_malloc(writeChunkSize);
+	if (buffer == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return -1;
+	}
+	begin = bmfs_trace_begin();
+	bmfs_stream_begin(&copy.disk, disk, fileentry->StartingBlock*blockSize, 1);
+	bmfs_stream_begin(&copy.file, tfile, 0, 0);
+	if (blockSize == defaultBlockSize)
+		retval = bmfs_copy_in(&bmfsGeometry, tfile, size, disk, fileentry, buffer, writeChunkSize, bmfs_copy_progress, &copy);
+	else
+		retval = bmfs_copy_in(&volumeGeometry, tfile, size, disk, fileentry, buffer, writeChunkSize, bmfs_copy_progress, &copy);
+	if (retval != 0)
+		printf("bmfs error: Unexpected read length detected.\n");
+	bmfs_stream_end(&copy.disk);
+	bmfs_stream_end(&copy.file);
+	bmfs_trace_span("file", fileentry->FileName, begin, size);
+	free(buffer);
+	return retval;
+}
+
+
+// Create a file about to be written if it does not exist yet, with the
+// reservation of bmfs_reserve_blocks
+// Every file is reserved before any is written, so the directory is never
+// waited for while the extent of an earlier file is held
+static void bmfs_write_reserve(struct BMFSLiteImage *source, char *filename)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile;
+	unsigned long long size;
+	int slot;
+
+	if (0 != bmfs_find(filename, &tempentry, &slot))
+		return;
+	if (source != NULL)
+	{
+		if ((slot = bmfs_dir_find(&source->Dir, filename)) < 0)
+			return;
+		size = ((struct BMFSEntry *)(source->Dir.Entries + slot * 64))->FileSize;
+	}
+	else
+	{
+		// Files that cannot be opened are reported when they are written
+		if ((tfile = fopen(filename, "rb")) == NULL)
+			return;
+		fseek(tfile, 0, SEEK_END);
+		size = ftell(tfile);
+		fclose(tfile);
+	}
+	bmfs_create_blocks(filename, bmfs_reserve_blocks(&volumeGeometry, size));
+}
+
+
+// Copy a local file into its extent, which bmfs_write_reserve created
+// On success the extent is left locked and the slot and new size are returned
+static int bmfs_write_data(char *filename, int *slot, unsigned long long *newsize)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile;
+	int ret = 0;
+	unsigned long long tempfilesize;
+
+	if ((tfile = fopen(filename, "rb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", filename);
+	}
+	else
+	{
+		// Is there enough room in BMFS?
+		fseek(tfile, 0, SEEK_END);
+		tempfilesize = ftell(tfile);
+		rewind(tfile);
+		if (0 == bmfs_find(filename, &tempentry, slot))
+		{
+			// The reservation failed and said why
+		}
+		else if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
+		{
+			printf("bmfs error: Not enough reserved space in BMFS.\n");
+		}
+		else if (bmfs_lock(tempentry.StartingBlock*blockSize, tempentry.ReservedBlocks*blockSize, BMFS_LOCK_WRITE) == 0)
+		{
+			// Only this file's extent is held while its data is written
+			bmfs_write_extent(tfile, tempfilesize, &tempentry);
+			*newsize = ftell(tfile);
+			ret = 1;
+		}
+		fclose(tfile);
+	}
+	return ret;
+}
+
+
+// Record the new size of a written file and release its extent
+// The entry comes before the extent in the lock order, so if another
+// process holds the entry the extent is let go while waiting for it, and
+// the file is checked to still be where it was written
+// Returns 0, or -1 if the size could not be recorded
+static int bmfs_write_size(int slot, unsigned long long newsize)
+{
+	struct BMFSEntry tempentry;
+	unsigned long long entry = bmfs_entry_offset(slot), extent, extentsize;
+	int ret = 0;
+
+	memcpy(&tempentry, dir.Entries+(slot*64), 64);
+	extent = tempentry.StartingBlock*blockSize;
+	extentsize = tempentry.ReservedBlocks*blockSize;
+	if (bmfs_lock(entry, 64, BMFS_LOCK_WRITE | BMFS_LOCK_NOWAIT) != 0)
+	{
+		bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+		if (bmfs_lock(entry, 64, BMFS_LOCK_WRITE) != 0)
+			return -1;
+		if (bmfs_lock(extent, extentsize, BMFS_LOCK_WRITE) != 0)
+		{
+			bmfs_lock(entry, 64, BMFS_UNLOCK);
+			return -1;
+		}
+	}
+	bmfs_disk_read(&tempentry, 64, entry);
+	if (memcmp(&tempentry, dir.Entries+(slot*64), 48) != 0)
+	{
+		printf("bmfs error: File '%s' was moved or removed while writing.\n", dir.Entries+(slot*64));
+		ret = -1;
+	}
+	else
+	{
+		tempentry.FileSize = newsize;
+		tempentry.Unused = 0;		// sync compares the data again next time
+		bmfs_disk_write(&tempentry, 64, entry);
+		memcpy(dir.Entries+(slot*64), &tempentry, 64);
+	}
+	bmfs_lock(entry, 64, BMFS_UNLOCK);
+	bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+	return ret;
+}
+
+
+// Copy a file from a BMFS-Lite disk into its extent, which
+// bmfs_write_reserve created
+// On success the extent is left locked and the slot and new size are returned
+static int bmfs_write_lite_data(struct BMFSLiteImage *source, char *filename, int *slot, unsigned long long *newsize)
+{
+	struct BMFSEntry tempentry, *liteentry;
+	unsigned long long size, extent, padding;
+	char *zeros;
+	int liteslot, ret = 1;
+
+	liteslot = bmfs_dir_find(&source->Dir, filename);
+	if (liteslot < 0)
+	{
+		printf("bmfs error: File '%s' not found in BMFS-Lite disk.\n", filename);
+		return 0;
+	}
+	liteentry = (struct BMFSEntry *)(source->Dir.Entries + liteslot * 64);
+	if (!bmfs_entry_valid(&bmfsLiteGeometry, liteentry, source->Size))
+	{
+		printf("bmfs error: File '%s' lies outside the BMFS-Lite disk.\n", filename);
+		return 0;
+	}
+
+	// Extents are planned again for the block size of this disk
+	size = liteentry->FileSize;
+	if (0 == bmfs_find(filename, &tempentry, slot))
+		return 0;
+	if ((tempentry.ReservedBlocks*blockSize) < size)
+	{
+		printf("bmfs error: Not enough reserved space in BMFS.\n");
+		return 0;
+	}
+
+	// Copy straight from the image in memory, then zero the rest of the last block
+	extent = tempentry.StartingBlock * blockSize;
+	padding = (blockSize - (size % blockSize)) % blockSize;
+	if (bmfs_lock(extent, tempentry.ReservedBlocks*blockSize, BMFS_LOCK_WRITE) != 0)
+		return 0;
+	if (size > 0 && bmfs_disk_write(source->Image + liteentry->StartingBlock * bmfsLiteGeometry.BlockSize, size, extent) != 0)
+		ret = 0;
+	if (ret == 1 && padding > 0)
+	{
+		zeros = bmfs_stats_calloc(1, padding);
+		if (zeros == NULL || bmfs_disk_write(zeros, padding, extent + size) != 0)
+			ret = 0;
+		free(zeros);
+	}
+	if (ret == 0)
+	{
+		printf("bmfs error: Unable to write '%s' to disk.\n", filename);
+		bmfs_lock(extent, tempentry.ReservedBlocks*blockSize, BMFS_UNLOCK);
+		return 0;
+	}
+	*newsize = size;
+	return 1;
+}
+
+
+// Write a file to a BMFS volume
+void bmfs_write(char *filename)
+{
+	bmfs_write_many(&filename, 1, NULL);
+}
+
+
+// Write several files to a BMFS volume, from local files or from the
+// BMFS-Lite disk in source if it is set
+// In strict mode each file's data is flushed before its directory entry is
+// written and flushed. In batch mode all the data is flushed once, then all
+// the entries are written and flushed once.
+void bmfs_write_many(char **names, int count, struct BMFSLiteImage *source)
+{
+	int *slots;
+	unsigned long long *sizes;
+	int tint, written = 0;
+
+	slots = bmfs_stats_malloc(count * sizeof(int));
+	sizes = bmfs_stats_malloc(count * sizeof(unsigned long long));
+	if (slots == NULL || sizes == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		free(slots);
+		return;
+	}
+
+	for (tint = 0; tint < count; tint++)
+		bmfs_write_reserve(source, names[tint]);
+
+	bmfs_stats_phase("copy");
+	for (tint = 0; tint < count; tint++)
+	{
+		if (source == NULL && bmfs_write_data(names[tint], &slots[written], &sizes[written]) == 0)
+			continue;
+		if (source != NULL && bmfs_write_lite_data(source, names[tint], &slots[written], &sizes[written]) == 0)
+			continue;
+		if (durabilityMode == DURABILITY_STRICT)
+		{
+			bmfs_stats_phase("commit");
+			bmfs_commit_data();
+			bmfs_write_size(slots[written], sizes[written]);
+			bmfs_commit_metadata();
+			bmfs_stats_phase("copy");
+		}
+		else
+		{
+			written++;
+		}
+	}
+
+	if (written > 0)
+	{
+		bmfs_stats_phase("commit");
+		bmfs_commit_data();
+		for (tint = 0; tint < written; tint++)
+			bmfs_write_size(slots[tint], sizes[tint]);
+		bmfs_commit_metadata();
+	}
+
+	free(slots);
+	free(sizes);
+}
+
+
+// Flush written file data before any directory entry refers to it
+void bmfs_commit_data(void)
+{
+	if (durabilityMode != DURABILITY_NONE)
+		bmfs_durable_sync();
+}
+
+
+// Flush the directory, after copying it to the backup in the last block
+// Without --durability the backup is not kept, so once the directory has
+// changed its tag is cleared and nothing takes it for a current copy. The
+// next strict or batch command writes it again.
+void bmfs_commit_metadata(void)
+{
+	unsigned long long backup = lastDataBlock * blockSize;
+	char tag[4];
+
+	if (durabilityMode == DURABILITY_NONE)
+	{
+		if (bmfs_disk_read(tag, 4, backup + 1024) == 0 && strncasecmp(tag, fs_tag, 4) == 0)
+		{
+			memset(tag, 0, 4);
+			bmfs_disk_write(tag, 4, backup + 1024);
+		}
+		return;
+	}
+
+	if (bmfs_lock_directory(BMFS_LOCK_READ) != 0)
+		return;
+	if (bmfs_disk_read(DiskInfo, 512, 1024) == 0 && bmfs_load_directory() == 0)
+	{
+		bmfs_disk_write(DiskInfo, 512, backup + 1024);
+		bmfs_disk_write(dir.Entries, 4096, backup + 4096);
+		if (ExtendedBlocks > 0)
+			bmfs_disk_write(dir.Entries + 4096, ExtendedBlocks * 4096, backup + extendedDirectoryOffset);
+	}
+	bmfs_lock_directory(BMFS_UNLOCK);
+	bmfs_durable_sync();
+}
+
+
+// Flush the disk to the device, keeping count for the durability report
+void bmfs_durable_sync(void)
+{
+	double start = bmfs_time();
+
+	bmfs_sync(disk);
+	syncTime += bmfs_time() - start;
+	syncCount++;
+}
+
+
+// Report why a BMFS-Lite disk could not be loaded
+static int bmfs_lite_open(char *litename, struct BMFSLiteImage *lite)
+{
+	int ret = bmfs_lite_load(litename, lite);
+
+	if (ret == -2)
+		printf("bmfs error: BMFS-Lite disk size must be between %d and %d bytes\n", BMFS_LITE_MINIMUM_SIZE, BMFS_LITE_MAXIMUM_SIZE);
+	else if (ret != 0)
+		printf("bmfs error: Unable to read BMFS-Lite disk '%s'\n", litename);
+	return ret;
+}
+
+
+// Copy files from this disk into a BMFS-Lite disk in one pass, reading each
+// extent straight into the image in memory and writing the image back once
+// If names is NULL every file is copied
+void bmfs_to_lite(char *litename, char **names, int count)
+{
+	struct BMFSLiteImage lite;
+	struct BMFSEntry tempentry, *pEntry, *liteentry;
+	unsigned long long first, last, blocks, start, extent, extentsize;
+	unsigned int end, position;
+	int *slots;
+	int tint, found, liteslot, copied = 0;
+
+	if (bmfs_lite_open(litename, &lite) != 0)
+		return;
+	found = bmfs_select(names, count, &slots);
+	if (found < 0)
+	{
+		bmfs_lite_free(&lite);
+		return;
+	}
+
+	// Read the source in one sweep across the disk
+	bmfs_dir_sort(&dir, slots, found);
+	first = bmfs_first_block(&bmfsLiteGeometry);
+	last = bmfs_last_block(&bmfsLiteGeometry, lite.Size);
+	for (tint = 0; tint < found; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + slots[tint] * 64);
+
+		// Share the extent with other readers, and pick up the size a writer
+		// may have set since the directory was loaded. A file that cannot be
+		// locked is skipped before it takes any room in the image.
+		extent = pEntry->StartingBlock * blockSize;
+		extentsize = pEntry->ReservedBlocks * blockSize;
+		if (bmfs_lock(extent, extentsize, BMFS_LOCK_READ) != 0)
+			continue;
+		bmfs_disk_read(&tempentry, 64, bmfs_entry_offset(slots[tint]));
+		if (memcmp(&tempentry, pEntry, 48) != 0 || tempentry.FileSize > extentsize)
+		{
+			printf("bmfs error: File '%s' changed while copying.\n", pEntry->FileName);
+			bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+			continue;
+		}
+		blocks = bmfs_reserve_blocks(&bmfsLiteGeometry, tempentry.FileSize);
+
+		// A file already in the image is replaced in place if it still fits
+		liteslot = bmfs_dir_find(&lite.Dir, pEntry->FileName);
+		if (liteslot >= 0)
+		{
+			liteentry = (struct BMFSEntry *)(lite.Dir.Entries + liteslot * 64);
+			if (liteentry->ReservedBlocks < blocks || !bmfs_entry_valid(&bmfsLiteGeometry, liteentry, lite.Size))
+			{
+				liteentry->FileName[0] = 0x01;
+				bmfs_dir_drop(&lite.Dir);
+				liteslot = -1;
+			}
+		}
+		if (liteslot < 0)
+		{
+			start = bmfs_dir_place(&lite.Dir, first, last, blocks, BMFS_FIT_BEST, &position);
+			if (start == 0 && bmfs_dir_free_blocks(&lite.Dir, first, last) >= blocks)
+			{
+				bmfs_mem_compact(&bmfsLiteGeometry, &lite.Dir, lite.Image, lite.Size);
+				start = bmfs_dir_place(&lite.Dir, first, last, blocks, BMFS_FIT_BEST, &position);
+			}
+			if (start != 0)
+				liteslot = bmfs_dir_free_slot(&lite.Dir, &end);
+			if (start == 0 || liteslot < 0)
+			{
+				printf("bmfs error: No room for '%s' in BMFS-Lite disk.\n", pEntry->FileName);
+				bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+				continue;
+			}
+			bmfs_dir_add(&lite.Dir, liteslot, end, position, pEntry->FileName, start, blocks);
+		}
+		liteentry = (struct BMFSEntry *)(lite.Dir.Entries + liteslot * 64);
+		if (tempentry.FileSize > 0 && bmfs_disk_read(lite.Image + liteentry->StartingBlock * bmfsLiteGeometry.BlockSize, tempentry.FileSize, extent) != 0)
+		{
+			printf("bmfs error: Unexpected read length detected.\n");
+		}
+		else
+		{
+			memset(lite.Image + liteentry->StartingBlock * bmfsLiteGeometry.BlockSize + tempentry.FileSize, 0, liteentry->ReservedBlocks * bmfsLiteGeometry.BlockSize - tempentry.FileSize);
+			liteentry->FileSize = tempentry.FileSize;
+			liteentry->Unused = 0;		// Written here, not by sync
+			copied++;
+		}
+		bmfs_lock(extent, extentsize, BMFS_UNLOCK);
+	}
+
+	if (bmfs_lite_save(litename, &lite) != 0)
+		printf("bmfs error: Unable to write BMFS-Lite disk '%s'\n", litename);
+	else
+		printf("Copied %d files to BMFS-Lite disk\n", copied);
+	free(slots);
+	bmfs_lite_free(&lite);
+}
+
+
+// Copy files from a BMFS-Lite disk onto this disk in one pass, with the
+// same durability as write. If names is NULL every file is copied.
+void bmfs_from_lite(char *litename, char **names, int count)
+{
+	struct BMFSLiteImage lite;
+	char **all = NULL;
+	unsigned int tint;
+
+	if (bmfs_lite_open(litename, &lite) != 0)
+		return;
+	if (names == NULL)
+	{
+		// Every file, in the order they sit in the image
+		if (bmfs_dir_extents(&lite.Dir) != 0 || (all = bmfs_stats_malloc((lite.Dir.ExtentCount + 1) * sizeof(char *))) == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			bmfs_lite_free(&lite);
+			return;
+		}
+		for (tint = 0; tint < lite.Dir.ExtentCount; tint++)
+			all[tint] = lite.Dir.Entries + lite.Dir.ExtentIndex[tint] * 64;
+		names = all;
+		count = lite.Dir.ExtentCount;
+	}
+	bmfs_write_many(names, count, &lite);
+	free(all);
+	bmfs_lite_free(&lite);
+}
+
+
+// Modification time of a host file in nanoseconds
+// sync keeps this in the unused field of the entries it writes
+static unsigned long long bmfs_sync_stamp(struct stat *st)
+{
+#if defined(__linux__)
+	return (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	return (unsigned long long)st->st_mtimespec.tv_sec * 1000000000ULL + st->st_mtimespec.tv_nsec;
+#else
+	return (unsigned long long)st->st_mtime * 1000000000ULL;
+#endif
+}
+
+
+// Check if a host file holds the same data as a file on the disk
+static int bmfs_sync_same(char *path, struct BMFSEntry *fileentry)
+{
+	unsigned long long offset = 0, chunk;
+	char *hostbuf, *diskbuf;
+	FILE *f;
+	int same = 1;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return 0;
+	hostbuf = bmfs_stats_malloc(readChunkSize);
+	diskbuf = bmfs_stats_malloc(readChunkSize);
+	if (hostbuf == NULL || diskbuf == NULL)
+		same = 0;
+	while (same && offset < fileentry->FileSize)
+	{
+		chunk = fileentry->FileSize - offset;
+		if (chunk > readChunkSize)
+			chunk = readChunkSize;
+		if (fread(hostbuf, chunk, 1, f) != 1 || bmfs_disk_read(diskbuf, chunk, fileentry->StartingBlock * blockSize + offset) != 0 || memcmp(hostbuf, diskbuf, chunk) != 0)
+			same = 0;
+		offset += chunk;
+	}
+	free(hostbuf);
+	free(diskbuf);
+	fclose(f);
+	return same;
+}
+
+
+// Blocks freed by files that sync moved in this pass. The directory on the
+// disk still points at them until it is written at the end of the pass, so
+// nothing else may be placed there before then.
+struct BMFSSyncVacated
+{
+	unsigned long long *start;
+	unsigned long long *blocks;
+	unsigned int count;
+};
+
+
+// Returns the index of a vacated extent that overlaps the blocks, or -1
+static int bmfs_sync_vacated(struct BMFSSyncVacated *vacated, unsigned long long start, unsigned long long blocks)
+{
+	unsigned int tint;
+
+	for (tint = 0; tint < vacated->count; tint++)
+	{
+		if (vacated->start[tint] < start + blocks && start < vacated->start[tint] + vacated->blocks[tint])
+			return tint;
+	}
+	return -1;
+}
+
+
+// Find the first run of free blocks that is not a vacated extent either
+// Returns the starting block, or 0 if nothing fits
+static unsigned long long bmfs_sync_place(struct BMFSSyncVacated *vacated, unsigned long long blocks, unsigned int *position)
+{
+	unsigned long long from = firstDataBlock, start;
+	int tint;
+
+	while ((start = bmfs_dir_place(&dir, from, lastDataBlock, blocks, BMFS_FIT_FIRST, position)) != 0)
+	{
+		if ((tint = bmfs_sync_vacated(vacated, start, blocks)) < 0)
+			return start;
+		from = vacated->start[tint] + vacated->blocks[tint];
+	}
+	return 0;
+}
+
+
+// Bring one file on the disk up to date with a host file
+// Returns 1 if data was written, 0 if it was current, or -1 on an error.
+// changed is set if the directory entry was changed. On an error the entry
+// is left as it was, apart from its sync stamp if its data was touched.
+static int bmfs_sync_file(char *path, char *name, struct stat *st, struct BMFSSyncVacated *vacated, int *changed)
+{
+	struct BMFSEntry *pEntry = NULL, saved;
+	unsigned long long size = st->st_size, stamp = bmfs_sync_stamp(st), needed, start, *grown;
+	unsigned int position, end;
+	int slot, added = 0, copied = 0, ret = 1;
+	FILE *tfile;
+
+	slot = bmfs_dir_find(&dir, name);
+	if (slot >= 0)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + slot * 64);
+		if (pEntry->FileSize == size && pEntry->Unused == stamp)
+			return 0;
+		// Files written some other way are compared once and then stamped
+		if (pEntry->FileSize == size && pEntry->Unused == 0 && bmfs_sync_same(path, pEntry))
+		{
+			pEntry->Unused = stamp;
+			*changed = 1;
+			return 0;
+		}
+	}
+
+	needed = bmfs_reserve_blocks(&volumeGeometry, size);
+	if (pEntry == NULL)
+	{
+		slot = bmfs_dir_free_slot(&dir, &end);
+		if (slot == -1 && bmfs_grow_directory() == 0)
+			slot = end;
+		if (slot == -1 || bmfs_dir_names(&dir) != 0)
+		{
+			printf("bmfs error: Cannot create file. No free directory entries.\n");
+			return -1;
+		}
+		start = bmfs_sync_place(vacated, needed, &position);
+		if (start == 0)
+		{
+			printf("bmfs error: Cannot create file of %llu blocks.\n", needed);
+			return -1;
+		}
+		pEntry = (struct BMFSEntry *)(dir.Entries + slot * 64);
+		memcpy(&saved, pEntry, 64);
+		bmfs_dir_add(&dir, slot, end, position, name, start, needed);
+		added = 1;
+	}
+	else
+	{
+		memcpy(&saved, pEntry, 64);
+		if (pEntry->ReservedBlocks < needed)
+		{
+			// Grow into the blocks after the file if they are free, otherwise
+			// move it. The old copy stays reserved until the directory is written.
+			start = pEntry->StartingBlock + pEntry->ReservedBlocks;
+			if (bmfs_dir_place_at(&dir, firstDataBlock, lastDataBlock, start, needed - pEntry->ReservedBlocks, &position) == 0 && bmfs_sync_vacated(vacated, start, needed - pEntry->ReservedBlocks) < 0)
+			{
+				pEntry->ReservedBlocks = needed;
+			}
+			else
+			{
+				start = bmfs_sync_place(vacated, needed, &position);
+				if (start == 0)
+				{
+					printf("bmfs error: Cannot create file of %llu blocks.\n", needed);
+					return -1;
+				}
+				if ((grown = bmfs_stats_realloc(vacated->start, (vacated->count + 1) * sizeof(unsigned long long))) != NULL)
+					vacated->start = grown;
+				if (grown == NULL || (grown = bmfs_stats_realloc(vacated->blocks, (vacated->count + 1) * sizeof(unsigned long long))) == NULL)
+				{
+					printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+					return -1;
+				}
+				vacated->blocks = grown;
+				vacated->start[vacated->count] = pEntry->StartingBlock;
+				vacated->blocks[vacated->count++] = pEntry->ReservedBlocks;
+				pEntry->StartingBlock = start;
+				pEntry->ReservedBlocks = needed;
+				bmfs_dir_drop(&dir);
+			}
+		}
+	}
+
+	if ((tfile = fopen(path, "rb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", path);
+		ret = -1;
+	}
+	else if (bmfs_lock(pEntry->StartingBlock * blockSize, pEntry->ReservedBlocks * blockSize, BMFS_LOCK_WRITE) != 0)
+	{
+		fclose(tfile);
+		ret = -1;
+	}
+	else
+	{
+		copied = 1;
+		if (bmfs_write_extent(tfile, size, pEntry) != 0)
+			ret = -1;
+		bmfs_lock(pEntry->StartingBlock * blockSize, pEntry->ReservedBlocks * blockSize, BMFS_UNLOCK);
+		fclose(tfile);
+	}
+	if (ret != 1)
+	{
+		// A new file is taken out again, and a file written in place has lost
+		// its old contents, so it is compared again by the next pass
+		memcpy(pEntry, &saved, 64);
+		bmfs_dir_drop(&dir);
+		if (!added && copied)
+		{
+			pEntry->Unused = 0;
+			*changed = 1;
+		}
+		return ret;
+	}
+	pEntry->FileSize = size;
+	pEntry->Unused = stamp;
+	*changed = 1;
+	return ret;
+}
+
+
+// Make the disk match the regular files in a host directory
+// If names is set only those files are looked at, otherwise the whole host
+// directory is scanned. Files missing from the host are deleted. Data is
+// written first and the directory is written back once at the end.
+static void bmfs_sync_pass(char *hostdir, char **names, int count)
+{
+	struct BMFSEntry *pEntry;
+	struct dirent *de;
+	struct stat st;
+	DIR *host = NULL;
+	char path[4096], *name;
+	unsigned long long bytes = 0;
+	struct BMFSSyncVacated vacated = { NULL, NULL, 0 };
+	unsigned int tint;
+	int next = 0, changed = 0, written = 0, current = 0, deleted = 0, ret;
+	double start = bmfs_time();
+
+	if (names == NULL && (host = opendir(hostdir)) == NULL)
+	{
+		printf("bmfs error: Could not open local directory '%s'\n", hostdir);
+		return;
+	}
+	if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+	{
+		if (host != NULL)
+			closedir(host);
+		return;
+	}
+	bmfs_disk_read(DiskInfo, 512, 1024);
+	bmfs_load_directory();
+
+	for (;;)
+	{
+		if (names != NULL)
+		{
+			if (next == count)
+				break;
+			name = names[next++];
+		}
+		else
+		{
+			if ((de = readdir(host)) == NULL)
+				break;
+			name = de->d_name;
+		}
+		snprintf(path, sizeof(path), "%s/%s", hostdir, name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (strlen(name) > 31)
+		{
+			printf("bmfs error: Skipping '%s', the name is too long.\n", name);
+			continue;
+		}
+		ret = bmfs_sync_file(path, name, &st, &vacated, &changed);
+		if (ret == 1)
+		{
+			written++;
+			bytes += st.st_size;
+		}
+		else if (ret == 0)
+		{
+			current++;
+		}
+	}
+	if (host != NULL)
+		closedir(host);
+
+	// Delete the files that are no longer on the host
+	for (tint = 0; tint < dir.Count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir.Entries + tint * 64);
+		if (pEntry->FileName[0] == 0x00)
+			break;
+		if (pEntry->FileName[0] == 0x01)
+			continue;
+		if (names != NULL)
+		{
+			for (next = 0; next < count && strcmp(names[next], pEntry->FileName) != 0; next++)
+				;
+			if (next == count)
+				continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", hostdir, pEntry->FileName);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			pEntry->FileName[0] = 0x01;
+			deleted++;
+			changed = 1;
+		}
+	}
+
+	if (changed)
+	{
+		bmfs_dir_drop(&dir);
+		bmfs_commit_data();
+		bmfs_disk_write(dir.Entries, 4096, 4096);
+		if (ExtendedBlocks > 0)
+			bmfs_disk_write(dir.Entries + 4096, ExtendedBlocks * 4096, extendedDirectoryOffset);
+	}
+	bmfs_lock_directory(BMFS_UNLOCK);
+	free(vacated.start);
+	free(vacated.blocks);
+	if (changed)
+		bmfs_commit_metadata();
+	printf("Synced '%s': %d written (%llu bytes), %d current, %d deleted in %.3f seconds.\n", hostdir, written, bytes, current, deleted, bmfs_time() - start);
+	fflush(stdout);
+}
+
+
+// Sync a host directory to the disk, and with --watch keep syncing the
+// files that change until interrupted
+void bmfs_sync_host(char *hostdir)
+{
+#ifdef __linux__
+	long events[1024];	// Aligned for struct inotify_event
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	char **names = NULL, **grown;
+	ssize_t len, pos;
+	int fd, count, tint, done = 0;
+#endif
+
+	bmfs_sync_pass(hostdir, NULL, 0);
+	if (!syncWatch)
+		return;
+
+#ifdef __linux__
+	fd = inotify_init();
+	if (fd < 0 || inotify_add_watch(fd, hostdir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+	{
+		printf("bmfs error: Could not watch local directory '%s'\n", hostdir);
+		return;
+	}
+	printf("Watching '%s' for changes, press Ctrl-C to stop.\n", hostdir);
+	fflush(stdout);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!done)
+	{
+		// Gather the names from a burst of events, waiting until it has been
+		// quiet for 100 ms, so one build is synced in one pass
+		count = 0;
+		while (poll(&pfd, 1, (count == 0 ? -1 : 100)) > 0)
+		{
+			len = read(fd, events, sizeof(events));
+			if (len <= 0)
+			{
+				done = 1;
+				break;
+			}
+			for (pos = 0; pos < len; pos += sizeof(struct inotify_event) + ev->len)
+			{
+				ev = (struct inotify_event *)((char *)events + pos);
+				if (ev->mask & IN_IGNORED)	// The directory itself is gone
+					done = 1;
+				if (ev->len == 0)
+					continue;
+				for (tint = 0; tint < count && strcmp(names[tint], ev->name) != 0; tint++)
+					;
+				if (tint < count)
+					continue;
+				grown = bmfs_stats_realloc(names, (count + 1) * sizeof(char *));
+				if (grown == NULL)
+					continue;
+				names = grown;
+				if ((names[count] = bmfs_strdup(ev->name)) != NULL)
+					count++;
+			}
+		}
+		if (count > 0)
+			bmfs_sync_pass(hostdir, names, count);
+		for (tint = 0; tint < count; tint++)
+			free(names[tint]);
+	}
+	free(names);
+	close(fd);
+#else
+	printf("bmfs error: --watch is only supported on Linux.\n");
+#endif
+}
+
+
+#ifndef _WIN32
+// A connection to serve, part way through sending a request or reading a reply
+struct BMFSServeClient
+{
+	struct BMFSRequest req;
+	size_t have;			// Bytes of the request received so far
+	int fd;				// Descriptor sent with the request, or -1
+	char *out;			// Reply still being sent, or NULL
+	size_t outSize;
+	size_t outSent;
+	double since;			// When the request or reply started
+};
+
+volatile sig_atomic_t serveStop = 0;
+
+static void bmfs_serve_signal(int sig)
+{
+	(void)sig;
+	serveStop = 1;
+}
+
+
+// Modification time and size of the disk, to tell when another process
+// has changed it
+static unsigned long long bmfs_serve_stamp(void)
+{
+	struct stat st;
+
+	fflush(disk);
+	if (fstat(fileno(disk), &st) != 0)
+		return 0;
+	return bmfs_sync_stamp(&st) ^ (unsigned long long)st.st_size;
+}
+
+
+// Reload the disk information and directory if another process changed
+// the disk, keeping the indexes when the directory is the same
+static void bmfs_serve_refresh(unsigned long long *stamp)
+{
+	unsigned long long now = bmfs_serve_stamp();
+
+	if (now == *stamp || bmfs_lock_directory(BMFS_LOCK_READ) != 0)
+		return;
+	bmfs_disk_read(DiskInfo, 512, 1024);
+	bmfs_load_directory();
+	bmfs_lock_directory(BMFS_UNLOCK);
+	*stamp = now;
+}
+
+
+// Copy between the disk and a client's file without going through stdio
+// Returns 0, or -1 on a short read or write
+static int bmfs_serve_copy(int from, unsigned long long fromoff, int to, unsigned long long tooff, unsigned long long length)
+{
+	ssize_t done;
+	char *buffer;
+	size_t chunk;
+
+#ifdef __linux__
+	// The kernel copies straight between the files where it can
+	loff_t in = fromoff, out = tooff;
+
+	while (length > 0 && (done = copy_file_range(from, &in, to, &out, length, 0)) > 0)
+		length -= done;
+	fromoff = in;
+	tooff = out;
+#endif
+	if (length == 0)
+		return 0;
+	if ((buffer = bmfs_stats_malloc(writeChunkSize)) == NULL)
+		return -1;
+	while (length > 0)
+	{
+		chunk = (length < writeChunkSize ? length : writeChunkSize);
+		if ((done = pread(from, buffer, chunk, fromoff)) <= 0 || pwrite(to, buffer, done, tooff) != done)
+			break;
+		fromoff += done;
+		tooff += done;
+		length -= done;
+	}
+	free(buffer);
+	return (length == 0 ? 0 : -1);
+}
+
+
+// Send as much of a client's reply as the socket takes without blocking
+// Returns 0, or -1 if the connection failed
+static int bmfs_serve_flush(int sock, struct BMFSServeClient *client)
+{
+	ssize_t sent;
+
+	while (client->outSent < client->outSize)
+	{
+		sent = send(sock, client->out + client->outSent, client->outSize - client->outSent, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (sent <= 0)
+			return -1;
+		client->outSent += sent;
+	}
+	free(client->out);
+	client->out = NULL;
+	return 0;
+}
+
+
+// Carry out one request against the cached directory
+static void bmfs_serve_request(struct BMFSRequest *req, int fd, struct BMFSReply *reply, char **list)
+{
+	struct BMFSEntry tempentry;
+	struct stat st;
+	unsigned long long padding;
+	char *zeros;
+	unsigned int tint;
+	int slot, ret;
+
+	memset(reply, 0, sizeof(struct BMFSReply));
+	req->Name[31] = '\0';
+	// A pipe or socket could stall the copy, and with it every other client
+	if (req->Op != BMFS_OP_LIST && (req->Name[0] == '\0' || req->Name[0] == 0x01 || (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))))
+	{
+		reply->Status = BMFS_ERR_INVALID;
+		return;
+	}
+	slot = (req->Op == BMFS_OP_LIST ? -1 : bmfs_dir_find(&dir, req->Name));
+	if (slot >= 0)
+		memcpy(&reply->Entry, dir.Entries + slot * 64, 64);
+
+	switch (req->Op)
+	{
+	case BMFS_OP_LIST:
+		*list = bmfs_stats_malloc(dir.Count * 64);
+		if (*list == NULL)
+		{
+			reply->Status = BMFS_ERR_IO;
+			break;
+		}
+		for (tint = 0; tint < dir.Count && dir.Entries[tint * 64] != 0x00; tint++)
+		{
+			if (dir.Entries[tint * 64] != 0x01)
+			{
+				memcpy(*list + reply->Size, dir.Entries + tint * 64, 64);
+				reply->Size += 64;
+			}
+		}
+		break;
+	case BMFS_OP_FIND:
+		if (slot < 0)
+			reply->Status = BMFS_ERR_NOT_FOUND;
+		break;
+	case BMFS_OP_CREATE:
+	case BMFS_OP_WRITE:
+		if (req->Op == BMFS_OP_WRITE && fd < 0)
+		{
+			reply->Status = BMFS_ERR_INVALID;
+			break;
+		}
+		if (slot >= 0 && req->Op == BMFS_OP_CREATE)
+		{
+			reply->Status = BMFS_ERR_EXISTS;
+			break;
+		}
+		if (slot < 0)
+		{
+			// A create reserves what it asks for, a write room to grow as well
+			if (req->Op == BMFS_OP_CREATE)
+				bmfs_create_blocks(req->Name, (req->Size > 0 ? (req->Size + blockSize - 1) / blockSize : 1));
+			else
+				bmfs_create_blocks(req->Name, bmfs_reserve_blocks(&volumeGeometry, req->Size));
+			if ((slot = bmfs_dir_find(&dir, req->Name)) < 0)
+			{
+				reply->Status = BMFS_ERR_NO_SPACE;
+				break;
+			}
+			memcpy(&reply->Entry, dir.Entries + slot * 64, 64);
+			bmfs_commit_metadata();
+		}
+		if (req->Op == BMFS_OP_CREATE)
+			break;
+		memcpy(&tempentry, dir.Entries + slot * 64, 64);
+		if (tempentry.ReservedBlocks * blockSize < req->Size)
+		{
+			reply->Status = BMFS_ERR_NO_SPACE;
+			break;
+		}
+		if (bmfs_lock(tempentry.StartingBlock * blockSize, tempentry.ReservedBlocks * blockSize, BMFS_LOCK_WRITE) != 0)
+		{
+			reply->Status = BMFS_ERR_IO;
+			break;
+		}
+		fflush(disk);
+		ret = bmfs_serve_copy(fd, 0, fileno(disk), tempentry.StartingBlock * blockSize, req->Size);
+		padding = (blockSize - (req->Size % blockSize)) % blockSize;
+		if (ret == 0 && padding > 0)
+		{
+			// 0 the rest of the last block
+			zeros = bmfs_stats_calloc(1, padding);
+			if (zeros == NULL || pwrite(fileno(disk), zeros, padding, tempentry.StartingBlock * blockSize + req->Size) != (ssize_t)padding)
+				ret = -1;
+			free(zeros);
+		}
+		if (ret != 0)
+			reply->Status = BMFS_ERR_IO;
+		bmfsStats.HostReads++;
+		bmfsStats.HostRead += req->Size;
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += req->Size + padding;
+		bmfs_commit_data();
+		if (bmfs_write_size(slot, (reply->Status == BMFS_OK ? req->Size : tempentry.FileSize)) != 0)
+			reply->Status = BMFS_ERR_IO;
+		bmfs_commit_metadata();
+		memcpy(&reply->Entry, dir.Entries + slot * 64, 64);
+		reply->Size = req->Size;
+		break;
+	case BMFS_OP_READ:
+		if (slot < 0)
+		{
+			reply->Status = BMFS_ERR_NOT_FOUND;
+			break;
+		}
+		if (fd < 0)
+		{
+			reply->Status = BMFS_ERR_INVALID;
+			break;
+		}
+		memcpy(&tempentry, dir.Entries + slot * 64, 64);
+		if (bmfs_lock(tempentry.StartingBlock * blockSize, tempentry.ReservedBlocks * blockSize, BMFS_LOCK_READ) != 0)
+		{
+			reply->Status = BMFS_ERR_IO;
+			break;
+		}
+		bmfs_disk_read(&tempentry, 64, bmfs_entry_offset(slot));
+		fflush(disk);
+		if (ftruncate(fd, 0) != 0 || bmfs_serve_copy(fileno(disk), tempentry.StartingBlock * blockSize, fd, 0, tempentry.FileSize) != 0)
+			reply->Status = BMFS_ERR_IO;
+		bmfs_lock(tempentry.StartingBlock * blockSize, tempentry.ReservedBlocks * blockSize, BMFS_UNLOCK);
+		bmfsStats.ImageReads++;
+		bmfsStats.ImageRead += tempentry.FileSize;
+		bmfsStats.HostWrites++;
+		bmfsStats.HostWritten += tempentry.FileSize;
+		memcpy(&reply->Entry, &tempentry, 64);
+		reply->Size = tempentry.FileSize;
+		break;
+	case BMFS_OP_DELETE:
+		if (slot < 0)
+		{
+			reply->Status = BMFS_ERR_NOT_FOUND;
+			break;
+		}
+		bmfs_delete(req->Name);
+		bmfs_commit_metadata();
+		break;
+	default:
+		reply->Status = BMFS_ERR_INVALID;
+	}
+}
+#endif
+
+
+// Keep the disk open and answer requests from clients on a Unix socket
+// Requests are handled one at a time, so changes to the directory are
+// serialized, and the directory is only read again when another process
+// has changed the disk. Client sockets never block: each request is
+// gathered as it arrives and each reply is sent as the client reads it, so
+// a slow or stalled client only holds up itself until it times out.
+void bmfs_serve(char *path)
+{
+#ifdef _WIN32
+	(void)path;
+	printf("bmfs error: serve needs Unix sockets, which this system does not have.\n");
+#else
+	struct sockaddr_un addr;
+	struct pollfd fds[maxClients + 1];
+	struct BMFSServeClient clients[maxClients + 1];
+	struct BMFSServeClient *client;
+	struct BMFSReply reply;
+	unsigned long long stamp = 0, requests = 0;
+	double now;
+	ssize_t got;
+	char *list;
+	int listener, nfds = 1, fd, drop, tint;
+
+	// Data is copied straight between descriptors, which a striped volume does not have
+	if (diskStripe != NULL)
+	{
+		printf("bmfs error: serve does not support striped volumes.\n");
+		return;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path) || (listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		printf("bmfs error: Unable to create socket '%s'\n", path);
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0)
+	{
+		printf("bmfs error: Unable to listen on socket '%s'\n", path);
+		close(listener);
+		return;
+	}
+	signal(SIGINT, bmfs_serve_signal);
+	signal(SIGTERM, bmfs_serve_signal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("Serving '%s' on '%s'\n", diskname, path);
+	fflush(stdout);
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	stamp = bmfs_serve_stamp();
+	bmfs_dir_names(&dir);
+	bmfs_dir_extents(&dir);
+	while (!serveStop)
+	{
+		// Wake up every second to drop clients that have timed out
+		if (poll(fds, nfds, 1000) < 0)
+			continue;			// Interrupted by a signal
+		now = bmfs_time();
+		if ((fds[0].revents & POLLIN) && (fd = accept(listener, NULL, NULL)) >= 0)
+		{
+			if (nfds <= maxClients && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0)
+			{
+				fds[nfds].fd = fd;
+				fds[nfds].events = POLLIN;
+				fds[nfds].revents = 0;
+				memset(&clients[nfds], 0, sizeof(struct BMFSServeClient));
+				clients[nfds].fd = -1;
+				nfds++;
+			}
+			else
+			{
+				close(fd);
+			}
+		}
+		for (tint = nfds - 1; tint > 0; tint--)
+		{
+			client = &clients[tint];
+			drop = 0;
+			if (client->out != NULL)
+			{
+				if (fds[tint].revents & (POLLOUT | POLLERR | POLLHUP))
+					drop = (bmfs_serve_flush(fds[tint].fd, client) != 0);
+			}
+			else if (fds[tint].revents != 0)
+			{
+				got = bmfs_proto_recv_some(fds[tint].fd, (char *)&client->req + client->have, sizeof(client->req) - client->have, &fd);
+				if (fd >= 0 && client->fd < 0)
+					client->fd = fd;
+				else if (fd >= 0)
+					close(fd);
+				if (got > 0)
+				{
+					if (client->have == 0)
+						client->since = now;
+					client->have += got;
+				}
+				else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					drop = 1;
+				}
+			}
+
+			// Carry out a whole request and start sending the reply
+			if (!drop && client->have == sizeof(client->req))
+			{
+				bmfs_serve_refresh(&stamp);
+				list = NULL;
+				bmfs_serve_request(&client->req, client->fd, &reply, &list);
+				if (client->fd >= 0)
+					close(client->fd);
+				client->fd = -1;
+				client->have = 0;
+				stamp = bmfs_serve_stamp();
+				requests++;
+				client->outSize = sizeof(reply) + (list != NULL ? reply.Size : 0);
+				client->outSent = 0;
+				client->since = now;
+				if ((client->out = bmfs_stats_malloc(client->outSize)) == NULL)
+				{
+					drop = 1;
+				}
+				else
+				{
+					memcpy(client->out, &reply, sizeof(reply));
+					if (list != NULL && reply.Size > 0)
+						memcpy(client->out + sizeof(reply), list, reply.Size);
+					drop = (bmfs_serve_flush(fds[tint].fd, client) != 0);
+				}
+				free(list);
+			}
+			if (!drop && (client->have > 0 || client->out != NULL) && now - client->since > serveTimeout)
+				drop = 1;
+
+			if (drop)
+			{
+				close(fds[tint].fd);
+				if (client->fd >= 0)
+					close(client->fd);
+				free(client->out);
+				fds[tint] = fds[nfds - 1];
+				clients[tint] = clients[nfds - 1];
+				nfds--;
+				continue;
+			}
+			fds[tint].events = (client->out != NULL ? POLLOUT : POLLIN);
+		}
+	}
+
+	for (tint = 1; tint < nfds; tint++)
+	{
+		close(fds[tint].fd);
+		if (clients[tint].fd >= 0)
+			close(clients[tint].fd);
+		free(clients[tint].out);
+	}
+	close(listener);
+	unlink(path);
+	printf("Served %llu requests.\n", requests);
+#endif
+}
+
+
+#ifndef _WIN32
+// A patch made by diff: this header, Runs run headers, then the data of
+// every run in the same order
+struct BMFSPatchHeader
+{
+	char Magic[8];			// "BMFSDIF2"
+	u64 OldSize;
+	u64 NewSize;
+	u64 Runs;
+	u64 Bytes;			// Data in all the runs
+	u64 Reserved[3];
+};
+
+// Bytes of the new image to write at an offset, with hashes of what the
+// old and new images hold there
+struct BMFSPatchRun
+{
+	u64 Offset;
+	u64 Length;
+	u64 OldHash;			// Of the part of the run inside the old image
+	u64 NewHash;
+};
+
+// A range of the image compared by a diff worker, or a group of runs
+// hashed or written by a worker
+struct BMFSPatchPiece
+{
+	unsigned long long offset;
+	unsigned long long length;
+};
+
+// What the disk being patched holds in a run
+#define PATCH_RUN_OTHER 0
+#define PATCH_RUN_OLD 1
+#define PATCH_RUN_NEW 2
+
+// Work shared by the diff and patch workers
+struct BMFSPatchScan
+{
+	struct BMFSPatchPiece *pieces;
+	int count;			// Number of pieces
+	int next;			// Next piece to hand out
+	int fd;				// The new image for diff, the patch for patch
+	int checking;			// Hashing the runs on the disk being patched
+	unsigned long long oldSize;
+	unsigned long long diskSize;	// Of the disk being patched
+	unsigned char *changed;		// A bit for each changed page of the new image
+	struct BMFSPatchRun *runs;
+	unsigned long long runCount;
+	unsigned long long *data;	// Offset of the data of each run in the patch
+	unsigned char *state;		// What the disk being patched holds in each run
+	unsigned long long bytes;	// Bytes and calls of all workers
+	unsigned long long calls;
+	unsigned long long allocations;	// Buffers of all workers, counted once they finish
+	unsigned long long allocated;
+	int failed;
+	pthread_mutex_t mutex;
+};
+
+
+// Read or write the disk at a byte offset from any thread, uncounted
+static int bmfs_disk_pio(void *buf, size_t len, unsigned long long offset, int writing)
+{
+	if (diskStripe != NULL)
+		return bmfs_stripe_io(diskStripe, buf, len, offset, writing);
+	if (writing)
+		return (pwrite(fileno(disk), buf, len, offset) == (ssize_t)len ? 0 : -1);
+	return (pread(fileno(disk), buf, len, offset) == (ssize_t)len ? 0 : -1);
+}
+
+
+// Add bytes to an FNV-1a hash, which starts at patchHashStart
+static unsigned long long bmfs_patch_fnv(unsigned long long hash, const unsigned char *buf, size_t len)
+{
+	size_t tint;
+
+	for (tint = 0; tint < len; tint++)
+		hash = (hash ^ buf[tint]) * 1099511628211ULL;
+	return hash;
+}
+
+
+// Run the workers of a diff or patch, or just this thread if none start
+// Returns the number of workers
+static int bmfs_patch_run(struct BMFSPatchScan *scan, void *(*worker)(void *))
+{
+	pthread_t *threads;
+	int jobs = (workerJobs < scan->count ? workerJobs : (scan->count > 0 ? scan->count : 1)), tint;
+
+	scan->next = 0;
+	pthread_mutex_init(&scan->mutex, NULL);
+	threads = bmfs_stats_malloc(jobs * sizeof(pthread_t));
+	for (tint = 0; threads != NULL && tint < jobs; tint++)
+	{
+		if (pthread_create(&threads[tint], NULL, worker, scan) != 0)
+			break;
+	}
+	if (threads == NULL || tint == 0)
+		worker(scan);
+	jobs = (threads == NULL || tint == 0 ? 1 : tint);
+	while (threads != NULL && tint-- > 0)
+		pthread_join(threads[tint], NULL);
+	free(threads);
+	pthread_mutex_destroy(&scan->mutex);
+	bmfsStats.Allocations += scan->allocations;
+	bmfsStats.AllocatedBytes += scan->allocated;
+	scan->allocations = scan->allocated = 0;
+	return jobs;
+}
+
+
+// Split the runs into groups of about the same amount of data, which the
+// workers take in disk order
+static void bmfs_patch_groups(struct BMFSPatchScan *scan, unsigned long long bytes)
+{
+	unsigned long long group = bytes / (workerJobs * 4) + 1, size = 0, tint;
+
+	scan->count = 0;
+	for (tint = 0; tint < scan->runCount; tint++)
+	{
+		if (scan->count == 0 || size >= group)
+		{
+			scan->pieces[scan->count].offset = tint;
+			scan->pieces[scan->count].length = 0;
+			scan->count++;
+			size = 0;
+		}
+		scan->pieces[scan->count - 1].length++;
+		size += scan->runs[tint].Length;
+	}
+}
+
+
+// Compare pieces of the old and new images until there are none left,
+// marking the pages that differ
+static void *bmfs_diff_worker(void *arg)
+{
+	struct BMFSPatchScan *scan = arg;
+	struct BMFSPatchPiece *piece;
+	unsigned long long done, chunk, have, page, length, offset, bytes = 0, calls = 0;
+	size_t step = (readChunkSize > patchPage ? readChunkSize / patchPage * patchPage : patchPage);
+	char *oldbuf = malloc(step), *newbuf = malloc(step);	// Counted by bmfs_patch_run
+	int index, failed = (oldbuf == NULL || newbuf == NULL);
+
+	while (!failed)
+	{
+		pthread_mutex_lock(&scan->mutex);
+		index = scan->next++;
+		pthread_mutex_unlock(&scan->mutex);
+		if (index >= scan->count)
+			break;
+		piece = &scan->pieces[index];
+		for (done = 0; done < piece->length && !failed; done += chunk)
+		{
+			offset = piece->offset + done;
+			chunk = (piece->length - done < step ? piece->length - done : step);
+			// Bytes past the end of the old image always differ
+			have = (offset >= scan->oldSize ? 0 : (scan->oldSize - offset < chunk ? scan->oldSize - offset : chunk));
+			if (pread(scan->fd, newbuf, chunk, offset) != (ssize_t)chunk || (have > 0 && bmfs_disk_pio(oldbuf, have, offset, 0) != 0))
+			{
+				failed = 1;
+				break;
+			}
+			bytes += chunk + have;
+			calls += 2;
+			for (page = 0; page < chunk; page += patchPage)
+			{
+				length = (chunk - page < patchPage ? chunk - page : patchPage);
+				if (page + length > have || memcmp(oldbuf + page, newbuf + page, length) != 0)
+				{
+					pthread_mutex_lock(&scan->mutex);
+					scan->changed[(offset + page) / patchPage / 8] |= 1 << ((offset + page) / patchPage % 8);
+					pthread_mutex_unlock(&scan->mutex);
+				}
+			}
+		}
+	}
+	pthread_mutex_lock(&scan->mutex);
+	scan->bytes += bytes;
+	scan->calls += calls;
+	scan->allocations += 2;
+	scan->allocated += 2 * step;
+	scan->failed |= failed;
+	pthread_mutex_unlock(&scan->mutex);
+	free(oldbuf);
+	free(newbuf);
+	return NULL;
+}
+
+
+// Hash groups of runs until there are none left. For diff this fills in
+// the hashes of the old and new bytes of each run, and for patch it finds
+// out which of them the disk being patched holds.
+static void *bmfs_patch_hash_worker(void *arg)
+{
+	struct BMFSPatchScan *scan = arg;
+	struct BMFSPatchRun *run;
+	unsigned long long tint, done, chunk, end, oldEnd, have, oldHash, newHash, bytes = 0, calls = 0;
+	unsigned char *buffer = malloc(readChunkSize);		// Counted by bmfs_patch_run
+	int index, failed = (buffer == NULL);
+
+	while (!failed)
+	{
+		pthread_mutex_lock(&scan->mutex);
+		index = scan->next++;
+		pthread_mutex_unlock(&scan->mutex);
+		if (index >= scan->count)
+			break;
+		for (tint = scan->pieces[index].offset; tint < scan->pieces[index].offset + scan->pieces[index].length && !failed; tint++)
+		{
+			run = &scan->runs[tint];
+			end = run->Offset + run->Length;
+			// Only the part of a run inside the old image has old bytes
+			oldEnd = (end < scan->oldSize ? end : scan->oldSize);
+			oldHash = newHash = patchHashStart;
+			if (!scan->checking)
+			{
+				for (done = run->Offset; done < oldEnd && !failed; done += chunk)
+				{
+					chunk = (oldEnd - done < readChunkSize ? oldEnd - done : readChunkSize);
+					failed = (bmfs_disk_pio(buffer, chunk, done, 0) != 0);
+					oldHash = bmfs_patch_fnv(oldHash, buffer, chunk);
+					bytes += chunk;
+					calls++;
+				}
+				for (done = run->Offset; done < end && !failed; done += chunk)
+				{
+					chunk = (end - done < readChunkSize ? end - done : readChunkSize);
+					failed = (pread(scan->fd, buffer, chunk, done) != (ssize_t)chunk);
+					newHash = bmfs_patch_fnv(newHash, buffer, chunk);
+					bytes += chunk;
+					calls++;
+				}
+				run->OldHash = oldHash;
+				run->NewHash = newHash;
+				continue;
+			}
+
+			// The disk holds the old bytes of the run, or the new ones if an
+			// earlier patch got this far
+			have = (end < scan->diskSize ? end : scan->diskSize);
+			for (done = run->Offset; done < have && !failed; done += chunk)
+			{
+				chunk = (have - done < readChunkSize ? have - done : readChunkSize);
+				if (done < oldEnd && done + chunk > oldEnd)
+					chunk = oldEnd - done;
+				failed = (bmfs_disk_pio(buffer, chunk, done, 0) != 0);
+				if (done < oldEnd)
+					oldHash = bmfs_patch_fnv(oldHash, buffer, chunk);
+				newHash = bmfs_patch_fnv(newHash, buffer, chunk);
+				bytes += chunk;
+				calls++;
+			}
+			if (have == end && newHash == run->NewHash)
+				scan->state[tint] = PATCH_RUN_NEW;
+			else if (oldEnd <= have && oldHash == run->OldHash)
+				scan->state[tint] = PATCH_RUN_OLD;
+			else
+				scan->state[tint] = PATCH_RUN_OTHER;
+		}
+	}
+	pthread_mutex_lock(&scan->mutex);
+	scan->bytes += bytes;
+	scan->calls += calls;
+	scan->allocations++;
+	scan->allocated += readChunkSize;
+	scan->failed |= failed;
+	pthread_mutex_unlock(&scan->mutex);
+	free(buffer);
+	return NULL;
+}
+
+
+// Find the next run of changed pages at or after *page
+// Returns 1 and sets run, or 0 if there are no more
+static int bmfs_diff_next_run(const unsigned char *changed, unsigned long long size, unsigned long long *page, struct BMFSPatchRun *run)
+{
+	unsigned long long pages = (size + patchPage - 1) / patchPage;
+
+	while (*page < pages && !(changed[*page / 8] & (1 << (*page % 8))))
+		*page += (changed[*page / 8] == 0 && *page % 8 == 0 ? 8 : 1);
+	if (*page >= pages)
+		return 0;
+	run->Offset = *page * patchPage;
+	while (*page < pages && (changed[*page / 8] & (1 << (*page % 8))))
+		(*page)++;
+	run->Length = (*page * patchPage < size ? *page * patchPage : size) - run->Offset;
+	return 1;
+}
+
+
+// Add a range of the new image to compare, split so the workers share it
+static void bmfs_diff_region(struct BMFSPatchScan *scan, unsigned long long start, unsigned long long end, unsigned long long size)
+{
+	const unsigned long long pieceSize = 64 * 1024 * 1024;
+
+	if (end > size)
+		end = size;
+	for (; start < end; start += pieceSize)
+	{
+		if (scan->pieces != NULL)
+		{
+			scan->pieces[scan->count].offset = start;
+			scan->pieces[scan->count].length = (end - start < pieceSize ? end - start : pieceSize);
+		}
+		scan->count++;
+	}
+}
+#endif
+
+
+// Write a patch that turns the disk into another image of the same volume
+// Only the reserved areas and the blocks that hold file data in the new
+// image are compared, 4KiB at a time
+// Returns 0, or 1 if the patch could not be made
+int bmfs_diff(char *newname, char *patchname)
+{
+#ifdef _WIN32
+	(void)newname;
+	(void)patchname;
+	printf("bmfs error: diff is not supported on Windows.\n");
+	return 1;
+#else
+	struct BMFSPatchScan scan;
+	struct BMFSPatchHeader header;
+	struct BMFSPatchRun run;
+	struct BMFSDirectory newdir;
+	struct BMFSGeometry geo = volumeGeometry;
+	struct BMFSEntry *pEntry;
+	char newinfo[512], *buffer = NULL;
+	unsigned long long newSize, newBlockSize = 0, offset = 0, blocks = 0, page, done, chunk, total;
+	double start = bmfs_time(), elapsed;
+	unsigned int tint;
+	int pass, jobs, ret = 0;
+	FILE *patch = NULL;
+
+	memset(&scan, 0, sizeof(scan));
+	memset(&newdir, 0, sizeof(newdir));
+	if ((scan.fd = open(newname, O_RDONLY)) < 0 || (off_t)(newSize = lseek(scan.fd, 0, SEEK_END)) <= 0 || pread(scan.fd, newinfo, 512, 1024) != 512 || strcasecmp(newinfo, fs_tag) != 0)
+	{
+		printf("bmfs error: '%s' is not a BMFS disk\n", newname);
+		if (scan.fd >= 0)
+			close(scan.fd);
+		return 1;
+	}
+
+	// Load the directory of the new image
+	memcpy(&newBlockSize, newinfo + DISKINFO_BLOCK_SIZE, 8);
+	geo.BlockSize = (newBlockSize != 0 ? newBlockSize : defaultBlockSize);
+	memcpy(&offset, newinfo + DISKINFO_EXTENDED_OFFSET, 8);
+	memcpy(&blocks, newinfo + DISKINFO_EXTENDED_BLOCKS, 8);
+	if (offset != extendedDirectoryOffset || blocks > maxExtendedBlocks)
+		blocks = 0;
+	newdir.Count = 64 * (1 + blocks);
+	if ((newdir.Entries = bmfs_stats_calloc(1 + blocks, 4096)) == NULL || pread(scan.fd, newdir.Entries, 4096, 4096) != 4096 || (blocks > 0 && pread(scan.fd, newdir.Entries + 4096, blocks * 4096, extendedDirectoryOffset) != (ssize_t)(blocks * 4096)) || bmfs_dir_extents(&newdir) != 0)
+	{
+		printf("bmfs error: Unable to read the directory of '%s'\n", newname);
+		ret = 1;
+	}
+
+	// The reserved areas at both ends, and the written blocks of every file
+	for (pass = 0; ret == 0 && pass < 2; pass++)
+	{
+		scan.count = 0;
+		bmfs_diff_region(&scan, 0, bmfs_first_block(&geo) * geo.BlockSize, newSize);
+		for (tint = 0; tint < newdir.ExtentCount; tint++)
+		{
+			pEntry = (struct BMFSEntry *)(newdir.Entries + newdir.ExtentIndex[tint] * 64);
+			bmfs_diff_region(&scan, pEntry->StartingBlock * geo.BlockSize, (pEntry->StartingBlock + (pEntry->FileSize + geo.BlockSize - 1) / geo.BlockSize) * geo.BlockSize, newSize);
+		}
+		bmfs_diff_region(&scan, bmfs_last_block(&geo, newSize) * geo.BlockSize, newSize, newSize);
+		if (pass == 0 && (scan.pieces = bmfs_stats_malloc((scan.count + 1) * sizeof(struct BMFSPatchPiece))) == NULL)
+			ret = 1;
+	}
+	scan.oldSize = (diskStripe != NULL ? diskStripe->Length : (unsigned long long)lseek(fileno(disk), 0, SEEK_END));
+	if (ret == 0 && (scan.changed = bmfs_stats_calloc((newSize + patchPage - 1) / patchPage / 8 + 1, 1)) == NULL)
+		ret = 1;
+	if (ret == 0)
+	{
+		fflush(disk);
+		jobs = bmfs_patch_run(&scan, bmfs_diff_worker);
+		total = 0;
+		for (tint = 0; tint < (unsigned int)scan.count; tint++)
+			total += scan.pieces[tint].length;
+		elapsed = bmfs_time() - start;
+		if (!scan.failed)
+			printf("Compared %llu of %llu MiB with %d workers in %.3f seconds (%.1f MiB/s)\n", total / 1048576, newSize / 1048576, jobs, elapsed, (elapsed > 0 ? total / 1048576.0 / elapsed : 0));
+	}
+
+	// Gather the runs of changed pages and hash what each image holds there
+	memset(&header, 0, sizeof(header));
+	memcpy(header.Magic, "BMFSDIF2", 8);
+	header.OldSize = scan.oldSize;
+	header.NewSize = newSize;
+	for (page = 0; ret == 0 && !scan.failed && bmfs_diff_next_run(scan.changed, newSize, &page, &run); )
+		scan.runCount++;
+	free(scan.pieces);
+	scan.pieces = NULL;
+	if (ret == 0 && !scan.failed)
+	{
+		scan.runs = bmfs_stats_malloc((scan.runCount + 1) * sizeof(struct BMFSPatchRun));
+		scan.pieces = bmfs_stats_malloc((scan.runCount + 1) * sizeof(struct BMFSPatchPiece));
+		if (scan.runs == NULL || scan.pieces == NULL)
+			ret = 1;
+	}
+	if (ret == 0 && !scan.failed)
+	{
+		for (page = 0, header.Runs = 0; bmfs_diff_next_run(scan.changed, newSize, &page, &scan.runs[header.Runs]); header.Runs++)
+			header.Bytes += scan.runs[header.Runs].Length;
+		bmfs_patch_groups(&scan, header.Bytes);
+		bmfs_patch_run(&scan, bmfs_patch_hash_worker);
+	}
+	bmfsStats.ImageReads += scan.calls;
+	bmfsStats.ImageRead += scan.bytes;
+	if (scan.failed)
+	{
+		printf("bmfs error: Unable to read the disks\n");
+		ret = 1;
+	}
+
+	// Write the header and every run, then the data of every run
+	if (ret == 0 && ((patch = fopen(patchname, "wb")) == NULL || (buffer = bmfs_stats_malloc(readChunkSize)) == NULL || fwrite(&header, sizeof(header), 1, patch) != 1 || fwrite(scan.runs, sizeof(struct BMFSPatchRun), header.Runs, patch) != header.Runs))
+		ret = 1;
+	for (page = 0; ret == 0 && page < header.Runs; page++)
+	{
+		for (done = 0; ret == 0 && done < scan.runs[page].Length; done += chunk)
+		{
+			chunk = (scan.runs[page].Length - done < readChunkSize ? scan.runs[page].Length - done : readChunkSize);
+			if (pread(scan.fd, buffer, chunk, scan.runs[page].Offset + done) != (ssize_t)chunk || fwrite(buffer, chunk, 1, patch) != 1)
+				ret = 1;
+			bmfsStats.HostReads++;
+			bmfsStats.HostRead += chunk;
+			bmfsStats.HostWrites++;
+			bmfsStats.HostWritten += chunk;
+		}
+	}
+	if (patch != NULL && fclose(patch) != 0)
+		ret = 1;
+	if (ret == 0)
+	{
+		total = sizeof(header) + header.Runs * sizeof(struct BMFSPatchRun) + header.Bytes;
+		printf("Patch '%s': %llu runs, %llu bytes (a full copy is %llu MiB, %.1f%% saved)\n", patchname, (unsigned long long)header.Runs, total, newSize / 1048576, 100.0 - total * 100.0 / newSize);
+	}
+	else if (patch != NULL)
+	{
+		printf("bmfs error: Unable to write patch '%s'\n", patchname);
+		remove(patchname);
+	}
+
+	free(buffer);
+	free(scan.changed);
+	free(scan.pieces);
+	free(scan.runs);
+	bmfs_dir_drop(&newdir);
+	free(newdir.Entries);
+	close(scan.fd);
+	return ret;
+#endif
+}
+
+
+#ifndef _WIN32
+// Write groups of runs from the patch to the disk until there are none
+// left, skipping runs the disk already holds the new bytes of
+static void *bmfs_patch_worker(void *arg)
+{
+	struct BMFSPatchScan *scan = arg;
+	struct BMFSPatchPiece *piece;
+	struct BMFSPatchRun *run;
+	unsigned long long tint, done, chunk, bytes = 0, calls = 0;
+	char *buffer = malloc(writeChunkSize);			// Counted by bmfs_patch_run
+	int index, failed = (buffer == NULL);
+
+	while (!failed)
+	{
+		pthread_mutex_lock(&scan->mutex);
+		index = scan->next++;
+		pthread_mutex_unlock(&scan->mutex);
+		if (index >= scan->count)
+			break;
+		piece = &scan->pieces[index];
+		// Each group is written in order, so every worker writes sequentially
+		for (tint = piece->offset; tint < piece->offset + piece->length && !failed; tint++)
+		{
+			run = &scan->runs[tint];
+			for (done = 0; done < run->Length && scan->state[tint] != PATCH_RUN_NEW; done += chunk)
+			{
+				chunk = (run->Length - done < writeChunkSize ? run->Length - done : writeChunkSize);
+				if (pread(scan->fd, buffer, chunk, scan->data[tint] + done) != (ssize_t)chunk || bmfs_disk_pio(buffer, chunk, run->Offset + done, 1) != 0)
+				{
+					failed = 1;
+					break;
+				}
+				bytes += chunk;
+				calls++;
+			}
+		}
+	}
+	pthread_mutex_lock(&scan->mutex);
+	scan->bytes += bytes;
+	scan->calls += calls;
+	scan->allocations++;
+	scan->allocated += writeChunkSize;
+	scan->failed |= failed;
+	pthread_mutex_unlock(&scan->mutex);
+	free(buffer);
+	return NULL;
+}
+#endif
+
+
+// Apply a patch made by diff to the disk, which must hold the old image
+// or be partly patched. Every run is hashed on the disk first, and only the
+// runs that still hold the old bytes are written.
+// Returns 0, or 1 if it could not be applied
+int bmfs_patch(char *patchname)
+{
+#ifdef _WIN32
+	(void)patchname;
+	printf("bmfs error: patch is not supported on Windows.\n");
+	return 1;
+#else
+	struct BMFSPatchScan scan;
+	struct BMFSPatchHeader header;
+	unsigned long long size, locked, tint, offset, runs = 0, bytes = 0;
+	double start = bmfs_time(), elapsed;
+	int jobs, other = 0, ret = 0;
+
+	memset(&scan, 0, sizeof(scan));
+	if ((scan.fd = open(patchname, O_RDONLY)) < 0 || pread(scan.fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.Magic, "BMFSDIF2", 8) != 0 || (unsigned long long)lseek(scan.fd, 0, SEEK_END) != sizeof(header) + header.Runs * sizeof(struct BMFSPatchRun) + header.Bytes)
+	{
+		printf("bmfs error: '%s' is not a BMFS patch\n", patchname);
+		if (scan.fd >= 0)
+			close(scan.fd);
+		return 1;
+	}
+
+	// The disk has to be the image the patch was made from, or that image
+	// after an earlier patch was cut short
+	fflush(disk);
+	size = (diskStripe != NULL ? diskStripe->Length : (unsigned long long)lseek(fileno(disk), 0, SEEK_END));
+	if (size != header.OldSize && size != header.NewSize)
+	{
+		printf("bmfs error: The disk is not the image patch '%s' was made from\n", patchname);
+		close(scan.fd);
+		return 1;
+	}
+	if (size != header.NewSize && diskStripe != NULL)
+	{
+		printf("bmfs error: The size of a striped volume or several targets cannot be changed\n");
+		close(scan.fd);
+		return 1;
+	}
+
+	scan.runCount = header.Runs;
+	scan.runs = bmfs_stats_malloc((header.Runs + 1) * sizeof(struct BMFSPatchRun));
+	scan.data = bmfs_stats_malloc((header.Runs + 1) * sizeof(unsigned long long));
+	scan.pieces = bmfs_stats_malloc((header.Runs + 1) * sizeof(struct BMFSPatchPiece));
+	scan.state = bmfs_stats_malloc(header.Runs + 1);
+	if (scan.runs == NULL || scan.data == NULL || scan.pieces == NULL || scan.state == NULL || pread(scan.fd, scan.runs, header.Runs * sizeof(struct BMFSPatchRun), sizeof(header)) != (ssize_t)(header.Runs * sizeof(struct BMFSPatchRun)))
+	{
+		printf("bmfs error: Unable to read patch '%s'\n", patchname);
+		ret = 1;
+	}
+	offset = sizeof(header) + header.Runs * sizeof(struct BMFSPatchRun);
+	for (tint = 0; ret == 0 && tint < header.Runs; tint++)
+	{
+		if (scan.runs[tint].Offset + scan.runs[tint].Length > header.NewSize || scan.runs[tint].Offset + scan.runs[tint].Length < scan.runs[tint].Offset)
+		{
+			printf("bmfs error: '%s' is not a BMFS patch\n", patchname);
+			ret = 1;
+		}
+		scan.data[tint] = offset;
+		offset += scan.runs[tint].Length;
+	}
+	if (ret != 0)
+	{
+		free(scan.runs);
+		free(scan.data);
+		free(scan.pieces);
+		free(scan.state);
+		close(scan.fd);
+		return ret;
+	}
+
+	// Find out what the disk holds in every run, under the lock so it cannot
+	// change before the runs are written
+	locked = (size > header.NewSize ? size : header.NewSize);
+	if (bmfs_lock(0, locked, BMFS_LOCK_WRITE) != 0)
+	{
+		free(scan.runs);
+		free(scan.data);
+		free(scan.pieces);
+		free(scan.state);
+		close(scan.fd);
+		return 1;
+	}
+	scan.oldSize = header.OldSize;
+	scan.diskSize = size;
+	scan.checking = 1;
+	bmfs_patch_groups(&scan, header.Bytes);
+	jobs = bmfs_patch_run(&scan, bmfs_patch_hash_worker);
+	bmfsStats.ImageReads += scan.calls;
+	bmfsStats.ImageRead += scan.bytes;
+	for (tint = 0; !scan.failed && tint < header.Runs; tint++)
+	{
+		if (scan.state[tint] == PATCH_RUN_OTHER)
+			other++;
+		else if (scan.state[tint] == PATCH_RUN_OLD)
+		{
+			runs++;
+			bytes += scan.runs[tint].Length;
+		}
+	}
+	if (scan.failed)
+	{
+		printf("bmfs error: Unable to read the disk\n");
+		ret = 1;
+	}
+	else if (other > 0)
+	{
+		printf("bmfs error: The disk is not the image patch '%s' was made from (%d of %llu runs differ)\n", patchname, other, (unsigned long long)header.Runs);
+		ret = 1;
+	}
+	else if (runs == 0 && size == header.NewSize)
+	{
+		printf("Patch '%s' is already applied.\n", patchname);
+	}
+	else if (header.NewSize != size && ftruncate(fileno(disk), header.NewSize) != 0)
+	{
+		printf("bmfs error: Unable to change the size of the disk\n");
+		ret = 1;
+	}
+	else
+	{
+		scan.bytes = scan.calls = 0;
+		jobs = bmfs_patch_run(&scan, bmfs_patch_worker);
+		bmfsStats.HostReads += scan.calls;
+		bmfsStats.HostRead += scan.bytes;
+		bmfsStats.ImageWrites += scan.calls;
+		bmfsStats.ImageWritten += scan.bytes;
+		bmfs_commit_data();
+		if (scan.failed)
+		{
+			printf("bmfs error: Unable to write the disk, it is only partly patched\n");
+			ret = 1;
+		}
+		else
+		{
+			elapsed = bmfs_time() - start;
+			printf("Applied %llu of %llu runs, %llu bytes with %d workers in %.3f seconds (a full copy is %llu MiB, %.1f%% saved)\n", runs, (unsigned long long)header.Runs, bytes, jobs, elapsed, (unsigned long long)header.NewSize / 1048576, 100.0 - bytes * 100.0 / header.NewSize);
+		}
+	}
+	bmfs_lock(0, locked, BMFS_UNLOCK);
+
+	free(scan.runs);
+	free(scan.data);
+	free(scan.pieces);
+	free(scan.state);
+	close(scan.fd);
+	return ret;
+#endif
+}
+
+
+void bmfs_delete(char *filename)
+{
+	struct BMFSEntry tempentry;
+	char delmarker = 0x01;
+	int slot;
+
+	if (0 == bmfs_find(filename, &tempentry, &slot))
+	{
+		printf("bmfs error: File not found in BMFS.\n");
+	}
+	else
+	{
+		// Take the directory entry, wait for readers and writers of the file,
+		// then update the entry unless another process got to it first
+		if (bmfs_lock(bmfs_entry_offset(slot), 64, BMFS_LOCK_WRITE) != 0)
+			return;
+		bmfs_disk_read(&tempentry, 64, bmfs_entry_offset(slot));
+		if (strcmp(tempentry.FileName, filename) == 0 && bmfs_lock(tempentry.StartingBlock*blockSize, tempentry.ReservedBlocks*blockSize, BMFS_LOCK_WRITE) == 0)
+		{
+			tempentry.FileName[0] = delmarker;
+			bmfs_disk_write(&tempentry, 64, bmfs_entry_offset(slot));
+			memcpy(dir.Entries+(slot*64), &tempentry, 64);
+			bmfs_dir_drop(&dir);
+			bmfs_lock(tempentry.StartingBlock*blockSize, tempentry.ReservedBlocks*blockSize, BMFS_UNLOCK);
+		}
+		bmfs_lock(bmfs_entry_offset(slot), 64, BMFS_UNLOCK);
+	}
+}
+
+
+// Open a disk image, the members of a striped volume if name is a
+// descriptor, or every disk of a comma separated list of targets, which
+// then look like one image through the stream
+FILE *bmfs_disk_open(char *name, char *mode)
+{
+	FILE *f;
+	int targets = (strchr(name, ',') != NULL && access(name, F_OK) != 0);
+#ifndef _WIN32
+	int ret;
+#endif
+
+	if (!targets && !bmfs_stripe_check(name))
+	{
+		if ((f = fopen(name, mode)) == NULL)
+			printf("bmfs error: Unable to open disk '%s'\n", name);
+		return f;
+	}
+#ifdef _WIN32
+	printf("bmfs error: %s are not supported on Windows.\n", (targets ? "Multiple target disks" : "Striped volumes"));
+	return NULL;
+#else
+	if (targets && (ret = bmfs_stripe_mirror(name, mode, &diskStripe)) != 0)
+	{
+		if (ret == -1)
+			printf("bmfs error: '%s' is not a valid list of disks\n", name);
+		else if (ret == -2)
+			printf("bmfs error: Unable to open any of the disks '%s'\n", name);
+		else
+			printf("bmfs error: The disks '%s' do not hold the same BMFS volume\n", name);
+		return NULL;
+	}
+	if (!targets && (ret = bmfs_stripe_open(name, mode, &diskStripe)) != 0)
+	{
+		if (ret == -1)
+			printf("bmfs error: '%s' is not a valid striped volume descriptor\n", name);
+		else if (ret == -2)
+			printf("bmfs error: Unable to open every member of '%s'\n", name);
+		else
+			printf("bmfs error: The members of '%s' do not have matching sizes\n", name);
+		return NULL;
+	}
+	if ((f = bmfs_stripe_stream(diskStripe)) == NULL)
+	{
+		printf("bmfs error: Unable to open disk '%s'\n", name);
+		diskStripe = NULL;
+	}
+	return f;
+#endif
+}
+
+
+// Show how each of several target disks did, after flushing the stream
+// Returns 0, or -1 if any of them failed
+int bmfs_disk_report(void)
+{
+	int ret = 0;
+#ifndef _WIN32
+	unsigned int tint;
+
+	if (disk == NULL || diskStripe == NULL || !diskStripe->Mirror)
+		return 0;
+	fflush(disk);
+	for (tint = 0; tint < diskStripe->Count; tint++)
+	{
+		if (diskStripe->Error[tint] != 0)
+			ret = -1;
+	}
+	if (!diskStripe->Writable && ret == 0)
+		return 0;
+	printf("%-32s %14s %10s  %s\n", "Target", "Written (MiB)", "MiB/s", "Status");
+	for (tint = 0; tint < diskStripe->Count; tint++)
+	{
+		printf("%-32s %14.1f %10.1f  %s\n", diskStripe->Path[tint], diskStripe->Written[tint] / 1048576.0, (diskStripe->Busy[tint] > 0 ? diskStripe->Written[tint] / 1048576.0 / diskStripe->Busy[tint] : 0), (diskStripe->Error[tint] == 0 ? "ok" : strerror(diskStripe->Error[tint])));
+	}
+#endif
+	return ret;
+}
+
+
+// Add how far the slowest of several target disks has got, and how many
+// have failed, to a progress line. One short part whatever the number of
+// disks, so the line still fits and can be redrawn in place.
+void bmfs_disk_progress(void)
+{
+#ifndef _WIN32
+	unsigned int tint, slowest = 0, failed = 0;
+	int found = 0;
+
+	if (diskStripe == NULL || !diskStripe->Mirror)
+		return;
+	pthread_mutex_lock(&diskStripe->Lock);
+	for (tint = 0; tint < diskStripe->Count; tint++)
+	{
+		if (diskStripe->Error[tint] != 0)
+			failed++;
+		else if (!found++ || diskStripe->Written[tint] < diskStripe->Written[slowest])
+			slowest = tint;
+	}
+	if (found)
+		printf(", slowest disk %u at %.0f MiB", slowest + 1, diskStripe->Written[slowest] / 1048576.0);
+	pthread_mutex_unlock(&diskStripe->Lock);
+	if (failed)
+		printf(", %u failed", failed);
+#endif
+}
+
+
+// Read from the disk at a byte offset without disturbing the stream position
+int bmfs_disk_read(void *buf, size_t len, unsigned long long offset)
+{
+	double begin = bmfs_trace_io_begin();
+	int ret;
+
+	bmfsStats.ImageReads++;
+	bmfsStats.ImageRead += len;
+#ifdef _WIN32
+	bmfs_seek(disk, offset);
+	ret = (fread(buf, len, 1, disk) == 1 ? 0 : -1);
+#else
+	fflush(disk);
+	if (diskStripe != NULL)
+		ret = bmfs_stripe_io(diskStripe, buf, len, offset, 0);
+	else
+		ret = (pread(fileno(disk), buf, len, offset) == (ssize_t)len ? 0 : -1);
+#endif
+	bmfs_trace_io("image read", begin, len);
+	return ret;
+}
+
+
+// Write to the disk at a byte offset in a single call
+int bmfs_disk_write(const void *buf, size_t len, unsigned long long offset)
+{
+	double begin = bmfs_trace_io_begin();
+	int ret;
+
+	bmfsStats.ImageWrites++;
+	bmfsStats.ImageWritten += len;
+	if ((offset >= 1024 && offset < 8192) || (offset >= extendedDirectoryOffset && offset < extendedDirectoryOffset + maxExtendedBlocks * 4096))
+		bmfsStats.DirectoryWrites++;
+#ifdef _WIN32
+	bmfs_seek(disk, offset);
+	ret = (fwrite(buf, len, 1, disk) == 1 ? 0 : -1);
+	fflush(disk);
+#else
+	fflush(disk);
+	if (diskStripe != NULL)
+		ret = bmfs_stripe_io(diskStripe, (void *)buf, len, offset, 1);
+	else
+		ret = (pwrite(fileno(disk), buf, len, offset) == (ssize_t)len ? 0 : -1);
+#endif
+	bmfs_trace_io("image write", begin, len);
+	return ret;
+}
+
+
+// Take or release an advisory lock on a byte range of the disk
+// Locks wait for conflicting locks held by other processes to be released,
+// unless BMFS_LOCK_NOWAIT is given. Locks are always waited for in one
+// order, the directory (including single entries) before file extents, so
+// the deadlocks fcntl reports cannot happen between bmfs processes.
+// Returns 0, or -1 with the error reported, except for a busy NOWAIT lock
+int bmfs_lock(unsigned long long offset, unsigned long long length, int type)
+{
+	int nowait = type & BMFS_LOCK_NOWAIT;
+#ifdef _WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(disk));
+	OVERLAPPED ov;
+	double begin = bmfs_trace_begin();
+	int ret;
+
+	type &= ~BMFS_LOCK_NOWAIT;
+	bmfsStats.Locks++;
+	fflush(disk);
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if (type == BMFS_UNLOCK)
+		ret = (UnlockFileEx(handle, 0, (DWORD)length, (DWORD)(length >> 32), &ov) ? 0 : -1);
+	else
+		ret = (LockFileEx(handle, (type == BMFS_LOCK_WRITE ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (nowait ? LOCKFILE_FAIL_IMMEDIATELY : 0), 0, (DWORD)length, (DWORD)(length >> 32), &ov) ? 0 : -1);
+	if (ret != 0 && nowait && GetLastError() == ERROR_LOCK_VIOLATION)
+		return -1;
+	if (type != BMFS_UNLOCK)
+		bmfs_trace_span("wait", "lock", begin, length);
+#else
+	struct flock fl;
+	double begin = bmfs_trace_begin();
+	unsigned int tint, count = 1;
+	int fd, ret = 0;
+
+	type &= ~BMFS_LOCK_NOWAIT;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = (type == BMFS_LOCK_WRITE ? F_WRLCK : (type == BMFS_LOCK_READ ? F_RDLCK : F_UNLCK));
+	fl.l_whence = SEEK_SET;
+	fl.l_start = offset;
+	fl.l_len = length;
+	bmfsStats.Locks++;
+	fflush(disk);
+	// The ranges of a striped volume are locked on its first member, and
+	// those of several targets on every one of them
+	if (diskStripe != NULL && diskStripe->Mirror)
+		count = diskStripe->Count;
+	for (tint = 0; ret == 0 && tint < count; tint++)
+	{
+		fd = (diskStripe == NULL ? fileno(disk) : diskStripe->Fd[tint]);
+		if (fd < 0)
+			continue;
+		while ((ret = fcntl(fd, (nowait || type == BMFS_UNLOCK ? F_SETLK : F_SETLKW), &fl)) != 0 && errno == EINTR)
+			;
+	}
+	if (ret != 0 && type != BMFS_UNLOCK)
+	{
+		// Let go of the targets already locked
+		int error = errno;
+
+		fl.l_type = F_UNLCK;
+		while (--tint > 0)
+		{
+			if (diskStripe->Fd[tint - 1] >= 0)
+				fcntl(diskStripe->Fd[tint - 1], F_SETLK, &fl);
+		}
+		errno = error;
+		if (nowait && (errno == EAGAIN || errno == EACCES))
+			return -1;
+	}
+	if (type != BMFS_UNLOCK)
+		bmfs_trace_span("wait", "lock", begin, length);
+#endif
+	if (ret != 0)
+	{
+		printf("bmfs error: Unable to %s bytes %llu to %llu of the disk: %s\n", (type == BMFS_UNLOCK ? "unlock" : "lock"), offset, offset + length, strerror(errno));
+		lockFailed = 1;
+	}
+	return ret;
+}
+
+
+// Flush a file all the way to the device
+void bmfs_sync(FILE *f)
+{
+	double begin = bmfs_trace_begin();
+
+	bmfsStats.Syncs++;
+	fflush(f);
+#ifdef _WIN32
+	_commit(_fileno(f));
+#else
+	if (f == disk && diskStripe != NULL)
+		bmfs_stripe_sync(diskStripe);
+	else
+		fsync(fileno(f));
+#endif
+	bmfs_trace_span("io", "sync", begin, 0);
+}
+
+
+// Monotonic wall clock in seconds
+double bmfs_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+// Ask the OS to start reading a range of the disk ahead of time
+static void bmfs_readahead(unsigned long long offset, unsigned long long length)
+{
+#if defined(__linux__)
+	fflush(disk);
+	posix_fadvise(fileno(disk), offset, length, POSIX_FADV_WILLNEED);
+#else
+	(void)offset;
+	(void)length;
+#endif
+}
+
+
+// Ask the OS to drop its cached pages for a range of the disk so the
+// next read has to come from the device
+// Returns 0, or -1 if the cache could not be dropped and reads of the range
+// would come from memory
+static int bmfs_drop_cache(unsigned long long offset, unsigned long long length)
+{
+#if defined(__linux__)
+	unsigned int tint;
+	int ret = 0;
+
+	if (diskStripe == NULL)
+		return (posix_fadvise(fileno(disk), offset, length, POSIX_FADV_DONTNEED) == 0 ? 0 : -1);
+	// The range is spread over the members, so drop all of each one
+	for (tint = 0; tint < diskStripe->Count; tint++)
+	{
+		if (diskStripe->Error[tint] == 0 && posix_fadvise(diskStripe->Fd[tint], 0, 0, POSIX_FADV_DONTNEED) != 0)
+			ret = -1;
+	}
+	return ret;
+#else
+	(void)offset;
+	(void)length;
+	return -1;
+#endif
+}
+
+
+// Start a sequential copy through a file at the given offset
+// With --stream the copied data is dropped from the page cache behind the copy
+static void bmfs_stream_begin(struct BMFSStream *stream, FILE *f, unsigned long long offset, int writing)
+{
+	stream->f = f;
+	stream->start = offset;
+	stream->end = offset;
+	stream->writing = writing;
+#if defined(__linux__)
+	if (streamMode)
+		posix_fadvise(fileno(f), offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+
+// Record that another chunk has been copied
+static void bmfs_stream_advance(struct BMFSStream *stream, unsigned long long length)
+{
+	stream->end += length;
+#if defined(__linux__)
+	if (!streamMode)
+		return;
+	if (stream->writing)
+	{
+		// Start writeback of the new data, then wait for and drop everything
+		// older than one window so dirty pages never pile up
+		fflush(stream->f);
+		sync_file_range(fileno(stream->f), stream->end - length, length, SYNC_FILE_RANGE_WRITE);
+		if (stream->end - stream->start >= 2ULL * streamWindow)
+		{
+			unsigned long long drop = stream->end - streamWindow - stream->start;
+			sync_file_range(fileno(stream->f), stream->start, drop, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(fileno(stream->f), stream->start, drop, POSIX_FADV_DONTNEED);
+			stream->start += drop;
+		}
+	}
+	else
+	{
+		posix_fadvise(fileno(stream->f), stream->start, stream->end - stream->start, POSIX_FADV_DONTNEED);
+		stream->start = stream->end;
+	}
+#endif
+}
+
+
+// Finish a sequential copy, dropping whatever is left of it from the page cache
+static void bmfs_stream_end(struct BMFSStream *stream)
+{
+#if defined(__linux__)
+	if (!streamMode || stream->end == stream->start)
+		return;
+	if (stream->writing)
+	{
+		fflush(stream->f);
+		sync_file_range(fileno(stream->f), stream->start, stream->end - stream->start, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+	posix_fadvise(fileno(stream->f), stream->start, stream->end - stream->start, POSIX_FADV_DONTNEED);
+	stream->start = stream->end;
+#else
+	(void)stream;
+#endif
+}
+
+
+// Advance the streams of a copy after each chunk, padding only touches the disk
+static void bmfs_copy_progress(void *ctx, size_t length, int padding)
+{
+	struct BMFSCopy *copy = ctx;
+
+	bmfs_stream_advance(&copy->disk, length);
+	if (padding == 0)
+		bmfs_stream_advance(&copy->file, length);
+}
+
+
+// Size of the system page cache in bytes, or -1 if it is not known
+static long long bmfs_page_cache(void)
+{
+	long long cached = -1;
+#if defined(__linux__)
+	char line[128];
+	FILE *meminfo;
+
+	if ((meminfo = fopen("/proc/meminfo", "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), meminfo) != NULL)
+		{
+			if (sscanf(line, "Cached: %lld kB", &cached) == 1)
+			{
+				cached *= 1024;
+				break;
+			}
+		}
+		fclose(meminfo);
+	}
+#endif
+	return cached;
+}
+
+
+// Find the largest run of unreserved blocks on the disk
+static unsigned long long bmfs_largest_free(unsigned long long *start)
+{
+	unsigned long long prev_file_end = firstDataBlock;
+	unsigned long long largest = 0;
+	unsigned long long this_file_start;
+	unsigned int tint;
+	struct BMFSEntry *pEntry = NULL;
+
+	*start = 0;
+	if (bmfs_dir_extents(&dir) != 0)
+		return 0;
+	for (tint = 0; tint < dir.ExtentCount + 1; tint++)
+	{
+		if (tint == dir.ExtentCount)
+		{
+			this_file_start = lastDataBlock; // start of the reserved area at the end
+		}
+		else
+		{
+			pEntry = (struct BMFSEntry *)(dir.Entries + dir.ExtentIndex[tint] * 64);
+			this_file_start = pEntry->StartingBlock;
+		}
+
+		if (this_file_start > prev_file_end && this_file_start - prev_file_end > largest)
+		{
+			largest = this_file_start - prev_file_end;
+			*start = prev_file_end;
+		}
+
+		if (tint < dir.ExtentCount && pEntry->StartingBlock + pEntry->ReservedBlocks > prev_file_end)
+			prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+
+	return largest;
+}
+
+
+// Probe the disk with a range of chunk sizes and save the fastest to the profile
+// Returns 0, or 1 if the probe could not be run or did not finish
+int bmfs_tune(unsigned long long scratchsize)
+{
+	size_t chunks[] = { 4096, 16384, 65536, 262144, 1048576, 2097152, 4194304, 8388608 };
+	int num_chunks = sizeof(chunks) / sizeof(chunks[0]);
+	double writeRate[8], readRate[8];
+	double best = 0, start;
+	unsigned long long scratchstart, scratchblocks, scratchbytes, done;
+	size_t chunk = 0;
+	int tint, bar, bestread = 0, bestwrite = 0, cached = 0, failed = 0;
+	char *buffer;
+
+	// The probe runs in free space so no file data is touched, and holds the
+	// directory so nothing can be allocated there until it is done
+	if (bmfs_lock_directory(BMFS_LOCK_WRITE) != 0)
+		return 1;
+	bmfs_disk_read(DiskInfo, 512, 1024);
+	bmfs_load_directory();
+	scratchblocks = bmfs_largest_free(&scratchstart);
+	if (scratchblocks == 0)
+	{
+		printf("bmfs error: No free space available for tuning.\n");
+		bmfs_lock_directory(BMFS_UNLOCK);
+		return 1;
+	}
+	if (scratchblocks > scratchsize * 1048576 / blockSize)
+		scratchblocks = scratchsize * 1048576 / blockSize;
+	scratchbytes = scratchblocks * blockSize;
+
+	buffer = bmfs_stats_malloc(chunks[num_chunks - 1]);
+	if (buffer == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		bmfs_lock_directory(BMFS_UNLOCK);
+		return 1;
+	}
+	memset(buffer, 0, chunks[num_chunks - 1]);
+
+	printf("Tuning with %llu MiB of scratch space at block %llu\n", scratchbytes / 1048576, scratchstart);
+	for (tint = 0; tint < num_chunks; tint++)
+	{
+		printf("Probing %llu KiB chunks...\r", (unsigned long long)chunks[tint] / 1024);
+		fflush(stdout);
+
+		bmfs_seek(disk, scratchstart * blockSize);
+		start = bmfs_time();
+		for (done = 0; done < scratchbytes; done += chunk)
+		{
+			chunk = chunks[tint];
+			if (chunk > scratchbytes - done)
+				chunk = scratchbytes - done;
+			if (fwrite(buffer, chunk, 1, disk) != 1)
+				break;
+		}
+		if (done < scratchbytes || fflush(disk) != 0)
+		{
+			printf("bmfs error: Writing %llu KiB chunks failed after %llu bytes: %s\n", (unsigned long long)chunks[tint] / 1024, done, strerror(errno));
+			failed = 1;
+			break;
+		}
+		bmfs_sync(disk);
+		writeRate[tint] = done / 1048576.0 / (bmfs_time() - start);
+
+		// Without a cold cache the reads only measure memory
+		if (bmfs_drop_cache(scratchstart * blockSize, scratchbytes) != 0)
+			cached = 1;
+		bmfs_seek(disk, scratchstart * blockSize);
+		start = bmfs_time();
+		for (done = 0; done < scratchbytes; done += chunk)
+		{
+			chunk = chunks[tint];
+			if (chunk > scratchbytes - done)
+				chunk = scratchbytes - done;
+			if (fread(buffer, chunk, 1, disk) != 1)
+				break;
+		}
+		if (done < scratchbytes)
+		{
+			printf("bmfs error: Reading %llu KiB chunks failed after %llu bytes.\n", (unsigned long long)chunks[tint] / 1024, done);
+			failed = 1;
+			break;
+		}
+		readRate[tint] = done / 1048576.0 / (bmfs_time() - start);
+
+		if (writeRate[tint] > writeRate[bestwrite])
+			bestwrite = tint;
+		if (readRate[tint] > readRate[bestread])
+			bestread = tint;
+		if (writeRate[tint] > best)
+			best = writeRate[tint];
+		if (readRate[tint] > best)
+			best = readRate[tint];
+	}
+	free(buffer);
+	bmfs_lock_directory(BMFS_UNLOCK);
+	printf("%40s\r", "");
+	if (failed)
+	{
+		// A short probe says nothing about the disk, so the profile is left alone
+		printf("bmfs error: Tuning stopped, the profile was not changed.\n");
+		return 1;
+	}
+
+	printf("Chunk (KiB) |   Write (MiB/s) |    Read (MiB/s)%s\n", (cached ? " (cached)" : ""));
+	printf("===============================================\n");
+	for (tint = 0; tint < num_chunks; tint++)
+	{
+		printf("%11llu %17.1f %17.1f  ", (unsigned long long)chunks[tint] / 1024, writeRate[tint], readRate[tint]);
+		for (bar = 0; bar < (int)(20 * writeRate[tint] / best); bar++)
+			putchar('W');
+		putchar('|');
+		for (bar = 0; bar < (int)(20 * readRate[tint] / best); bar++)
+			putchar('R');
+		putchar('\n');
+	}
+
+	if (!cached)
+		readChunkSize = chunks[bestread];
+	else
+		printf("Reads came from the page cache, so the read chunk is left at %llu KiB\n", (unsigned long long)readChunkSize / 1024);
+	writeChunkSize = chunks[bestwrite];
+	printf("Best read chunk: %llu KiB, best write chunk: %llu KiB\n", (unsigned long long)readChunkSize / 1024, (unsigned long long)writeChunkSize / 1024);
+	return bmfs_profile_save(diskname);
+}
+
+
+// Location of the device profile file
+static void bmfs_profile_path(char *path, size_t len)
+{
+	char *home;
+
+	if ((home = getenv("BMFS_PROFILE")) != NULL)
+	{
+		snprintf(path, len, "%s", home);
+		return;
+	}
+	home = getenv("HOME");
+	if (home == NULL)
+		home = getenv("USERPROFILE");
+	if (home == NULL)
+		home = ".";
+	snprintf(path, len, "%s/.bmfsprofile", home);
+}
+
+
+// The name a disk is kept under in the profile: its absolute path with
+// links resolved, so the same disk matches from any directory and by any
+// name. Several comma separated disks are kept under the list as given.
+static void bmfs_profile_key(const char *diskname, char *key, size_t len)
+{
+#ifdef _WIN32
+	if (_fullpath(key, diskname, len) == NULL)
+		snprintf(key, len, "%s", diskname);
+#else
+	char *resolved;
+
+	if ((resolved = realpath(diskname, NULL)) == NULL)
+	{
+		snprintf(key, len, "%s", diskname);
+		return;
+	}
+	snprintf(key, len, "%s", resolved);
+	free(resolved);
+#endif
+}
+
+
+// Load the tuned chunk sizes for a disk, if it has been profiled
+// Each line of the profile is: read_chunk write_chunk disk_key
+void bmfs_profile_load(char *diskname)
+{
+	char path[1024], line[1280], key[1024];
+	unsigned long long readchunk, writechunk;
+	FILE *profile;
+	int offset;
+
+	bmfs_profile_key(diskname, key, sizeof(key));
+	bmfs_profile_path(path, sizeof(path));
+	if ((profile = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), profile) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (sscanf(line, "%llu %llu %n", &readchunk, &writechunk, &offset) == 2 && strcmp(line + offset, key) == 0)
+		{
+			if (readchunk >= 512 && writechunk >= 512)
+			{
+				readChunkSize = readchunk;
+				writeChunkSize = writechunk;
+				initChunkSize = writechunk;
+			}
+		}
+	}
+	fclose(profile);
+}
+
+
+// Store the current chunk sizes for a disk, replacing any previous entry
+int bmfs_profile_save(char *diskname)
+{
+	char path[1024], line[1280], key[1024];
+	char *contents = NULL, *grown;
+	size_t used = 0, linelen;
+	unsigned long long readchunk, writechunk;
+	FILE *profile;
+	int offset;
+
+	bmfs_profile_key(diskname, key, sizeof(key));
+	bmfs_profile_path(path, sizeof(path));
+
+	// Keep the entries for every other disk
+	if ((profile = fopen(path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), profile) != NULL)
+		{
+			if (sscanf(line, "%llu %llu %n", &readchunk, &writechunk, &offset) == 2)
+			{
+				linelen = strcspn(line + offset, "\r\n");
+				if (linelen == strlen(key) && strncmp(line + offset, key, linelen) == 0)
+					continue;
+			}
+			linelen = strlen(line);
+			grown = bmfs_stats_realloc(contents, used + linelen + 1);
+			if (grown == NULL)
+				break;
+			contents = grown;
+			memcpy(contents + used, line, linelen + 1);
+			used += linelen;
+		}
+		fclose(profile);
+	}
+
+	if ((profile = fopen(path, "w")) == NULL)
+	{
+		printf("bmfs error: Unable to write profile '%s'\n", path);
+		free(contents);
+		return 1;
+	}
+	if (contents != NULL)
+		fwrite(contents, used, 1, profile);
+	fprintf(profile, "%llu %llu %s\n", (unsigned long long)readChunkSize, (unsigned long long)writeChunkSize, key);
+	fclose(profile);
+	free(contents);
+	printf("Profile saved to '%s'\n", path);
+	return 0;
 }
 
 
@@ -0,0 +1,1274 @@
+/* BareMetal File System Benchmark */
+/* Measures the BMFS data paths on a scratch image */
+
+/* Global includes */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+
+#include "bmfscore.h"
+#include "bmfsproto.h"
+#include "bmfsstripe.h"
+
+/* Global defines */
+#define maxList 16
+
+// A way of moving file data between a local file and the image
+struct BMFSBackend
+{
+	const char *Name;
+	int (*Open)(void);
+	void (*Close)(void);
+	int (*WriteFile)(const char *src, const struct BMFSEntry *fileentry);
+	int (*ReadFile)(const char *dst, const struct BMFSEntry *fileentry);
+};
+
+// Latencies of the operations of one workload
+struct BMFSSamples
+{
+	double *Time;
+	unsigned int Count;
+	u64 Bytes;
+	double Total;
+};
+
+/* Global constants */
+const size_t chunkSize = 2 * 1024 * 1024;
+const unsigned int directAlign = 4096;
+
+/* Global variables */
+char *imagename = "bmfsbench.img";
+char *baselinename = NULL;
+char *bmfsname = NULL;
+char *memberDirs = NULL;
+char srcname[] = "bmfsbench.src";
+char dstname[] = "bmfsbench.dst";
+u64 imageSize = 512ULL * 1024 * 1024;
+struct BMFSGeometry geometry = { 2 * 1024 * 1024, 4096, 2 * 1024 * 1024, 2 * 1024 * 1024 };
+u64 fileCounts[maxList] = { 1, 16, 64 };
+u64 fileSizes[maxList] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+unsigned int fileCountCount = 3, fileSizeCount = 3;
+int fileCountOption = 0, fileSizeOption = 0;
+char *backendNames = NULL;
+int cacheModes = 3;		// Bit 0 for warm, bit 1 for cold
+unsigned int rounds = 3;
+char *buffer;
+FILE *image;
+#ifndef _WIN32
+int imagefd = -1;
+#endif
+
+/* Built-in functions */
+int bmfs_bench_io(void);
+int bmfs_bench_meta(void);
+int bmfs_bench_serve(const char *self);
+int bmfs_bench_stripe(void);
+int bmfs_bench_options(int argc, char *argv[]);
+double bmfs_bench_time(void);
+
+
+/* Program code */
+int main(int argc, char *argv[])
+{
+	argc = bmfs_bench_options(argc, argv);
+	if (argc < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	else if (argc < 2)
+	{
+		printf("BareMetal File System Benchmark\n\n");
+		printf("Usage: bmfsbench io [options]\n");
+		printf("       bmfsbench meta [--baseline=file]\n");
+		printf("       bmfsbench serve [--bmfs=file] [--files=n] [--file-size=size] [--rounds=n]\n");
+		printf("       bmfsbench stripe [--members=dir,...] [--size=size] [--rounds=n]\n\n");
+		printf("Options:  --image=file            scratch image, removed afterwards (default bmfsbench.img)\n");
+		printf("          --size=size             scratch image size (default 512M)\n");
+		printf("          --block-size=size       block size, 4K to 2M (default 2M)\n");
+		printf("          --files=n,...           file counts (default 1,16,64)\n");
+		printf("          --file-size=size,...    file sizes (default 64K,1M,16M)\n");
+		printf("          --backend=name,...      stdio, mmap, direct, copy (default all)\n");
+		printf("          --cache=warm|cold|both  page cache state for each operation (default both)\n");
+		printf("          --rounds=n              times each workload is run (default 3)\n");
+		printf("          --baseline=file         compare with the output of an earlier run\n");
+		printf("          --bmfs=file             bmfs to run for serve (default next to bmfsbench)\n");
+		printf("          --members=dir,...       directory of each stripe member (default .,.,.,.)\n");
+		exit(EXIT_SUCCESS);
+	}
+
+	if (strcasecmp(argv[1], "io") == 0)
+		return bmfs_bench_io();
+	if (strcasecmp(argv[1], "meta") == 0)
+		return bmfs_bench_meta();
+	if (strcasecmp(argv[1], "serve") == 0)
+		return bmfs_bench_serve(argv[0]);
+	if (strcasecmp(argv[1], "stripe") == 0)
+		return bmfs_bench_stripe();
+	printf("bmfsbench error: Unknown benchmark '%s'\n", argv[1]);
+	return EXIT_FAILURE;
+}
+
+
+// Parse a size like 64K, 16M or 1G
+static int bmfs_bench_size(const char *str, u64 *size)
+{
+	char *unit;
+
+	*size = strtoull(str, &unit, 10);
+	if (unit == str)
+		return -1;
+	switch (toupper(*unit))
+	{
+		case 'G':
+			*size *= 1024;
+			/* fall through */
+		case 'M':
+			*size *= 1024;
+			/* fall through */
+		case 'K':
+			*size *= 1024;
+			unit++;
+			break;
+	}
+	return (*unit == '\0' || *unit == ',' ? 0 : -1);
+}
+
+
+// Parse a comma separated list of sizes
+static int bmfs_bench_list(const char *str, u64 *list, unsigned int *count)
+{
+	*count = 0;
+	while (*count < maxList)
+	{
+		if (bmfs_bench_size(str, &list[*count]) != 0 || list[*count] == 0)
+			return -1;
+		(*count)++;
+		if ((str = strchr(str, ',')) == NULL)
+			return 0;
+		str++;
+	}
+	return -1;
+}
+
+
+// Strip the --name=value options out of the argument list
+// Returns the new argument count, or -1 if an option was not valid
+int bmfs_bench_options(int argc, char *argv[])
+{
+	int tint, count = 1, ret = 0;
+	u64 size;
+
+	for (tint = 1; tint < argc && ret == 0; tint++)
+	{
+		if (strncmp(argv[tint], "--", 2) != 0)
+			argv[count++] = argv[tint];
+		else if (strncmp(argv[tint], "--image=", 8) == 0)
+			imagename = argv[tint] + 8;
+		else if (strncmp(argv[tint], "--size=", 7) == 0)
+			ret = bmfs_bench_size(argv[tint] + 7, &imageSize);
+		else if (strncmp(argv[tint], "--block-size=", 13) == 0)
+		{
+			ret = bmfs_bench_size(argv[tint] + 13, &size);
+			if (size < 4096 || size > 2 * 1024 * 1024 || (size & (size - 1)) != 0)
+				ret = -1;
+			geometry.BlockSize = size;
+		}
+		else if (strncmp(argv[tint], "--files=", 8) == 0)
+		{
+			ret = bmfs_bench_list(argv[tint] + 8, fileCounts, &fileCountCount);
+			fileCountOption = 1;
+		}
+		else if (strncmp(argv[tint], "--file-size=", 12) == 0)
+		{
+			ret = bmfs_bench_list(argv[tint] + 12, fileSizes, &fileSizeCount);
+			fileSizeOption = 1;
+		}
+		else if (strncmp(argv[tint], "--backend=", 10) == 0)
+			backendNames = argv[tint] + 10;
+		else if (strcmp(argv[tint], "--cache=warm") == 0)
+			cacheModes = 1;
+		else if (strcmp(argv[tint], "--cache=cold") == 0)
+			cacheModes = 2;
+		else if (strcmp(argv[tint], "--cache=both") == 0)
+			cacheModes = 3;
+		else if (strncmp(argv[tint], "--rounds=", 9) == 0)
+			ret = ((rounds = atoi(argv[tint] + 9)) > 0 ? 0 : -1);
+		else if (strncmp(argv[tint], "--baseline=", 11) == 0)
+			baselinename = argv[tint] + 11;
+		else if (strncmp(argv[tint], "--bmfs=", 7) == 0)
+			bmfsname = argv[tint] + 7;
+		else if (strncmp(argv[tint], "--members=", 10) == 0)
+			memberDirs = argv[tint] + 10;
+		else
+			ret = -1;
+	}
+	if (ret != 0)
+	{
+		printf("bmfsbench error: Invalid option '%s'\n", argv[tint - 1]);
+		return -1;
+	}
+	argv[count] = NULL;
+	return count;
+}
+
+
+// Monotonic wall clock in seconds
+double bmfs_bench_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+// Zero bytes needed to fill out the last block of a file
+static u64 bmfs_bench_padding(u64 size)
+{
+	return (geometry.BlockSize - (size % geometry.BlockSize)) % geometry.BlockSize;
+}
+
+
+/* stdio backend: the copy loops the bmfs utility uses */
+static int bmfs_stdio_open(void)
+{
+	return ((image = fopen(imagename, "r+b")) == NULL ? -1 : 0);
+}
+
+
+static void bmfs_stdio_close(void)
+{
+	fclose(image);
+}
+
+
+static int bmfs_stdio_write(const char *src, const struct BMFSEntry *fileentry)
+{
+	FILE *in;
+	int ret;
+
+	if ((in = fopen(src, "rb")) == NULL)
+		return -1;
+	ret = bmfs_copy_in(&geometry, in, fileentry->FileSize, image, fileentry, buffer, chunkSize, NULL, NULL);
+	fflush(image);
+	fclose(in);
+	return ret;
+}
+
+
+static int bmfs_stdio_read(const char *dst, const struct BMFSEntry *fileentry)
+{
+	FILE *out;
+	int ret;
+
+	if ((out = fopen(dst, "wb")) == NULL)
+		return -1;
+	ret = bmfs_copy_out(&geometry, image, fileentry, out, buffer, chunkSize, NULL, NULL);
+	fclose(out);
+	return ret;
+}
+
+
+#ifndef _WIN32
+/* mmap backend: each file's extent is mapped while it is copied */
+static int bmfs_fd_open(void)
+{
+	return ((imagefd = open(imagename, O_RDWR)) < 0 ? -1 : 0);
+}
+
+
+static void bmfs_fd_close(void)
+{
+	close(imagefd);
+	imagefd = -1;
+}
+
+
+static int bmfs_mmap_write(const char *src, const struct BMFSEntry *fileentry)
+{
+	u64 length = fileentry->FileSize + bmfs_bench_padding(fileentry->FileSize), done = 0;
+	ssize_t got = 1;
+	char *map;
+	int in;
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, imagefd, fileentry->StartingBlock * geometry.BlockSize);
+	if (map == MAP_FAILED)
+	{
+		close(in);
+		return -1;
+	}
+	while (done < fileentry->FileSize && got > 0)
+	{
+		got = read(in, map + done, fileentry->FileSize - done);
+		done += (got > 0 ? got : 0);
+	}
+	memset(map + done, 0, length - done);
+	munmap(map, length);
+	close(in);
+	return (done == fileentry->FileSize ? 0 : -1);
+}
+
+
+static int bmfs_mmap_read(const char *dst, const struct BMFSEntry *fileentry)
+{
+	u64 done = 0;
+	ssize_t put = 1;
+	char *map;
+	int out;
+
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	map = mmap(NULL, fileentry->FileSize, PROT_READ, MAP_SHARED, imagefd, fileentry->StartingBlock * geometry.BlockSize);
+	if (map == MAP_FAILED)
+	{
+		close(out);
+		return -1;
+	}
+	while (done < fileentry->FileSize && put > 0)
+	{
+		put = write(out, map + done, fileentry->FileSize - done);
+		done += (put > 0 ? put : 0);
+	}
+	munmap(map, fileentry->FileSize);
+	close(out);
+	return (done == fileentry->FileSize ? 0 : -1);
+}
+#endif
+
+
+#ifdef __linux__
+/* direct backend: O_DIRECT on the image, bypassing the page cache */
+static int bmfs_direct_open(void)
+{
+	return ((imagefd = open(imagename, O_RDWR | O_DIRECT)) < 0 ? -1 : 0);
+}
+
+
+static int bmfs_direct_write(const char *src, const struct BMFSEntry *fileentry)
+{
+	u64 offset = fileentry->StartingBlock * geometry.BlockSize, left = fileentry->FileSize + bmfs_bench_padding(fileentry->FileSize);
+	ssize_t got;
+	size_t chunk;
+	int in, ret = 0;
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	while (ret == 0 && left > 0)
+	{
+		chunk = (left < chunkSize ? left : chunkSize);
+		got = read(in, buffer, chunk);
+		if (got < 0)
+			ret = -1;
+		else if ((size_t)got < chunk)
+			memset(buffer + got, 0, chunk - got);	// Padding is whole blocks, so stays aligned
+		if (ret == 0 && pwrite(imagefd, buffer, chunk, offset) != (ssize_t)chunk)
+			ret = -1;
+		offset += chunk;
+		left -= chunk;
+	}
+	close(in);
+	return ret;
+}
+
+
+static int bmfs_direct_read(const char *dst, const struct BMFSEntry *fileentry)
+{
+	u64 offset = fileentry->StartingBlock * geometry.BlockSize, left = fileentry->FileSize;
+	size_t chunk, aligned;
+	int out, ret = 0;
+
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	while (ret == 0 && left > 0)
+	{
+		chunk = (left < chunkSize ? left : chunkSize);
+		aligned = (chunk + directAlign - 1) & ~(size_t)(directAlign - 1);
+		if (pread(imagefd, buffer, aligned, offset) != (ssize_t)aligned || write(out, buffer, chunk) != (ssize_t)chunk)
+			ret = -1;
+		offset += chunk;
+		left -= chunk;
+	}
+	close(out);
+	return ret;
+}
+
+
+/* copy backend: copy_file_range, so the kernel moves the data */
+static int bmfs_copy_write(const char *src, const struct BMFSEntry *fileentry)
+{
+	loff_t offset = fileentry->StartingBlock * geometry.BlockSize;
+	u64 left = fileentry->FileSize, padding = bmfs_bench_padding(fileentry->FileSize);
+	ssize_t done = 1;
+	int in, ret = 0;
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	while (left > 0 && done > 0)
+	{
+		done = copy_file_range(in, NULL, imagefd, &offset, left, 0);
+		left -= (done > 0 ? done : 0);
+	}
+	if (left > 0)
+		ret = -1;
+	memset(buffer, 0, (padding < chunkSize ? padding : chunkSize));
+	while (ret == 0 && padding > 0)
+	{
+		done = (padding < chunkSize ? padding : chunkSize);
+		if (pwrite(imagefd, buffer, done, offset) != done)
+			ret = -1;
+		offset += done;
+		padding -= done;
+	}
+	close(in);
+	return ret;
+}
+
+
+static int bmfs_copy_read(const char *dst, const struct BMFSEntry *fileentry)
+{
+	loff_t offset = fileentry->StartingBlock * geometry.BlockSize;
+	u64 left = fileentry->FileSize;
+	ssize_t done = 1;
+	int out;
+
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	while (left > 0 && done > 0)
+	{
+		done = copy_file_range(imagefd, &offset, out, NULL, left, 0);
+		left -= (done > 0 ? done : 0);
+	}
+	close(out);
+	return (left == 0 ? 0 : -1);
+}
+#endif
+
+
+const struct BMFSBackend backends[] = {
+	{ "stdio", bmfs_stdio_open, bmfs_stdio_close, bmfs_stdio_write, bmfs_stdio_read },
+#ifndef _WIN32
+	{ "mmap", bmfs_fd_open, bmfs_fd_close, bmfs_mmap_write, bmfs_mmap_read },
+#endif
+#ifdef __linux__
+	{ "direct", bmfs_direct_open, bmfs_fd_close, bmfs_direct_write, bmfs_direct_read },
+	{ "copy", bmfs_fd_open, bmfs_fd_close, bmfs_copy_write, bmfs_copy_read },
+#endif
+};
+
+
+// Push a file out of the page cache so the next operation starts cold
+static void bmfs_bench_drop(const char *name)
+{
+#ifdef __linux__
+	int fd = open(name, O_RDONLY);
+
+	if (fd >= 0)
+	{
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#else
+	(void)name;
+#endif
+}
+
+
+// Make a local file of random data
+static int bmfs_bench_source(u64 size)
+{
+	FILE *f;
+	u64 done, tint;
+
+	if ((f = fopen(srcname, "wb")) == NULL)
+		return -1;
+	for (done = 0; done < size; done += chunkSize)
+	{
+		for (tint = 0; tint < chunkSize; tint++)
+			buffer[tint] = (char)rand();
+		fwrite(buffer, (size - done < chunkSize ? size - done : chunkSize), 1, f);
+	}
+	fclose(f);
+	return 0;
+}
+
+
+// Make an empty sparse scratch image, so writes go to unallocated space
+static int bmfs_bench_image(void)
+{
+	FILE *f;
+
+	if ((f = fopen(imagename, "wb")) == NULL)
+		return -1;
+	bmfs_seek(f, imageSize - 1);
+	fwrite("", 1, 1, f);
+	fclose(f);
+	return 0;
+}
+
+
+// Lay out count files of size bytes, reserved the way the write command
+// does. Returns 0, or -1 if they do not fit.
+static int bmfs_bench_layout(struct BMFSDirectory *dir, u64 count, u64 size)
+{
+	struct BMFSEntry *pEntry;
+	unsigned int position, end;
+	u64 tint, start, blocks = bmfs_reserve_blocks(&geometry, size);
+	int slot;
+
+	dir->Count = (unsigned int)((count + 64) / 64 * 64);
+	dir->Entries = calloc(dir->Count, 64);
+	if (dir->Entries == NULL)
+		return -1;
+	for (tint = 0; tint < count; tint++)
+	{
+		start = bmfs_dir_place(dir, bmfs_first_block(&geometry), bmfs_last_block(&geometry, imageSize), blocks, BMFS_FIT_FIRST, &position);
+		if (start == 0)
+			return -1;
+		slot = bmfs_dir_free_slot(dir, &end);
+		if (slot < 0)
+			return -1;
+		snprintf(buffer, 32, "file%llu", (unsigned long long)tint);
+		bmfs_dir_add(dir, slot, end, position, buffer, start, blocks);
+		pEntry = (struct BMFSEntry *)(dir->Entries + slot * 64);
+		pEntry->FileSize = size;
+	}
+	return 0;
+}
+
+
+static int bmfs_bench_time_cmp(const void *pa, const void *pb)
+{
+	double a = *(const double *)pa, b = *(const double *)pb;
+
+	return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+
+// Run one workload over the files in the given order
+// Writes come from the source file, reads go to the destination file
+static int bmfs_bench_run(const struct BMFSBackend *backend, struct BMFSDirectory *dir, int *slots, u64 count, int writing, int cold, struct BMFSSamples *samples)
+{
+	struct BMFSEntry *pEntry;
+	double start;
+	u64 tint;
+	int ret;
+
+	for (tint = 0; tint < count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir->Entries + slots[tint] * 64);
+		if (cold)
+		{
+			bmfs_bench_drop(imagename);
+			bmfs_bench_drop(srcname);
+		}
+		start = bmfs_bench_time();
+		if (writing)
+			ret = backend->WriteFile(srcname, pEntry);
+		else
+			ret = backend->ReadFile(dstname, pEntry);
+		if (cold)	// Cold operations are timed until the data is on the device
+			bmfs_bench_drop(writing ? imagename : dstname);
+		samples->Time[samples->Count] = bmfs_bench_time() - start;
+		samples->Total += samples->Time[samples->Count++];
+		samples->Bytes += pEntry->FileSize;
+		if (ret != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+// Find a result in the output of an earlier run
+// Returns the MiB/s it recorded, or 0
+static double bmfs_bench_baseline(const char *key)
+{
+	char line[256], name[128];
+	double mibs = 0, found = 0;
+	FILE *f;
+	int offset;
+
+	if (baselinename == NULL || (f = fopen(baselinename, "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (line[0] == '#')
+			continue;
+		// The key is the first five columns
+		if (sscanf(line, "%*s %*s %*s %*s %*s%n %lf", &offset, &mibs) == 1 && offset < (int)sizeof(name))
+		{
+			memcpy(name, line, offset);
+			name[offset] = '\0';
+			if (strcmp(name, key) == 0)
+				found = mibs;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+
+// Print one result line, with the change from the baseline if there is one
+static void bmfs_bench_report(const char *workload, const char *backend, int cold, u64 count, u64 size, struct BMFSSamples *samples)
+{
+	char key[128];
+	double mibs, before;
+
+	qsort(samples->Time, samples->Count, sizeof(double), bmfs_bench_time_cmp);
+	mibs = (samples->Total > 0 ? samples->Bytes / 1048576.0 / samples->Total : 0);
+	snprintf(key, sizeof(key), "%-9s %-6s %-4s %6llu %10llu", workload, backend, (cold ? "cold" : "warm"), (unsigned long long)count, (unsigned long long)size);
+	printf("%s %10.1f %10.1f %10.1f", key, mibs, samples->Time[samples->Count / 2] * 1e6, samples->Time[(samples->Count * 99) / 100] * 1e6);
+	if ((before = bmfs_bench_baseline(key)) > 0)
+		printf(" %+8.1f%%", (mibs - before) * 100 / before);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+// Check if a backend was asked for with --backend
+static int bmfs_bench_wanted(const char *name)
+{
+	const char *p = backendNames;
+	size_t len = strlen(name);
+
+	if (p == NULL)
+		return 1;
+	while (p != NULL)
+	{
+		if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		if ((p = strchr(p, ',')) != NULL)
+			p++;
+	}
+	return 0;
+}
+
+
+// Throughput and latency of write, overwrite, read and extract for each
+// backend, file count, file size and cache state
+// write fills a fresh sparse image, overwrite rewrites the same extents,
+// read takes the files in a shuffled order and extract in disk order
+int bmfs_bench_io(void)
+{
+	static const char *workloads[] = { "write", "overwrite", "read", "extract" };
+	struct BMFSDirectory dir;
+	struct BMFSSamples samples;
+	const struct BMFSBackend *backend;
+	unsigned int b, c, s, w, r;
+	int *shuffled, cold, tint, swap, ret = 0;
+	u64 count, size;
+
+#ifndef __linux__
+	if (cacheModes & 2)
+	{
+		printf("# cold cache runs are only supported on Linux\n");
+		cacheModes &= 1;
+	}
+#endif
+#ifdef __linux__
+	if (posix_memalign((void **)&buffer, directAlign, chunkSize) != 0)
+		buffer = NULL;
+#else
+	buffer = malloc(chunkSize);
+#endif
+	if (buffer == NULL)
+	{
+		printf("bmfsbench error: Unable to allocate enough memory for buffer.\n");
+		return EXIT_FAILURE;
+	}
+	srand(1);
+
+	printf("# image %llu bytes, block size %llu, %u rounds\n", (unsigned long long)imageSize, (unsigned long long)geometry.BlockSize, rounds);
+	printf("# %-7s %-6s %-4s %6s %10s %10s %10s %10s\n", "workload", "io", "cache", "files", "file_size", "MiB/s", "p50_us", "p99_us");
+	for (s = 0; s < fileSizeCount && ret == 0; s++)
+	{
+		size = fileSizes[s];
+		if (bmfs_bench_source(size) != 0)
+		{
+			printf("bmfsbench error: Could not create '%s'\n", srcname);
+			ret = -1;
+			break;
+		}
+		for (c = 0; c < fileCountCount && ret == 0; c++)
+		{
+			count = fileCounts[c];
+			memset(&dir, 0, sizeof(dir));
+			if (bmfs_bench_layout(&dir, count, size) != 0)
+			{
+				printf("# %llu files of %llu bytes do not fit in the image, skipped\n", (unsigned long long)count, (unsigned long long)size);
+				free(dir.Entries);
+				bmfs_dir_drop(&dir);
+				continue;
+			}
+			shuffled = malloc(count * sizeof(int));
+			samples.Time = malloc(count * rounds * sizeof(double));
+			if (shuffled == NULL || samples.Time == NULL)
+			{
+				printf("bmfsbench error: Unable to allocate enough memory for buffer.\n");
+				ret = -1;
+			}
+			for (tint = 0; ret == 0 && tint < (int)count; tint++)
+				shuffled[tint] = tint;
+			for (tint = (int)count - 1; ret == 0 && tint > 0; tint--)
+			{
+				swap = rand() % (tint + 1);
+				r = shuffled[tint];
+				shuffled[tint] = shuffled[swap];
+				shuffled[swap] = r;
+			}
+
+			for (b = 0; b < sizeof(backends) / sizeof(backends[0]) && ret == 0; b++)
+			{
+				backend = &backends[b];
+				if (!bmfs_bench_wanted(backend->Name))
+					continue;
+				for (cold = 0; cold < 2 && ret == 0; cold++)
+				{
+					if (!(cacheModes & (1 << cold)))
+						continue;
+					for (w = 0; w < 4 && ret == 0; w++)
+					{
+						samples.Count = 0;
+						samples.Bytes = 0;
+						samples.Total = 0;
+						for (r = 0; r < rounds && ret == 0; r++)
+						{
+							if (w == 0 && bmfs_bench_image() != 0)
+							{
+								printf("bmfsbench error: Could not create '%s'\n", imagename);
+								ret = -1;
+								break;
+							}
+							if (backend->Open() != 0)
+							{
+								printf("# %s is not supported on this file system, skipped\n", backend->Name);
+								w = 4;
+								cold = 2;
+								break;
+							}
+							ret = bmfs_bench_run(backend, &dir, (w == 2 ? shuffled : dir.ExtentIndex), count, (w < 2), cold, &samples);
+							backend->Close();
+							if (ret != 0)
+								printf("bmfsbench error: %s %s failed.\n", backend->Name, workloads[w]);
+						}
+						if (ret == 0 && samples.Count > 0)
+							bmfs_bench_report(workloads[w], backend->Name, cold, count, size, &samples);
+					}
+				}
+			}
+			free(shuffled);
+			free(samples.Time);
+			free(dir.Entries);
+			bmfs_dir_drop(&dir);
+		}
+	}
+	remove(imagename);
+	remove(srcname);
+	remove(dstname);
+	free(buffer);
+	return (ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+
+// A synthetic directory for the metadata benchmark
+struct BMFSScenario
+{
+	const char *Name;
+	unsigned int Slots;	// Directory slots, more than 64 is an extended directory
+	unsigned int Files;	// Slots that hold a file, the rest up to Used are deleted
+	unsigned int Used;	// Slots before the end of directory marker
+	u64 Gap;		// Free blocks left after each file
+};
+
+const struct BMFSScenario scenarios[] = {
+	{ "full", 64, 63, 63, 0 },
+	{ "fragmented", 64, 63, 63, 1 },
+	{ "deleted", 64, 8, 63, 0 },
+	{ "extended", 16448, 15000, 16000, 1 },
+};
+
+
+// Fill a directory for a scenario
+// Files take one block each, and every deleted slot is spread evenly among them
+static int bmfs_meta_fill(struct BMFSDirectory *dir, const struct BMFSScenario *sc)
+{
+	struct BMFSEntry *pEntry;
+	unsigned int tint, files = 0;
+	u64 block = bmfs_first_block(&geometry);
+
+	memset(dir, 0, sizeof(struct BMFSDirectory));
+	dir->Count = sc->Slots;
+	if ((dir->Entries = calloc(sc->Slots, 64)) == NULL)
+		return -1;
+	for (tint = 0; tint < sc->Used; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir->Entries + tint * 64);
+		if ((u64)tint * sc->Files / sc->Used == files && files < sc->Files)
+		{
+			snprintf(pEntry->FileName, 32, "file%u", files++);
+			pEntry->StartingBlock = block;
+			pEntry->ReservedBlocks = 1;
+			pEntry->FileSize = 4096;
+		}
+		else
+		{
+			snprintf(pEntry->FileName, 32, "%cold%u", 0x01, tint);
+		}
+		block += 1 + sc->Gap;
+	}
+	return 0;
+}
+
+
+// Time one metadata operation until enough has run to give a stable figure
+// Returns the time per operation in nanoseconds, allocs is set to the
+// allocations made by the core per operation
+static double bmfs_meta_run(const char *op, struct BMFSDirectory *dir, const struct BMFSScenario *sc, const char *snapshot, FILE *null, double *allocs)
+{
+	char name[32];
+	u64 before;
+	unsigned int position, end;
+	double start, total = 0;
+	u64 ops = 0, last = (u64)1 << 40, first = bmfs_first_block(&geometry), blocks;
+	int slot;
+
+	before = bmfsStats.Allocations;
+	while (total < 0.2 && ops < 10000000)
+	{
+		if (strcmp(op, "create") == 0 || strcmp(op, "open") == 0)
+		{
+			// Every command starts from a freshly loaded directory
+			memcpy(dir->Entries, snapshot, (size_t)sc->Slots * 64);
+			bmfs_dir_drop(dir);
+		}
+		snprintf(name, sizeof(name), "file%u", (unsigned int)(ops % sc->Files));
+		start = bmfs_bench_time();
+		if (strcmp(op, "find") == 0)
+		{
+			for (slot = 0; slot < 1000; slot++)
+				bmfs_dir_find(dir, name);
+			ops += 999;
+		}
+		else if (strcmp(op, "miss") == 0)
+		{
+			name[0] = 'x';
+			for (slot = 0; slot < 1000; slot++)
+				bmfs_dir_find(dir, name);
+			ops += 999;
+		}
+		else if (strcmp(op, "open") == 0)
+		{
+			bmfs_dir_find(dir, name);
+		}
+		else if (strcmp(op, "create") == 0)
+		{
+			// The same steps as bmfs create, with a file of two blocks
+			snprintf(name, sizeof(name), "new%llu", (unsigned long long)ops);
+			slot = bmfs_dir_free_slot(dir, &end);
+			if (slot >= 0 && bmfs_dir_find(dir, name) < 0)
+			{
+				blocks = bmfs_dir_place(dir, first, last, 2, BMFS_FIT_FIRST, &position);
+				if (blocks != 0)
+					bmfs_dir_add(dir, slot, end, position, name, blocks, 2);
+			}
+		}
+		else
+		{
+			bmfs_dir_print(dir, null, 2);
+		}
+		total += bmfs_bench_time() - start;
+		ops++;
+	}
+	*allocs = (double)(bmfsStats.Allocations - before) / ops;
+	return total * 1e9 / ops;
+}
+
+
+// Time of find, of the first lookup of a command (open, which builds the
+// index), of create and of list on each synthetic directory
+int bmfs_bench_meta(void)
+{
+	static const char *ops[] = { "find", "miss", "open", "create", "list" };
+	const struct BMFSScenario *sc;
+	struct BMFSDirectory dir;
+	char key[128], *snapshot;
+	double ns, allocs, before;
+	unsigned int s, o;
+	FILE *null;
+
+#ifdef _WIN32
+	null = fopen("NUL", "w");
+#else
+	null = fopen("/dev/null", "w");
+#endif
+	if (null == NULL)
+		return EXIT_FAILURE;
+	printf("# %-7s %-10s %6s %6s %6s %10s %10s\n", "op", "scenario", "slots", "files", "used", "ns/op", "allocs/op");
+	for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+	{
+		sc = &scenarios[s];
+		snapshot = malloc((size_t)sc->Slots * 64);
+		if (snapshot == NULL || bmfs_meta_fill(&dir, sc) != 0)
+		{
+			printf("bmfsbench error: Unable to allocate enough memory for directory.\n");
+			return EXIT_FAILURE;
+		}
+		memcpy(snapshot, dir.Entries, (size_t)sc->Slots * 64);
+		for (o = 0; o < sizeof(ops) / sizeof(ops[0]); o++)
+		{
+			ns = bmfs_meta_run(ops[o], &dir, sc, snapshot, null, &allocs);
+			snprintf(key, sizeof(key), "%-9s %-10s %6u %6u %6u", ops[o], sc->Name, sc->Slots, sc->Files, sc->Used);
+			printf("%s %10.1f %10.2f", key, ns, allocs);
+			if ((before = bmfs_bench_baseline(key)) > 0)
+				printf(" %+8.1f%%", (ns - before) * 100 / before);
+			printf("\n");
+			fflush(stdout);
+		}
+		bmfs_dir_drop(&dir);
+		free(dir.Entries);
+		free(snapshot);
+	}
+	fclose(null);
+	return EXIT_SUCCESS;
+}
+
+
+#ifndef _WIN32
+// Run bmfs with its output thrown away
+// Returns the exit status if wait is set, or else the process id, or -1
+static int bmfs_serve_spawn(const char *bmfs, char *const argv[], int wait)
+{
+	pid_t pid;
+	int status, null;
+
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		return -1;
+	if (pid == 0)
+	{
+		if ((null = open("/dev/null", O_WRONLY)) >= 0)
+			dup2(null, STDOUT_FILENO);
+		execv(bmfs, argv);
+		_exit(127);
+	}
+	if (!wait)
+		return (int)pid;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+
+// One operation on file name, by running the CLI
+static int bmfs_serve_cli(const char *bmfs, const char *op, char *name)
+{
+	char *argv[6] = { (char *)bmfs, imagename, (char *)op, name, NULL, NULL };
+
+	if (strcmp(op, "create") == 0)
+		argv[4] = "1";
+	else if (strcmp(op, "list") == 0)
+		argv[3] = NULL;
+	return bmfs_serve_spawn(bmfs, argv, 1);
+}
+
+
+// The same operation, sent to a server
+static int bmfs_serve_call(int sock, const char *op, char *name, u64 size)
+{
+	struct BMFSReply reply;
+	char entries[4096];
+	u64 left;
+	int fd = -1, ret;
+
+	if (strcmp(op, "create") == 0)
+		return bmfs_proto_call(sock, BMFS_OP_CREATE, name, 1024 * 1024, -1, &reply);
+	if (strcmp(op, "delete") == 0)
+		return bmfs_proto_call(sock, BMFS_OP_DELETE, name, 0, -1, &reply);
+	if (strcmp(op, "list") == 0)
+	{
+		if ((ret = bmfs_proto_call(sock, BMFS_OP_LIST, NULL, 0, -1, &reply)) != BMFS_OK)
+			return ret;
+		for (left = reply.Size; left > 0; left -= (left > sizeof(entries) ? sizeof(entries) : left))
+		{
+			if (bmfs_proto_recv(sock, entries, (left > sizeof(entries) ? sizeof(entries) : left), NULL) != 0)
+				return -1;
+		}
+		return BMFS_OK;
+	}
+	if (strcmp(op, "write") == 0)
+		fd = open(name, O_RDONLY);
+	else
+		fd = open(name, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	ret = bmfs_proto_call(sock, (strcmp(op, "write") == 0 ? BMFS_OP_WRITE : BMFS_OP_READ), name, size, fd, &reply);
+	close(fd);
+	return ret;
+}
+
+
+// Start a server on the scratch image and connect to it
+// Returns the socket, or -1
+static int bmfs_serve_start(const char *bmfs, pid_t *pid)
+{
+	char option[] = "--socket=bmfsbench.sock";
+	char *argv[5] = { (char *)bmfs, imagename, "serve", option, NULL };
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+	int sock, tint;
+
+	if ((*pid = bmfs_serve_spawn(bmfs, argv, 0)) < 0)
+		return -1;
+	// Wait up to 5 seconds for it to listen
+	for (tint = 0; tint < 500; tint++)
+	{
+		if ((sock = bmfs_proto_connect("bmfsbench.sock")) >= 0)
+			return sock;
+		nanosleep(&pause, NULL);
+	}
+	kill(*pid, SIGTERM);
+	waitpid(*pid, NULL, 0);
+	return -1;
+}
+#endif
+
+
+// Operations per second of the CLI, which loads the directory for every
+// command, and of bmfs serve, which keeps it loaded, on the same workload
+int bmfs_bench_serve(const char *self)
+{
+#ifdef _WIN32
+	(void)self;
+	printf("bmfsbench error: serve needs Unix sockets, which this system does not have.\n");
+	return EXIT_FAILURE;
+#else
+	static const char *ops[] = { "create", "write", "read", "list", "delete" };
+	const unsigned int opCount = sizeof(ops) / sizeof(ops[0]);
+	char path[4096], bmfs[4096], dirname[] = "bmfsbench.XXXXXX", name[32], initsize[32];
+	char *initargv[5] = { bmfs, imagename, "initialize", initsize, NULL };
+	double elapsed[2][5], start;
+	u64 files = (fileCountOption ? fileCounts[0] : 48), size = (fileSizeOption ? fileSizes[0] : 4096);
+	unsigned int mode, round, o, tint;
+	int ret = 0, sock = -1;
+	pid_t pid = -1;
+	FILE *f;
+
+	// Find bmfs before moving to the scratch directory
+	if (bmfsname != NULL)
+		snprintf(path, sizeof(path), "%s", bmfsname);
+	else if (strrchr(self, '/') != NULL)
+		snprintf(path, sizeof(path), "%.*sbmfs", (int)(strrchr(self, '/') - self + 1), self);
+	else
+		snprintf(path, sizeof(path), "bmfs");
+	if (realpath(path, bmfs) == NULL || access(bmfs, X_OK) != 0)
+	{
+		printf("bmfsbench error: Could not find bmfs at '%s', use --bmfs=file\n", path);
+		return EXIT_FAILURE;
+	}
+	if (files > 63)
+	{
+		printf("bmfsbench error: serve needs 63 files or fewer\n");
+		return EXIT_FAILURE;
+	}
+	if (mkdtemp(dirname) == NULL || chdir(dirname) != 0)
+	{
+		printf("bmfsbench error: Could not create a scratch directory\n");
+		return EXIT_FAILURE;
+	}
+
+	// The local files that are written
+	if ((buffer = calloc(1, size)) == NULL)
+		return EXIT_FAILURE;
+	for (tint = 0; tint < files && ret == 0; tint++)
+	{
+		snprintf(name, sizeof(name), "file%u", tint);
+		if ((f = fopen(name, "wb")) == NULL || fwrite(buffer, 1, size, f) != size)
+			ret = -1;
+		if (f != NULL)
+			fclose(f);
+	}
+	if (ret != 0)
+		printf("bmfsbench error: Could not create '%s'\n", name);
+	snprintf(initsize, sizeof(initsize), "%lluM", (unsigned long long)(imageSize / (1024 * 1024)));
+
+	memset(elapsed, 0, sizeof(elapsed));
+	for (mode = 0; mode < 2 && ret == 0; mode++)
+	{
+		if (bmfs_serve_spawn(bmfs, initargv, 1) != 0)
+		{
+			printf("bmfsbench error: Could not create '%s'\n", imagename);
+			ret = -1;
+			break;
+		}
+		if (mode == 1 && (sock = bmfs_serve_start(bmfs, &pid)) < 0)
+		{
+			printf("bmfsbench error: Could not start bmfs serve\n");
+			ret = -1;
+			break;
+		}
+		for (round = 0; round < rounds && ret == 0; round++)
+		{
+			for (o = 0; o < opCount && ret == 0; o++)
+			{
+				start = bmfs_bench_time();
+				for (tint = 0; tint < files && ret == 0; tint++)
+				{
+					snprintf(name, sizeof(name), "file%u", tint);
+					ret = (mode == 0 ? bmfs_serve_cli(bmfs, ops[o], name) : bmfs_serve_call(sock, ops[o], name, size));
+					if (ret != 0)
+						printf("bmfsbench error: %s %s failed.\n", (mode == 0 ? "bmfs" : "bmfs serve"), ops[o]);
+				}
+				elapsed[mode][o] += bmfs_bench_time() - start;
+			}
+		}
+		if (mode == 1)
+		{
+			close(sock);
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	if (ret == 0)
+	{
+		printf("# %-7s %6s %10s %12s %12s %8s\n", "op", "files", "size", "cli ops/s", "serve ops/s", "speedup");
+		for (o = 0; o < opCount; o++)
+			printf("%-9s %6llu %10llu %12.1f %12.1f %7.1fx\n", ops[o], (unsigned long long)files, (unsigned long long)size, files * rounds / elapsed[0][o], files * rounds / elapsed[1][o], elapsed[0][o] / elapsed[1][o]);
+	}
+
+	// Clean up the scratch directory
+	for (tint = 0; tint < files; tint++)
+	{
+		snprintf(name, sizeof(name), "file%u", tint);
+		remove(name);
+	}
+	remove(imagename);
+	remove("bmfsbench.sock");
+	if (chdir("..") == 0)
+		rmdir(dirname);
+	free(buffer);
+	return (ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+}
+
+
+// Throughput of a striped volume as members are added, with the members of
+// each run in the directories given by --members, one per member
+int bmfs_bench_stripe(void)
+{
+#ifdef _WIN32
+	printf("bmfsbench error: Striped volumes are not supported on Windows.\n");
+	return EXIT_FAILURE;
+#else
+	struct BMFSStripe *stripe;
+	char *dirs[BMFS_STRIPE_MAX], *list, *next, path[1100];
+	double start, best[2], seconds, first[2] = { 0, 0 };
+	unsigned int count = 0, members, tint, round;
+	u64 offset, row;
+	int ret = 0, w;
+	FILE *f;
+
+	// Four members in the current directory unless told otherwise
+	next = (memberDirs != NULL ? memberDirs : ".,.,.,.");
+	if ((list = malloc(strlen(next) + 1)) == NULL)
+		return EXIT_FAILURE;
+	strcpy(list, next);
+	for (next = strtok(list, ","); next != NULL && count < BMFS_STRIPE_MAX; next = strtok(NULL, ","))
+		dirs[count++] = next;
+	if ((buffer = malloc((size_t)BMFS_STRIPE_SIZE * count)) == NULL)
+	{
+		free(list);
+		return EXIT_FAILURE;
+	}
+	for (offset = 0; offset < (u64)BMFS_STRIPE_SIZE * count; offset++)
+		buffer[offset] = (char)(offset * 2654435761u >> 13);
+
+	printf("# %-7s %10s %11s %11s %8s %8s\n", "members", "size", "write MiB/s", "read MiB/s", "write x", "read x");
+	for (members = 1; members <= count && ret == 0; members++)
+	{
+		if ((f = fopen("bmfsbench.stripe", "w")) == NULL)
+		{
+			ret = -1;
+			break;
+		}
+		fprintf(f, "%s\n", BMFS_STRIPE_MAGIC);
+		for (tint = 0; tint < members; tint++)
+			fprintf(f, "member %s/bmfsbench.member%u\n", dirs[tint], tint);
+		fclose(f);
+		row = (u64)BMFS_STRIPE_SIZE * members;
+		best[0] = best[1] = 0;
+		for (round = 0; round < rounds && ret == 0; round++)
+		{
+			// Write the whole volume a row at a time, then read it back cold
+			for (w = 0; w < 2 && ret == 0; w++)
+			{
+				if (bmfs_stripe_open("bmfsbench.stripe", (w == 0 ? "wb" : "rb"), &stripe) != 0)
+				{
+					ret = -1;
+					break;
+				}
+				start = bmfs_bench_time();
+				for (offset = 0; offset < imageSize && ret == 0; offset += row)
+					ret = bmfs_stripe_io(stripe, buffer, (imageSize - offset < row ? imageSize - offset : row), offset, (w == 0));
+				if (w == 0)
+					bmfs_stripe_sync(stripe);
+				seconds = bmfs_bench_time() - start;
+				bmfs_stripe_close(stripe);
+				if (best[w] == 0 || seconds < best[w])
+					best[w] = seconds;
+				for (tint = 0; tint < members; tint++)
+				{
+					snprintf(path, sizeof(path), "%s/bmfsbench.member%u", dirs[tint], tint);
+					bmfs_bench_drop(path);
+				}
+			}
+		}
+		if (ret != 0)
+		{
+			printf("bmfsbench error: Striped volume of %u members failed.\n", members);
+			break;
+		}
+		if (members == 1)
+		{
+			first[0] = best[0];
+			first[1] = best[1];
+		}
+		printf("%-9u %10llu %11.1f %11.1f %7.2fx %7.2fx\n", members, (unsigned long long)imageSize, imageSize / best[0] / 1048576, imageSize / best[1] / 1048576, first[0] / best[0], first[1] / best[1]);
+		fflush(stdout);
+	}
+
+	for (tint = 0; tint < count; tint++)
+	{
+		snprintf(path, sizeof(path), "%s/bmfsbench.member%u", dirs[tint], tint);
+		remove(path);
+	}
+	remove("bmfsbench.stripe");
+	free(buffer);
+	free(list);
+	return (ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+}
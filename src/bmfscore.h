@@ -0,0 +1,719 @@
+/* BareMetal File System Core */
+/* Directory, allocation and copy code shared by the BMFS and BMFS-Lite utilities */
+
+#ifndef BMFSCORE_H
+#define BMFSCORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmfsstats.h"
+
+/* Typedefs */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/* Global defines */
+struct BMFSEntry
+{
+	char FileName[32];
+	u64 StartingBlock;
+	u64 ReservedBlocks;
+	u64 FileSize;
+	u64 Unused;		// Sync stamp, 0 unless sync wrote the data last
+};
+
+// Layout of a volume
+struct BMFSGeometry
+{
+	u64 BlockSize;		// Bytes per block
+	u64 DirectoryOffset;	// Byte offset of the 4KiB directory
+	u64 ReservedStart;	// Bytes kept for the file system at the start of the disk
+	u64 ReservedEnd;	// Bytes kept for the file system at the end of the disk
+};
+
+// In-memory directory and the indexes built over it
+struct BMFSDirectory
+{
+	char *Entries;			// Directory entries, 64 bytes per slot
+	unsigned int Count;		// Number of entry slots
+	int *NameIndex;			// Hash of file names to slots
+	unsigned int NameIndexSize;
+	int *ExtentIndex;		// Slots of all files, sorted by starting block
+	unsigned int ExtentCount;
+};
+
+// A whole BMFS-Lite image held in memory
+struct BMFSLiteImage
+{
+	char *Image;
+	u64 Size;
+	struct BMFSDirectory Dir;
+};
+
+// How the data blocks of a volume are used
+#define BMFS_SPACE_BINS 48
+struct BMFSSpace
+{
+	u64 Total;			// Data blocks between the reserved areas
+	u64 Reserved;			// Blocks reserved by files
+	u64 Written;			// Reserved blocks that hold file data
+	u64 Free;
+	u64 Largest;			// Blocks in the largest free extent
+	u64 Extents;			// Number of free extents
+	u64 Bins[BMFS_SPACE_BINS];	// Free extents of 2^n to 2^(n+1)-1 blocks
+};
+
+// Called after each chunk of a copy, padding is set for the zeros that
+// fill out the last block of a file
+typedef void (*BMFSChunkFn)(void *ctx, size_t length, int padding);
+
+/* Global constants */
+// The two known layouts. The functions below are all inline, so passing one
+// of these lets the compiler fold the geometry into fixed-size code.
+static const struct BMFSGeometry bmfsGeometry = { 2 * 1024 * 1024, 4096, 2 * 1024 * 1024, 2 * 1024 * 1024 };
+static const struct BMFSGeometry bmfsLiteGeometry = { 1024, 0, 4096, 0 };
+// BMFS-Lite images are 64KiB to 2MiB
+#define BMFS_LITE_MINIMUM_SIZE (64 * 1024)
+#define BMFS_LITE_MAXIMUM_SIZE (2 * 1024 * 1024)
+// Allocation policies for new files
+#define BMFS_FIT_FIRST 0	// Lowest gap that is big enough
+#define BMFS_FIT_BEST 1		// Smallest gap that is big enough
+
+// Directory being sorted by bmfs_disk_order_cmp
+static char *bmfsSortEntries;
+
+
+// Seek to a 64-bit byte offset
+static inline int bmfs_seek(FILE *f, u64 offset)
+{
+	bmfsStats.Seeks++;
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+
+// First block files can be placed in
+static inline u64 bmfs_first_block(const struct BMFSGeometry *geo)
+{
+	return geo->ReservedStart / geo->BlockSize;
+}
+
+
+// Block after the last one files can be placed in, for a disk of the given size
+static inline u64 bmfs_last_block(const struct BMFSGeometry *geo, u64 bytes)
+{
+	u64 blocks = bytes / geo->BlockSize;
+	u64 reserved = geo->ReservedEnd / geo->BlockSize;
+
+	return (blocks > reserved ? blocks - reserved : 0);
+}
+
+
+// Blocks to reserve for a file of size bytes that is being written: all it
+// needs now and at least one more, so it can grow a little without moving
+static inline u64 bmfs_reserve_blocks(const struct BMFSGeometry *geo, u64 size)
+{
+	return size / geo->BlockSize + 1;
+}
+
+
+// helper function for qsort, sorts directory slot numbers by StartingBlock field
+static int bmfs_disk_order_cmp(const void *pa, const void *pb)
+{
+	struct BMFSEntry *ea = (struct BMFSEntry *)(bmfsSortEntries + *(const int *)pa * 64);
+	struct BMFSEntry *eb = (struct BMFSEntry *)(bmfsSortEntries + *(const int *)pb * 64);
+	if (ea->StartingBlock < eb->StartingBlock)
+		return -1;
+	return (ea->StartingBlock > eb->StartingBlock);
+}
+
+
+// Sort a list of directory slots into disk order
+static inline void bmfs_dir_sort(struct BMFSDirectory *dir, int *slots, unsigned int count)
+{
+	bmfsSortEntries = dir->Entries;
+	qsort(slots, count, sizeof(int), bmfs_disk_order_cmp);
+}
+
+
+// FNV-1a hash of a file name
+static inline unsigned int bmfs_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name != '\0')
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+// Add a directory slot to the name index
+static inline void bmfs_dir_name_insert(struct BMFSDirectory *dir, int slot)
+{
+	unsigned int h = bmfs_name_hash(dir->Entries + slot * 64) & (dir->NameIndexSize - 1);
+
+	while (dir->NameIndex[h] >= 0)
+		h = (h + 1) & (dir->NameIndexSize - 1);
+	dir->NameIndex[h] = slot;
+}
+
+
+// Build the name index for the whole directory if it is not current
+// It is not stored on the disk, so this is one pass over every slot each
+// time a directory is loaded
+// Empty index slots are -1, slots of deleted files are -2
+static inline int bmfs_dir_names(struct BMFSDirectory *dir)
+{
+	unsigned int tint, size = 128;
+
+	if (dir->NameIndex != NULL)
+		return 0;
+	while (size < dir->Count * 2)
+		size *= 2;
+	dir->NameIndex = bmfs_stats_malloc(size * sizeof(int));
+	if (dir->NameIndex == NULL)
+		return -1;
+	dir->NameIndexSize = size;
+	for (tint = 0; tint < size; tint++)
+		dir->NameIndex[tint] = -1;
+	for (tint = 0; tint < dir->Count; tint++)
+	{
+		if (dir->Entries[tint * 64] == 0x00)			// End of directory
+			break;
+		if (dir->Entries[tint * 64] != 0x01)			// Valid entry
+			bmfs_dir_name_insert(dir, tint);
+	}
+	return 0;
+}
+
+
+// Build the list of files in disk order if it is not current
+static inline int bmfs_dir_extents(struct BMFSDirectory *dir)
+{
+	unsigned int tint;
+
+	if (dir->ExtentIndex != NULL)
+		return 0;
+	dir->ExtentIndex = bmfs_stats_malloc((dir->Count + 1) * sizeof(int));
+	if (dir->ExtentIndex == NULL)
+		return -1;
+	dir->ExtentCount = 0;
+	for (tint = 0; tint < dir->Count; tint++)
+	{
+		if (dir->Entries[tint * 64] == 0x00)			// End of directory
+			break;
+		if (dir->Entries[tint * 64] != 0x01)			// Valid entry
+			dir->ExtentIndex[dir->ExtentCount++] = tint;
+	}
+	bmfs_dir_sort(dir, dir->ExtentIndex, dir->ExtentCount);
+	return 0;
+}
+
+
+// Throw away the indexes after the directory has changed underneath them
+static inline void bmfs_dir_drop(struct BMFSDirectory *dir)
+{
+	free(dir->NameIndex);
+	dir->NameIndex = NULL;
+	free(dir->ExtentIndex);
+	dir->ExtentIndex = NULL;
+}
+
+
+// Directory slot of a file, or -1 if it does not exist
+static inline int bmfs_dir_find(struct BMFSDirectory *dir, const char *filename)
+{
+	unsigned int h;
+	int slot;
+
+	if (bmfs_dir_names(dir) != 0)
+		return -1;
+	h = bmfs_name_hash(filename) & (dir->NameIndexSize - 1);
+	while ((slot = dir->NameIndex[h]) != -1)
+	{
+		if (slot >= 0 && strcmp(filename, dir->Entries + slot * 64) == 0)
+			return slot;
+		h = (h + 1) & (dir->NameIndexSize - 1);
+	}
+	return -1;
+}
+
+
+// First unused directory slot, or -1 if the directory is full
+// end is set to the slot holding the end of directory marker, or to the
+// number of slots if every slot has been used
+static inline int bmfs_dir_free_slot(struct BMFSDirectory *dir, unsigned int *end)
+{
+	int first_free_entry = -1;
+	unsigned int tint;
+
+	*end = dir->Count;
+	for (tint = 0; tint < dir->Count; tint++)
+	{
+		if (dir->Entries[tint * 64] == 0x00)			// End of directory
+		{
+			*end = tint;
+			if (first_free_entry == -1)
+				first_free_entry = tint;
+			break;
+		}
+		else if (dir->Entries[tint * 64] == 0x01 && first_free_entry == -1)	// Unused entry
+		{
+			first_free_entry = tint;
+		}
+	}
+	return first_free_entry;
+}
+
+
+// Find a gap of enough free blocks between first and last, walking the files
+// in disk order. Returns the starting block, or 0 if nothing fits.
+// position is set to where the new file goes in the extent index.
+static inline u64 bmfs_dir_place(struct BMFSDirectory *dir, u64 first, u64 last, u64 blocks, int fit, unsigned int *position)
+{
+	struct BMFSEntry *pEntry;
+	u64 prev_file_end = first, this_file_start;
+	u64 best_start = 0, best_size = 0;
+	unsigned int tint;
+
+	if (bmfs_dir_extents(dir) != 0)
+		return 0;
+	for (tint = 0; tint < dir->ExtentCount + 1; tint++)
+	{
+		// on each iteration of this loop we'll see if a new file can fit
+		// between the end of the previous file (initially the first data block)
+		// and the beginning of the current file (or the last data block if there are no more files).
+
+		pEntry = NULL;
+		if (tint == dir->ExtentCount)
+		{
+			this_file_start = last; // start of the reserved area at the end
+		}
+		else
+		{
+			pEntry = (struct BMFSEntry *)(dir->Entries + dir->ExtentIndex[tint] * 64);
+			this_file_start = pEntry->StartingBlock;
+		}
+
+		if (this_file_start >= prev_file_end && this_file_start - prev_file_end >= blocks)
+		{ // fits here
+			if (fit == BMFS_FIT_FIRST)
+			{
+				*position = tint;
+				return prev_file_end;
+			}
+			if (best_start == 0 || this_file_start - prev_file_end < best_size)
+			{
+				best_start = prev_file_end;
+				best_size = this_file_start - prev_file_end;
+				*position = tint;
+			}
+		}
+
+		if (pEntry != NULL && pEntry->StartingBlock + pEntry->ReservedBlocks > prev_file_end)
+			prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+	return best_start;
+}
+
+
+// Check that blocks starting at start are free and between first and last
+// Returns 0 if they are, with position set as for bmfs_dir_place, or -1
+static inline int bmfs_dir_place_at(struct BMFSDirectory *dir, u64 first, u64 last, u64 start, u64 blocks, unsigned int *position)
+{
+	struct BMFSEntry *pEntry;
+	unsigned int tint;
+
+	if (start < first || start > last || last - start < blocks)
+		return -1;
+	if (bmfs_dir_extents(dir) != 0)
+		return -1;
+	for (tint = 0; tint < dir->ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir->Entries + dir->ExtentIndex[tint] * 64);
+		if (pEntry->StartingBlock + pEntry->ReservedBlocks > start && pEntry->StartingBlock < start + blocks)
+			return -1;
+		if (pEntry->StartingBlock >= start + blocks)
+			break;
+	}
+	*position = tint;
+	return 0;
+}
+
+
+// Number of blocks between first and last not reserved by any file
+static inline u64 bmfs_dir_free_blocks(struct BMFSDirectory *dir, u64 first, u64 last)
+{
+	struct BMFSEntry *pEntry;
+	u64 used = 0;
+	unsigned int tint;
+
+	if (bmfs_dir_extents(dir) != 0)
+		return 0;
+	for (tint = 0; tint < dir->ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir->Entries + dir->ExtentIndex[tint] * 64);
+		used += pEntry->ReservedBlocks;
+	}
+	return (last - first > used ? last - first - used : 0);
+}
+
+
+// Walk the files in disk order and add up the free extents between them
+// Returns 0, or -1 if the extent index could not be built
+static inline int bmfs_dir_space(struct BMFSDirectory *dir, u64 first, u64 last, u64 blocksize, struct BMFSSpace *space)
+{
+	struct BMFSEntry *pEntry;
+	u64 prev_file_end = first, this_file_start, gap, written;
+	unsigned int tint, bin;
+
+	memset(space, 0, sizeof(struct BMFSSpace));
+	if (bmfs_dir_extents(dir) != 0)
+		return -1;
+	space->Total = (last > first ? last - first : 0);
+	for (tint = 0; tint < dir->ExtentCount + 1; tint++)
+	{
+		pEntry = NULL;
+		if (tint == dir->ExtentCount)
+		{
+			this_file_start = last;
+		}
+		else
+		{
+			pEntry = (struct BMFSEntry *)(dir->Entries + dir->ExtentIndex[tint] * 64);
+			this_file_start = pEntry->StartingBlock;
+		}
+
+		if (this_file_start > prev_file_end)
+		{
+			gap = this_file_start - prev_file_end;
+			for (bin = 0; bin + 1 < BMFS_SPACE_BINS && gap >> (bin + 1) != 0; bin++)
+				;
+			space->Bins[bin]++;
+			space->Extents++;
+			space->Free += gap;
+			if (gap > space->Largest)
+				space->Largest = gap;
+		}
+
+		if (pEntry != NULL)
+		{
+			written = (pEntry->FileSize + blocksize - 1) / blocksize;
+			space->Reserved += pEntry->ReservedBlocks;
+			space->Written += (written < pEntry->ReservedBlocks ? written : pEntry->ReservedBlocks);
+			if (pEntry->StartingBlock + pEntry->ReservedBlocks > prev_file_end)
+				prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+		}
+	}
+	return 0;
+}
+
+
+// Fill in a new directory entry at slot and keep the indexes current
+// end and position come from bmfs_dir_free_slot and bmfs_dir_place.
+// Returns the number of entries from slot on that changed (1 or 2).
+static inline int bmfs_dir_add(struct BMFSDirectory *dir, int slot, unsigned int end, unsigned int position, const char *filename, u64 start, u64 blocks)
+{
+	struct BMFSEntry *pEntry;
+	int changed_entries = 1;
+
+	pEntry = (struct BMFSEntry *)(dir->Entries + slot * 64);
+	memset(pEntry, 0, 64);
+	pEntry->StartingBlock = start;
+	pEntry->ReservedBlocks = blocks;
+	pEntry->FileSize = 0;
+	strcpy(pEntry->FileName, filename);
+
+	if ((unsigned int)slot == end && end + 1 < dir->Count)
+	{
+		// here we used the record that was marked with 0x00,
+		// so make sure to mark the next record with 0x00 if it exists
+		dir->Entries[(end + 1) * 64] = 0x00;
+		changed_entries = 2;
+	}
+
+	if (dir->NameIndex != NULL)
+		bmfs_dir_name_insert(dir, slot);
+	if (dir->ExtentIndex != NULL)
+	{
+		memmove(dir->ExtentIndex + position + 1, dir->ExtentIndex + position, (dir->ExtentCount - position) * sizeof(int));
+		dir->ExtentIndex[position] = slot;
+		dir->ExtentCount++;
+	}
+	return changed_entries;
+}
+
+
+// Print the name, size and reserved space of each file in directory order
+// unit is the reserved space shown per block
+static inline void bmfs_dir_print(const struct BMFSDirectory *dir, FILE *out, u64 unit)
+{
+	const struct BMFSEntry *pEntry;
+	unsigned int tint;
+
+	for (tint = 0; tint < dir->Count; tint++)
+	{
+		pEntry = (const struct BMFSEntry *)(dir->Entries + tint * 64);
+		if (pEntry->FileName[0] == 0x00)			// End of directory
+			break;
+		if (pEntry->FileName[0] != 0x01)			// Valid entry
+			fprintf(out, "%-32s %20lld %20lld\n", pEntry->FileName, (long long int)pEntry->FileSize, (long long int)(pEntry->ReservedBlocks * unit));
+	}
+}
+
+
+// Copy the contents of a file from the image to a local file
+// Returns 0 on success, -1 on a short read
+static inline int bmfs_copy_out(const struct BMFSGeometry *geo, FILE *image, const struct BMFSEntry *fileentry, FILE *out, char *buffer, size_t chunksize, BMFSChunkFn fn, void *ctx)
+{
+	u64 bytestoread = fileentry->FileSize;
+	size_t chunk;
+	double begin;
+
+	if (bmfs_seek(image, fileentry->StartingBlock * geo->BlockSize) != 0)
+		return -1;
+	while (bytestoread != 0)
+	{
+		chunk = chunksize;
+		if (bytestoread < chunk)
+			chunk = bytestoread;
+		begin = bmfs_trace_io_begin();
+		if (fread(buffer, chunk, 1, image) != 1)
+			return -1;
+		bmfs_trace_io("image read", begin, chunk);
+		begin = bmfs_trace_io_begin();
+		fwrite(buffer, chunk, 1, out);
+		bmfs_trace_io("host write", begin, chunk);
+		bmfsStats.ImageReads++;
+		bmfsStats.ImageRead += chunk;
+		bmfsStats.HostWrites++;
+		bmfsStats.HostWritten += chunk;
+		bytestoread -= chunk;
+		if (fn != NULL)
+			fn(ctx, chunk, 0);
+	}
+	return 0;
+}
+
+
+// Copy size bytes of a local file into the extent of a file in the image,
+// zeroing the rest of the last block
+// Returns 0 on success, -1 on a short read
+static inline int bmfs_copy_in(const struct BMFSGeometry *geo, FILE *in, u64 size, FILE *image, const struct BMFSEntry *fileentry, char *buffer, size_t chunksize, BMFSChunkFn fn, void *ctx)
+{
+	u64 padding = (geo->BlockSize - (size % geo->BlockSize)) % geo->BlockSize;
+	size_t chunk;
+	double begin;
+
+	if (bmfs_seek(image, fileentry->StartingBlock * geo->BlockSize) != 0)
+		return -1;
+	while (size != 0)
+	{
+		chunk = chunksize;
+		if (size < chunk)
+			chunk = size;
+		begin = bmfs_trace_io_begin();
+		if (fread(buffer, chunk, 1, in) != 1)
+			return -1;
+		bmfs_trace_io("host read", begin, chunk);
+		begin = bmfs_trace_io_begin();
+		fwrite(buffer, chunk, 1, image);
+		bmfs_trace_io("image write", begin, chunk);
+		bmfsStats.HostReads++;
+		bmfsStats.HostRead += chunk;
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += chunk;
+		size -= chunk;
+		if (fn != NULL)
+			fn(ctx, chunk, 0);
+	}
+	memset(buffer, 0, chunksize);	// 0 the rest of the last block
+	while (padding != 0)
+	{
+		chunk = chunksize;
+		if (padding < chunk)
+			chunk = padding;
+		begin = bmfs_trace_io_begin();
+		fwrite(buffer, chunk, 1, image);
+		bmfs_trace_io("image write", begin, chunk);
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += chunk;
+		padding -= chunk;
+		if (fn != NULL)
+			fn(ctx, chunk, 1);
+	}
+	return 0;
+}
+
+
+
+// Check that a file lies inside an image of the given size
+static inline int bmfs_entry_valid(const struct BMFSGeometry *geo, const struct BMFSEntry *fileentry, u64 bytes)
+{
+	u64 blocks = bytes / geo->BlockSize;
+
+	return (fileentry->StartingBlock >= bmfs_first_block(geo) && fileentry->StartingBlock <= blocks && fileentry->ReservedBlocks <= blocks - fileentry->StartingBlock && fileentry->FileSize <= fileentry->ReservedBlocks * geo->BlockSize);
+}
+
+
+// Copy the contents of a file from an image held in memory to a local file
+// Returns 0 on success, -1 on a short write
+static inline int bmfs_mem_copy_out(const struct BMFSGeometry *geo, const char *image, const struct BMFSEntry *fileentry, FILE *out)
+{
+	double begin;
+	int ret;
+
+	if (fileentry->FileSize == 0)
+		return 0;
+	bmfsStats.HostWrites++;
+	bmfsStats.HostWritten += fileentry->FileSize;
+	begin = bmfs_trace_io_begin();
+	ret = (fwrite(image + fileentry->StartingBlock * geo->BlockSize, fileentry->FileSize, 1, out) == 1 ? 0 : -1);
+	bmfs_trace_io("host write", begin, fileentry->FileSize);
+	return ret;
+}
+
+
+// Read size bytes of a local file straight into the extent of a file in an
+// image held in memory, zeroing the rest of the last block
+// Returns 0 on success, -1 on a short read
+static inline int bmfs_mem_copy_in(const struct BMFSGeometry *geo, FILE *in, u64 size, char *image, const struct BMFSEntry *fileentry)
+{
+	char *extent = image + fileentry->StartingBlock * geo->BlockSize;
+	u64 padding = (geo->BlockSize - (size % geo->BlockSize)) % geo->BlockSize;
+	double begin = bmfs_trace_io_begin();
+
+	if (size != 0 && fread(extent, size, 1, in) != 1)
+		return -1;
+	bmfs_trace_io("host read", begin, size);
+	bmfsStats.HostReads++;
+	bmfsStats.HostRead += size;
+	memset(extent + size, 0, padding);
+	return 0;
+}
+
+
+// Slide every file of an image held in memory down to close the gaps between
+// them, zero the free space after them, and squeeze deleted entries out of
+// the directory. Returns the first free block, or 0 on failure.
+static inline u64 bmfs_mem_compact(const struct BMFSGeometry *geo, struct BMFSDirectory *dir, char *image, u64 bytes)
+{
+	struct BMFSEntry *pEntry;
+	u64 next = bmfs_first_block(geo), last = bmfs_last_block(geo, bytes);
+	unsigned int tint, used = 0;
+
+	if (bmfs_dir_extents(dir) != 0)
+		return 0;
+	for (tint = 0; tint < dir->ExtentCount; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir->Entries + dir->ExtentIndex[tint] * 64);
+		if (pEntry->StartingBlock > next)
+		{
+			memmove(image + next * geo->BlockSize, image + pEntry->StartingBlock * geo->BlockSize, pEntry->ReservedBlocks * geo->BlockSize);
+			pEntry->StartingBlock = next;
+		}
+		if (pEntry->StartingBlock + pEntry->ReservedBlocks > next)
+			next = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+	if (next < last)
+		memset(image + next * geo->BlockSize, 0, (last - next) * geo->BlockSize);
+
+	for (tint = 0; tint < dir->Count; tint++)
+	{
+		if (dir->Entries[tint * 64] == 0x00)			// End of directory
+			break;
+		if (dir->Entries[tint * 64] != 0x01)			// Valid entry
+		{
+			if (used != tint)
+				memcpy(dir->Entries + used * 64, dir->Entries + tint * 64, 64);
+			used++;
+		}
+	}
+	memset(dir->Entries + used * 64, 0, (tint - used) * 64);
+	bmfs_dir_drop(dir);
+	return next;
+}
+
+
+
+// Read a whole BMFS-Lite image into memory
+// Returns 0 on success, -1 if it could not be read, -2 if its size is wrong
+static inline int bmfs_lite_load(const char *path, struct BMFSLiteImage *lite)
+{
+	FILE *f;
+	long size;
+	double begin;
+
+	memset(lite, 0, sizeof(struct BMFSLiteImage));
+	if ((f = fopen(path, "rb")) == NULL)
+		return -1;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if (size < BMFS_LITE_MINIMUM_SIZE || size > BMFS_LITE_MAXIMUM_SIZE)
+	{
+		fclose(f);
+		return -2;
+	}
+	lite->Image = bmfs_stats_malloc(size);
+	begin = bmfs_trace_io_begin();
+	if (lite->Image == NULL || fread(lite->Image, size, 1, f) != 1)	// Read the whole image in one go
+	{
+		free(lite->Image);
+		lite->Image = NULL;
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	bmfs_trace_io("image read", begin, size);
+	bmfsStats.ImageReads++;
+	bmfsStats.ImageRead += size;
+	lite->Size = size;
+	lite->Dir.Entries = lite->Image + bmfsLiteGeometry.DirectoryOffset;
+	lite->Dir.Count = 64;
+	return 0;
+}
+
+
+// Write a BMFS-Lite image held in memory back with a single write
+static inline int bmfs_lite_save(const char *path, struct BMFSLiteImage *lite)
+{
+	FILE *f;
+	int ret = 0;
+	double begin;
+
+	if ((f = fopen(path, "r+b")) == NULL)
+		return -1;
+	begin = bmfs_trace_io_begin();
+	if (fwrite(lite->Image, lite->Size, 1, f) != 1)
+		ret = -1;
+	bmfs_trace_io("image write", begin, lite->Size);
+	bmfsStats.ImageWrites++;
+	bmfsStats.ImageWritten += lite->Size;
+	if (fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+
+// Release a BMFS-Lite image held in memory
+static inline void bmfs_lite_free(struct BMFSLiteImage *lite)
+{
+	bmfs_dir_drop(&lite->Dir);
+	free(lite->Image);
+	lite->Image = NULL;
+}
+
+#endif
+
+/* EOF */
@@ -3,36 +3,41 @@
 /* v1.0 (2024 11 21) */
 
 /* Global includes */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
-
-/* Typedefs */
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef uint64_t u64;
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "bmfscore.h"
 
 /* Global defines */
-struct BMFSEntry
+#define symbolLength 96
+// A symbol for emit-object
+struct BMFSSymbol
 {
-	char FileName[32];
-	u64 StartingBlock; // Files start at block 4
-	u64 ReservedBlocks;
-	u64 FileSize;
-	u64 Unused;
+	char Name[symbolLength];
+	u64 Offset;
+	u64 Size;
 };
 
 /* Global constants */
 // Min drive size is 64KiB
-const unsigned int minimumDiskSize = (64 * 1024);
+const unsigned int minimumDiskSize = BMFS_LITE_MINIMUM_SIZE;
 // Max drive size is 2MiB
-const unsigned int maximumDiskSize = (2 * 1024 * 1024);
-// Block size in BMFS-Lite is 1KiB
+const unsigned int maximumDiskSize = BMFS_LITE_MAXIMUM_SIZE;
+// Block size in BMFS-Lite is 1KiB, files start at block 4 after the directory
 const unsigned int blockSize = 1024;
+// Emitted images are aligned to a 4KiB page so they can be used in place
+const unsigned int pageSize = 4096;
 
 /* Global variables */
 FILE *file, *disk;
@@ -45,11 +50,21 @@ char s_initialize[] = "initialize";
 char s_create[] = "create";
 char s_read[] = "read";
 char s_write[] = "write";
+char s_delete[] = "delete";
+char s_compact[] = "compact";
+char s_emit_object[] = "emit-object";
 struct BMFSEntry entry;
 void *pentry = &entry;
 char *BlockMap;
 char *FileBlocks;
-char Directory[4096];
+char *Image;				// Whole disk image, loaded at open and written back once
+char *Directory;
+struct BMFSDirectory dir = { NULL, 64, NULL, 0, NULL, 0 };
+int imageChanged = 0;
+int atomicMode = 0;
+int fitMode = BMFS_FIT_BEST;
+char *tracePath = NULL;
+unsigned long long traceSample = 1;
 
 /* Built-in functions */
 int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber);
@@ -57,21 +72,45 @@ void bmfs_list(void);
 void bmfs_format(void);
 int bmfs_initialize(char *diskname, char *size);
 void bmfs_create(char *filename, unsigned long long maxsize);
+void bmfs_create_blocks(char *filename, unsigned long long blocks);
 void bmfs_read(char *filename);
 void bmfs_write(char *filename);
+void bmfs_delete(char *filename);
+void bmfs_compact(void);
+int bmfs_emit_object(char *outname, char *prefix);
+int bmfs_options(int argc, char *argv[]);
+int bmfs_load(char *diskname);
+int bmfs_flush(char *diskname);
 
 /* Program code */
 int main(int argc, char *argv[])
 {
+	int tint, ret = 0;
+
 	/* Parse arguments */
-	if (argc == 1) // No arguments provided
+	if (getenv("BMFS_STATS") != NULL && bmfs_stats_start(getenv("BMFS_STATS")) != 0)
+	{
+		printf("bmfs error: Unknown BMFS_STATS mode '%s'\n", getenv("BMFS_STATS"));
+		exit(EXIT_FAILURE);
+	}
+	argc = bmfs_options(argc, argv);
+	if (argc < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	else if (argc == 1) // No arguments provided
 	{
 		printf("BareMetal File System Lite Utility v1.0 (2024 11 19)\n");
 		printf("Written by Ian Seyler @ Return Infinity (ian.seyler@returninfinity.com)\n\n");
 		printf("Usage: bmfs disk function file\n\n");
 		printf("Disk:     the name of the disk file\n");
-		printf("Function: list, read, write, create, format, initialize\n");
-		printf("File:     (if applicable)\n");
+		printf("Function: list, read, write, create, delete, compact, emit-object, format, initialize\n");
+		printf("File:     (if applicable)\n\n");
+		printf("Options:  --atomic          replace the disk through a temporary file when it changes\n");
+		printf("          --fit=best|first  where new files are placed (default best)\n");
+		printf("          --stats[=text|json]  report time, I/O and memory use to stderr\n");
+		printf("          --trace=file      record a Chrome trace of phases, files and I/O\n");
+		printf("          --trace-sample=n  keep one in n block I/O spans in the trace\n");
 		exit(EXIT_SUCCESS);
 	}
 
@@ -82,6 +121,19 @@ int main(int argc, char *argv[])
 		filename = (argc > 3 ? argv[3] : NULL);
 	}
 
+	if (tracePath != NULL)
+	{
+		if (bmfs_trace_start(tracePath, "bmfslite", traceSample) != 0)
+		{
+			printf("bmfs error: Unable to create trace file '%s'\n", tracePath);
+			exit(EXIT_FAILURE);
+		}
+		atexit(bmfs_trace_stop);
+	}
+	if (bmfsStats.Mode != BMFS_STATS_OFF)
+		atexit(bmfs_stats_report);
+	bmfs_stats_phase("open");
+
 	if (argc > 2 && strcasecmp(s_initialize, command) == 0)
 	{
 		if (argc >= 4)
@@ -100,20 +152,14 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ((disk = fopen(diskname, "r+b")) == NULL)			// Open for read/write in binary mode
+	// Everything below works on the image in memory
+	bmfs_stats_phase("load");
+	if (bmfs_load(diskname) != 0)
 	{
-		printf("bmfs error: Unable to open disk '%s'\n", diskname);
 		exit(EXIT_FAILURE);
 	}
-	else								// Opened ok, is it a valid BMFS disk?
-	{
-		fseek(disk, 0, SEEK_END);
-		disksize = ftell(disk);					// Disk size in Bytes
-		fseek(disk, 0, SEEK_SET);				// Seek to start for directory
-		retval = fread(Directory, 4096, 1, disk);		// Read 4096 bytes to the Directory buffer
-		rewind(disk);
-	}
 
+	bmfs_stats_phase("command");
 	if (strcasecmp(s_list, command) == 0)
 	{
 		bmfs_list();
@@ -170,56 +216,226 @@ int main(int argc, char *argv[])
 	}
 	else if (strcasecmp(s_read, command) == 0)
 	{
-		bmfs_read(filename);
+		for (tint = 3; tint < argc; tint++)
+			bmfs_read(argv[tint]);
 	}
 	else if (strcasecmp(s_write, command) == 0)
 	{
-		bmfs_write(filename);
+		for (tint = 3; tint < argc; tint++)
+			bmfs_write(argv[tint]);
+	}
+	else if (strcasecmp(s_delete, command) == 0)
+	{
+		for (tint = 3; tint < argc; tint++)
+			bmfs_delete(argv[tint]);
+	}
+	else if (strcasecmp(s_compact, command) == 0)
+	{
+		bmfs_compact();
+	}
+	else if (strcasecmp(s_emit_object, command) == 0)
+	{
+		if (filename == NULL)
+		{
+			printf("Usage: bmfslite disk %s out.o|out.S|out.h [symbol]\n", command);
+			ret = 1;
+		}
+		else
+		{
+			ret = bmfs_emit_object(filename, (argc > 4 ? argv[4] : NULL));
+		}
 	}
 	else
 	{
 		printf("bmfs error: Unknown command\n");
 	}
 
-	if (disk != NULL)
+	// Write back all the changes at once
+	if (imageChanged)
 	{
-		fclose( disk );
-		disk = NULL;
+		bmfs_stats_phase("flush");
+		ret = bmfs_flush(diskname);
 	}
+	free(Image);
 
-	return 0;
+	return ret;
 }
 
 
-int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
+// Strip the global --name options out of the argument list
+// Returns the new argument count, or -1 if an option was not valid
+int bmfs_options(int argc, char *argv[])
 {
-	int tint;
+	int tint, count = 1;
 
-	for (tint = 0; tint < 64; tint++)
+	for (tint = 1; tint < argc; tint++)
 	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory
+		if (strncmp(argv[tint], "--", 2) != 0)
 		{
-			tint = 64;
+			argv[count++] = argv[tint];
 		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
+		else if (strcmp(argv[tint], "--atomic") == 0)
 		{
-			// Ignore
+			atomicMode = 1;
 		}
-		else							// Valid entry
+		else if (strcmp(argv[tint], "--fit=best") == 0)
+		{
+			fitMode = BMFS_FIT_BEST;
+		}
+		else if (strcmp(argv[tint], "--fit=first") == 0)
 		{
-			if (strcmp(filename, entry.FileName) == 0)
+			fitMode = BMFS_FIT_FIRST;
+		}
+		else if (strcmp(argv[tint], "--stats") == 0)
+		{
+			bmfs_stats_start("text");
+		}
+		else if (strncmp(argv[tint], "--trace=", 8) == 0)
+		{
+			tracePath = argv[tint] + 8;
+		}
+		else if (strcmp(argv[tint], "--trace") == 0 && tint + 1 < argc)
+		{
+			tracePath = argv[++tint];
+		}
+		else if (strncmp(argv[tint], "--trace-sample=", 15) == 0)
+		{
+			traceSample = strtoull(argv[tint] + 15, NULL, 10);
+			if (traceSample == 0)
 			{
-				memcpy(fileentry, pentry, 64);
-				*entrynumber = tint;
-				return 1;
+				printf("bmfs error: Trace sample must be at least 1\n");
+				return -1;
 			}
 		}
+		else if (strncmp(argv[tint], "--stats=", 8) == 0)
+		{
+			if (bmfs_stats_start(argv[tint] + 8) != 0)
+			{
+				printf("bmfs error: Unknown statistics format '%s'\n", argv[tint] + 8);
+				return -1;
+			}
+		}
+		else
+		{
+			printf("bmfs error: Unknown option '%s'\n", argv[tint]);
+			return -1;
+		}
+	}
+	argv[count] = NULL;
+	return count;
+}
+
+
+// Read the whole disk image into memory
+int bmfs_load(char *diskname)
+{
+	struct BMFSLiteImage lite;
+	int ret;
+
+	ret = bmfs_lite_load(diskname, &lite);
+	if (ret == -2)
+	{
+		printf("bmfs error: Disk size must be between %d and %d bytes\n", minimumDiskSize, maximumDiskSize);
+		return -1;
 	}
+	else if (ret != 0)
+	{
+		printf("bmfs error: Unable to read disk '%s'\n", diskname);
+		return -1;
+	}
+	Image = lite.Image;
+	disksize = lite.Size;
+	dir = lite.Dir;
+	Directory = dir.Entries;
 	return 0;
 }
 
 
+// Write the image back to the disk with a single write
+// In atomic mode the image goes to a temporary file first, which is flushed
+// and then renamed over the disk, so the disk is never left half written
+int bmfs_flush(char *diskname)
+{
+	char *target = diskname;
+	FILE *f;
+	double begin;
+	int ret = 0;
+
+	if (atomicMode)
+	{
+		target = bmfs_stats_malloc(strlen(diskname) + 5);
+		if (target == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			return 1;
+		}
+		sprintf(target, "%s.tmp", diskname);
+	}
+
+	if ((f = fopen(target, (atomicMode ? "wb" : "r+b"))) == NULL)
+	{
+		printf("bmfs error: Unable to open disk '%s'\n", target);
+		ret = 1;
+	}
+	else
+	{
+		begin = bmfs_trace_io_begin();
+		if (fwrite(Image, disksize, 1, f) != 1 || fflush(f) != 0)
+			ret = 1;
+		bmfs_trace_io("image write", begin, disksize);
+		bmfsStats.ImageWrites++;
+		bmfsStats.ImageWritten += disksize;
+		if (atomicMode && ret == 0)
+		{
+			bmfsStats.Syncs++;
+			begin = bmfs_trace_begin();
+#ifdef _WIN32
+			ret = (_commit(_fileno(f)) == 0 ? 0 : 1);
+#else
+			ret = (fsync(fileno(f)) == 0 ? 0 : 1);
+#endif
+			bmfs_trace_span("io", "sync", begin, 0);
+		}
+		if (fclose(f) != 0)
+			ret = 1;
+		if (ret != 0)
+			printf("bmfs error: Unable to write disk '%s'\n", target);
+	}
+
+	if (atomicMode)
+	{
+		if (ret == 0)
+		{
+#ifdef _WIN32
+			if (MoveFileExA(target, diskname, MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+			if (rename(target, diskname) != 0)
+#endif
+			{
+				printf("bmfs error: Unable to replace disk '%s'\n", diskname);
+				ret = 1;
+			}
+		}
+		if (ret != 0)
+			remove(target);
+		free(target);
+	}
+	return ret;
+}
+
+
+int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
+{
+	int slot = bmfs_dir_find(&dir, filename);
+
+	if (slot < 0)
+		return 0;
+	memcpy(fileentry, Directory + slot * 64, 64);
+	*entrynumber = slot;
+	return 1;
+}
+
+
 void bmfs_list(void)
 {
 	int tint;
@@ -248,7 +464,12 @@ void bmfs_list(void)
 
 void bmfs_format(void)
 {
-// Todo - overwrite entire file with zeros
+	// A freshly initialized disk is already zero
+	if (Image != NULL)
+	{
+		memset(Image, 0, disksize);
+		imageChanged = 1;
+	}
 }
 
 
@@ -352,7 +573,7 @@ int bmfs_initialize(char *diskname, char *size)
 	// Allocate buffer to use for filling the disk image with zeros.
 	if (ret == 0)
 	{
-		buffer = (char *) malloc(bufferSize);
+		buffer = (char *) bmfs_stats_malloc(bufferSize);
 		if (buffer == NULL)
 		{
 			printf("bmfs error: Failed to allocate buffer\n");
@@ -397,6 +618,8 @@ int bmfs_initialize(char *diskname, char *size)
 				break;
 			}
 			writeSize += chunkSize;
+			bmfsStats.ImageWrites++;
+			bmfsStats.ImageWritten += chunkSize;
 		}
 		if (ret == 0)
 		{
@@ -431,124 +654,114 @@ int bmfs_initialize(char *diskname, char *size)
 	return ret;
 }
 
-// helper function for qsort, sorts by StartingBlock field
-static int StartingBlockCmp(const void *pa, const void *pb)
+// Create a file with room for maxsize bytes
+void bmfs_create(char *filename, unsigned long long maxsize)
 {
-	struct BMFSEntry *ea = (struct BMFSEntry *)pa;
-	struct BMFSEntry *eb = (struct BMFSEntry *)pb;
-	// empty records go to the end
-	if (ea->FileName[0] == 0x01)
-		return 1;
-	if (eb->FileName[0] == 0x01)
-		return -1;
-	// compare non-empty records by their starting blocks number
-	return (ea->StartingBlock - eb->StartingBlock);
+	bmfs_create_blocks(filename, (maxsize + blockSize - 1) / blockSize);
 }
 
-void bmfs_create(char *filename, unsigned long long maxsize)
+
+void bmfs_create_blocks(char *filename, unsigned long long blocks_requested)
 {
 	struct BMFSEntry tempentry;
 	int slot;
 
+	if (strlen(filename) > 31)
+	{
+		printf("bmfs error: Filename too long.\n");
+		return;
+	}
+
 	if (bmfs_find(filename, &tempentry, &slot) == 0)
 	{
-		unsigned long long blocks_requested = maxsize / 2; // how many blocks to allocate
-		char dir_copy[4096]; // copy of directory
-		int num_used_entries = 0; // how many entries of Directory are either used or deleted
-		int first_free_entry = -1; // where to put new entry
-		int tint;
-		struct BMFSEntry *pEntry;
-		unsigned long long new_file_start = 0;
+		unsigned int num_used_entries; // how many entries of Directory are either used or deleted
+		unsigned int position; // where the new file goes in disk order
+		int first_free_entry; // where to put new entry
+		unsigned long long new_file_start;
+		unsigned long long first = bmfs_first_block(&bmfsLiteGeometry);
+		unsigned long long last = bmfs_last_block(&bmfsLiteGeometry, disksize);
 
-		if(strlen(filename) > 31)
+		// Find an area with enough free blocks, closing up the gaps between
+		// files first if there is enough space but no single gap is big enough
+		new_file_start = bmfs_dir_place(&dir, first, last, blocks_requested, fitMode, &position);
+		if (new_file_start == 0 && bmfs_dir_free_blocks(&dir, first, last) >= blocks_requested)
 		{
-			printf("bmfs error: Filename too long.\n");
-			return;
+			bmfs_compact();
+			new_file_start = bmfs_dir_place(&dir, first, last, blocks_requested, fitMode, &position);
 		}
-
-		// Make a copy of Directory to play with
-		memcpy(dir_copy, Directory, 4096);
-
-		// Calculate number of files
-		for (tint = 0; tint < 64; tint++)
+		if (new_file_start == 0)
 		{
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-			if (pEntry->FileName[0] == 0x00) // end of directory
-			{
-				num_used_entries = tint;
-				if (first_free_entry == -1)
-					first_free_entry = tint; // there were no unused entires before, will use this one
-				break;
-			}
-			else if (pEntry->FileName[0] == 0x01) // unused entry
-			{
-				if (first_free_entry == -1)
-					first_free_entry = tint; // will use it for our new file
-			}
+			printf("bmfs error: Cannot create file of %llu blocks.\n", blocks_requested);
+			return;
 		}
 
+		first_free_entry = bmfs_dir_free_slot(&dir, &num_used_entries);
 		if (first_free_entry == -1)
 		{
 			printf("bmfs error: Cannot create file. No free directory entries.\n");
 			return;
 		}
 
-		// Find an area with enough free blocks
-		// Sort our copy of the directory by starting block number
-		qsort(dir_copy, num_used_entries, 64, StartingBlockCmp);
-
-		for (tint = 0; tint < num_used_entries + 1; tint++)
-		{
-			// on each iteration of this loop we'll see if a new file can fit
-			// between the end of the previous file (initially == 1)
-			// and the beginning of the current file (or the last data block if there are no more files).
-
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
+		// Add file record to Directory
+		bmfs_dir_add(&dir, first_free_entry, num_used_entries, position, filename, new_file_start, blocks_requested);
 
-			new_file_start += pEntry->ReservedBlocks;
-		}
-		new_file_start += 4; // Skip the directory
+		imageChanged = 1;
 
-		// Add file record to Directory
-		pEntry = (struct BMFSEntry *)(Directory + first_free_entry * 64);
-		pEntry->StartingBlock = new_file_start;
-		pEntry->ReservedBlocks = blocks_requested;
-		pEntry->FileSize = 0;
-		strcpy(pEntry->FileName, filename);
+		// printf("Complete: file %s starts at block %lld, directory entry #%d.\n", filename, new_file_start, first_free_entry);
+	}
+	else
+	{
+		printf("bmfs error: File already exists.\n");
+	}
+}
 
-		if (first_free_entry == num_used_entries && num_used_entries + 1 < 64)
-		{
-			// here we used the record that was marked with 0x00,
-			// so make sure to mark the next record with 0x00 if it exists
-			pEntry = (struct BMFSEntry *)(Directory + (num_used_entries + 1) * 64);
-			pEntry->FileName[0] = 0x00;
-		}
 
-		// Flush Directory to disk
-		fseek(disk, 0, SEEK_SET);				// Seek to start for directory
-		fwrite(Directory, 4096, 1, disk);			// Write 4096 bytes for the Directory
+// Delete a file, leaving its blocks free for new files
+void bmfs_delete(char *filename)
+{
+	struct BMFSEntry tempentry;
+	int slot;
 
-		// printf("Complete: file %s starts at block %lld, directory entry #%d.\n", pEntry->FileName, pEntry->StartingBlock, first_free_entry);
+	if (0 == bmfs_find(filename, &tempentry, &slot))
+	{
+		printf("bmfs error: File not found in BMFS.\n");
 	}
 	else
 	{
-		printf("bmfs error: File already exists.\n");
+		Directory[slot * 64] = 0x01;				// Mark the entry as unused
+		bmfs_dir_drop(&dir);
+		imageChanged = 1;
+	}
+}
+
+
+// Move all files to the start of the disk so the free space is in one piece
+void bmfs_compact(void)
+{
+	if (bmfs_mem_compact(&bmfsLiteGeometry, &dir, Image, disksize) == 0)
+	{
+		printf("bmfs error: Unable to allocate enough memory for directory.\n");
+		return;
 	}
+	imageChanged = 1;
 }
 
+
 // Read a file from a BMFS volume
 void bmfs_read(char *filename)
 {
 	struct BMFSEntry tempentry;
 	FILE *tfile;
-	int slot, retval;
-	unsigned long long bytestoread;
-	char *buffer;
+	int slot;
 
 	if (0 == bmfs_find(filename, &tempentry, &slot))
 	{
 		printf("bmfs error: File not found in BMFS.\n");
 	}
+	else if (!bmfs_entry_valid(&bmfsLiteGeometry, &tempentry, disksize))
+	{
+		printf("bmfs error: File '%s' lies outside the disk.\n", filename);
+	}
 	else
 	{
 		if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
@@ -557,48 +770,11 @@ void bmfs_read(char *filename)
 		}
 		else
 		{
-			bytestoread = tempentry.FileSize;
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (bytestoread != 0)
-				{
-					if (bytestoread >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, tfile);
-							bytestoread -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, bytestoread, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, bytestoread, 1, tfile);
-							bytestoread = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-				}
-			}
+			double begin = bmfs_trace_begin();
+			if (bmfs_mem_copy_out(&bmfsLiteGeometry, Image, &tempentry, tfile) != 0)
+				printf("bmfs error: Could not write local file '%s'\n", tempentry.FileName);
 			fclose(tfile);
+			bmfs_trace_span("file", tempentry.FileName, begin, tempentry.FileSize);
 		}
 	}
 }
@@ -609,9 +785,9 @@ void bmfs_write(char *filename)
 {
 	struct BMFSEntry tempentry;
 	FILE *tfile;
-	int slot, retval;
+	int slot;
 	unsigned long long tempfilesize;
-	char *buffer;
+	double begin = bmfs_trace_begin();
 
 	if ((tfile = fopen(filename, "rb")) == NULL)
 	{
@@ -625,64 +801,346 @@ void bmfs_write(char *filename)
 		rewind(tfile);
 		if (0 == bmfs_find(filename, &tempentry, &slot))
 		{
-			bmfs_create(filename, (tempfilesize+blockSize)/blockSize*2);
-			bmfs_find(filename, &tempentry, &slot);
+			bmfs_create_blocks(filename, bmfs_reserve_blocks(&bmfsLiteGeometry, tempfilesize));
+			if (0 == bmfs_find(filename, &tempentry, &slot))
+			{
+				fclose(tfile);
+				return;
+			}
 		}
 		if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
 		{
 			printf("bmfs error: Not enough reserved space in BMFS.\n");
 		}
+		else if (!bmfs_entry_valid(&bmfsLiteGeometry, &tempentry, disksize))
+		{
+			printf("bmfs error: File '%s' lies outside the disk.\n", filename);
+		}
+		else if (bmfs_mem_copy_in(&bmfsLiteGeometry, tfile, tempfilesize, Image, &tempentry) != 0)
+		{
+			printf("bmfs error: Unexpected read length detected.\n");
+		}
 		else
 		{
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (tempfilesize != 0)
-				{
-					if (tempfilesize >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, tfile);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, tempfilesize, 1, tfile);
-						if (retval == 1)
-						{
-							memset(buffer+(tempfilesize), 0, (blockSize-tempfilesize)); // 0 the rest of the buffer
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-				}
-			}
 			// Update directory
-			tempfilesize = ftell(tfile);
 			memcpy(Directory+(slot*64)+48, &tempfilesize, 8);
-			fseek(disk, 0, SEEK_SET);			// Seek to directory
-			fwrite(Directory, 4096, 1, disk);		// Write new directory to disk
+			memset(Directory+(slot*64)+56, 0, 8);	// The sync stamp no longer matches
+			imageChanged = 1;
 		}
 		fclose(tfile);
+		bmfs_trace_span("file", filename, begin, tempfilesize);
+	}
+}
+
+
+// Turn a prefix, file name and suffix into a C identifier
+static void bmfs_symbol_name(char *out, const char *prefix, const char *name, const char *suffix, int upper)
+{
+	size_t len = 0;
+	const char *parts[3];
+	int part;
+
+	parts[0] = prefix;
+	parts[1] = name;
+	parts[2] = suffix;
+	for (part = 0; part < 3; part++)
+	{
+		const char *c = parts[part];
+		if (c == NULL)
+			continue;
+		if (part > 0 && *c != '\0')
+			out[len++] = '_';
+		for (; *c != '\0' && len < symbolLength - 1; c++)
+		{
+			if (isalnum((unsigned char)*c))
+				out[len++] = (upper ? toupper((unsigned char)*c) : *c);
+			else
+				out[len++] = '_';
+		}
+	}
+	out[len] = '\0';
+}
+
+
+// Collect the symbols for an emitted image: the image itself, the directory
+// and the data of every file. Returns the number of symbols, or -1.
+static int bmfs_emit_symbols(struct BMFSSymbol **symbols, const char *prefix)
+{
+	struct BMFSSymbol *sym;
+	struct BMFSEntry *pEntry;
+	int tint, other, count = 2;
+
+	sym = bmfs_stats_malloc((dir.Count + 2) * sizeof(struct BMFSSymbol));
+	if (sym == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return -1;
+	}
+	bmfs_symbol_name(sym[0].Name, prefix, NULL, NULL, 0);
+	sym[0].Offset = 0;
+	sym[0].Size = disksize;
+	bmfs_symbol_name(sym[1].Name, prefix, "directory", NULL, 0);
+	sym[1].Offset = bmfsLiteGeometry.DirectoryOffset;
+	sym[1].Size = 4096;
+
+	for (tint = 0; tint < (int)dir.Count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(Directory + tint * 64);
+		if (pEntry->FileName[0] == 0x00)			// End of directory
+			break;
+		if (pEntry->FileName[0] == 0x01)			// Empty entry
+			continue;
+		if (!bmfs_entry_valid(&bmfsLiteGeometry, pEntry, disksize))
+		{
+			printf("bmfs error: File '%s' lies outside the disk.\n", pEntry->FileName);
+			free(sym);
+			return -1;
+		}
+		bmfs_symbol_name(sym[count].Name, prefix, pEntry->FileName, NULL, 0);
+		for (other = 0; other < count; other++)
+		{
+			if (strcmp(sym[other].Name, sym[count].Name) == 0)
+			{
+				// Names that only differ in punctuation get the slot number too
+				sprintf(tempstring, "%d", tint);
+				bmfs_symbol_name(sym[count].Name, prefix, pEntry->FileName, tempstring, 0);
+				break;
+			}
+		}
+		sym[count].Offset = pEntry->StartingBlock * blockSize;
+		sym[count].Size = pEntry->FileSize;
+		count++;
+	}
+	*symbols = sym;
+	return count;
+}
+
+
+// Write the image as GNU assembler source
+static int bmfs_emit_asm(FILE *out, struct BMFSSymbol *sym, int count)
+{
+	unsigned long long offset, zeros = 0;
+	unsigned int tint;
+	int s;
+
+	fprintf(out, "/* BMFS-Lite RAM disk generated by bmfslite from %s */\n\n", diskname);
+	fprintf(out, "\t.section .data\n\t.balign %u\n", pageSize);
+	fprintf(out, "\t.globl %s\n\t.type %s, @object\n\t.size %s, %u\n", sym[0].Name, sym[0].Name, sym[0].Name, disksize);
+	for (s = 1; s < count; s++)
+	{
+		fprintf(out, "\t.globl %s\n\t.set %s, %s + %llu\n", sym[s].Name, sym[s].Name, sym[0].Name, (unsigned long long)sym[s].Offset);
+	}
+	for (s = 0; s < count; s++)
+	{
+		fprintf(out, "\t.globl %s_size\n\t.set %s_size, %llu\n", sym[s].Name, sym[s].Name, (unsigned long long)sym[s].Size);
+	}
+	fprintf(out, "%s:\n", sym[0].Name);
+	for (offset = 0; offset < disksize; offset += 16)
+	{
+		// Runs of zeros are emitted as .zero to keep the source small
+		for (tint = 0; tint < 16 && Image[offset + tint] == 0; tint++);
+		if (tint == 16)
+		{
+			zeros += 16;
+			continue;
+		}
+		if (zeros > 0)
+			fprintf(out, "\t.zero %llu\n", zeros);
+		zeros = 0;
+		fprintf(out, "\t.byte ");
+		for (tint = 0; tint < 16; tint++)
+			fprintf(out, "0x%02x%s", (unsigned char)Image[offset + tint], (tint < 15 ? "," : "\n"));
+	}
+	if (zeros > 0)
+		fprintf(out, "\t.zero %llu\n", zeros);
+	fprintf(out, "\n\t.section .note.GNU-stack,\"\",@progbits\n");
+	return 0;
+}
+
+
+// Write the image as a C header with offset and size macros
+static int bmfs_emit_header(FILE *out, struct BMFSSymbol *sym, int count)
+{
+	char upper[symbolLength];
+	unsigned int offset;
+	int s;
+
+	bmfs_symbol_name(upper, sym[0].Name, "h", NULL, 1);
+	fprintf(out, "/* BMFS-Lite RAM disk generated by bmfslite from %s */\n", diskname);
+	fprintf(out, "/* Include this in one source file only, it defines %s */\n\n", sym[0].Name);
+	fprintf(out, "#ifndef %s\n#define %s\n\n", upper, upper);
+	for (s = 0; s < count; s++)
+	{
+		bmfs_symbol_name(upper, sym[s].Name, NULL, NULL, 1);
+		if (s > 0)
+			fprintf(out, "#define %s_OFFSET %llu\n", upper, (unsigned long long)sym[s].Offset);
+		fprintf(out, "#define %s_SIZE %llu\n", upper, (unsigned long long)sym[s].Size);
+	}
+	fprintf(out, "\nunsigned char %s[%u] __attribute__((aligned(%u))) = {\n", sym[0].Name, disksize, pageSize);
+	for (offset = 0; offset < disksize; offset++)
+		fprintf(out, "0x%02x%s", (unsigned char)Image[offset], (offset + 1 == disksize ? "\n" : ((offset & 15) == 15 ? ",\n" : ",")));
+	fprintf(out, "};\n\n#endif\n");
+	return 0;
+}
+
+
+// Store little-endian values in an ELF buffer
+static void bmfs_put(char *buf, unsigned long long value, int bytes)
+{
+	int tint;
+
+	for (tint = 0; tint < bytes; tint++)
+		buf[tint] = (char)(value >> (8 * tint));
+}
+
+
+// Write the image as an x86-64 ELF relocatable object
+// Sections are .data (the page aligned image), .symtab, .strtab, .shstrtab
+// and an empty .note.GNU-stack so the stack is not made executable
+static int bmfs_emit_elf(FILE *out, struct BMFSSymbol *sym, int count)
+{
+	static const char shstrtab[] = "\0.data\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+	unsigned long long dataoff, symoff, stroff, shstroff, shoff, total, strsize = 1, name;
+	int nsyms = 1 + 2 * count, s, ret = 0;
+	char *buf, *p;
+
+	for (s = 0; s < count; s++)
+		strsize += 2 * strlen(sym[s].Name) + 7;		// name\0 and name_size\0
+
+	dataoff = pageSize;
+	symoff = dataoff + disksize;
+	stroff = symoff + nsyms * 24;
+	shstroff = stroff + strsize;
+	shoff = (shstroff + sizeof(shstrtab) + 7) & ~7ULL;
+	total = shoff + 6 * 64;
+
+	buf = bmfs_stats_calloc(1, total);
+	if (buf == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		return -1;
+	}
+
+	// ELF header
+	memcpy(buf, "\177ELF", 4);
+	buf[4] = 2;						// 64-bit
+	buf[5] = 1;						// Little-endian
+	buf[6] = 1;						// Version
+	bmfs_put(buf + 16, 1, 2);				// Relocatable
+	bmfs_put(buf + 18, 62, 2);				// x86-64
+	bmfs_put(buf + 20, 1, 4);
+	bmfs_put(buf + 40, shoff, 8);
+	bmfs_put(buf + 52, 64, 2);				// Header size
+	bmfs_put(buf + 58, 64, 2);				// Section header size
+	bmfs_put(buf + 60, 6, 2);				// Section count
+	bmfs_put(buf + 62, 4, 2);				// Section names in .shstrtab
+
+	memcpy(buf + dataoff, Image, disksize);
+
+	// Symbols: every data symbol is a global object in .data, every size is absolute
+	name = 1;
+	for (s = 0; s < count; s++)
+	{
+		p = buf + symoff + (1 + 2 * s) * 24;
+		strcpy(buf + stroff + name, sym[s].Name);
+		bmfs_put(p, name, 4);
+		p[4] = 0x11;					// Global object
+		bmfs_put(p + 6, 1, 2);				// .data
+		bmfs_put(p + 8, sym[s].Offset, 8);
+		bmfs_put(p + 16, sym[s].Size, 8);
+		name += strlen(sym[s].Name) + 1;
+
+		p += 24;
+		sprintf(buf + stroff + name, "%s_size", sym[s].Name);
+		bmfs_put(p, name, 4);
+		p[4] = 0x10;					// Global, no type
+		bmfs_put(p + 6, 0xfff1, 2);			// Absolute
+		bmfs_put(p + 8, sym[s].Size, 8);
+		name += strlen(sym[s].Name) + 6;
+	}
+	memcpy(buf + shstroff, shstrtab, sizeof(shstrtab));
+
+	// Section headers, after the null one
+	p = buf + shoff + 64;					// .data
+	bmfs_put(p, 1, 4);
+	bmfs_put(p + 4, 1, 4);					// Program bits
+	bmfs_put(p + 8, 3, 8);					// Writable, allocated
+	bmfs_put(p + 24, dataoff, 8);
+	bmfs_put(p + 32, disksize, 8);
+	bmfs_put(p + 48, pageSize, 8);
+	p += 64;						// .symtab
+	bmfs_put(p, 7, 4);
+	bmfs_put(p + 4, 2, 4);
+	bmfs_put(p + 24, symoff, 8);
+	bmfs_put(p + 32, nsyms * 24, 8);
+	bmfs_put(p + 40, 3, 4);					// Names in .strtab
+	bmfs_put(p + 44, 1, 4);					// First global symbol
+	bmfs_put(p + 48, 8, 8);
+	bmfs_put(p + 56, 24, 8);
+	p += 64;						// .strtab
+	bmfs_put(p, 15, 4);
+	bmfs_put(p + 4, 3, 4);
+	bmfs_put(p + 24, stroff, 8);
+	bmfs_put(p + 32, strsize, 8);
+	bmfs_put(p + 48, 1, 8);
+	p += 64;						// .shstrtab
+	bmfs_put(p, 23, 4);
+	bmfs_put(p + 4, 3, 4);
+	bmfs_put(p + 24, shstroff, 8);
+	bmfs_put(p + 32, sizeof(shstrtab), 8);
+	bmfs_put(p + 48, 1, 8);
+	p += 64;						// .note.GNU-stack
+	bmfs_put(p, 33, 4);
+	bmfs_put(p + 4, 1, 4);
+	bmfs_put(p + 24, shstroff, 8);
+	bmfs_put(p + 48, 1, 8);
+
+	if (fwrite(buf, total, 1, out) != 1)
+		ret = -1;
+	bmfsStats.HostWrites++;
+	bmfsStats.HostWritten += total;
+	free(buf);
+	return ret;
+}
+
+
+// Write the image in a form that can be linked into a kernel, chosen by the
+// extension of the output file: .o for an ELF object, .S for assembler
+// source or .h for a C header
+int bmfs_emit_object(char *outname, char *prefix)
+{
+	struct BMFSSymbol *sym;
+	const char *ext = strrchr(outname, '.');
+	FILE *out;
+	int count, ret = -1;
+
+	if (ext == NULL || (strcmp(ext, ".o") != 0 && strcmp(ext, ".S") != 0 && strcmp(ext, ".s") != 0 && strcmp(ext, ".h") != 0))
+	{
+		printf("bmfs error: Output file must end in .o, .S or .h\n");
+		return 1;
+	}
+	count = bmfs_emit_symbols(&sym, (prefix != NULL ? prefix : "bmfs_ramdisk"));
+	if (count < 0)
+		return 1;
+	if ((out = fopen(outname, (strcmp(ext, ".o") == 0 ? "wb" : "w"))) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", outname);
+	}
+	else
+	{
+		if (strcmp(ext, ".o") == 0)
+			ret = bmfs_emit_elf(out, sym, count);
+		else if (strcmp(ext, ".h") == 0)
+			ret = bmfs_emit_header(out, sym, count);
+		else
+			ret = bmfs_emit_asm(out, sym, count);
+		if (fclose(out) != 0)
+			ret = -1;
+		if (ret != 0)
+			printf("bmfs error: Could not write local file '%s'\n", outname);
 	}
+	free(sym);
+	return (ret == 0 ? 0 : 1);
 }
 
 
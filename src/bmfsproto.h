@@ -0,0 +1,212 @@
+/* BareMetal File System Server Protocol */
+/* Requests and replies for bmfs serve, shared by the server and its clients */
+
+#ifndef BMFSPROTO_H
+#define BMFSPROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include "bmfscore.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/* Global defines */
+// Operations
+#define BMFS_OP_LIST 1		// Reply is followed by Size bytes of directory entries
+#define BMFS_OP_FIND 2
+#define BMFS_OP_CREATE 3	// Reserve Size bytes
+#define BMFS_OP_READ 4		// Copy the file to the descriptor sent with the request
+#define BMFS_OP_WRITE 5		// Copy Size bytes from the descriptor sent with the request
+#define BMFS_OP_DELETE 6
+
+// Reply status
+#define BMFS_OK 0
+#define BMFS_ERR_NOT_FOUND 1
+#define BMFS_ERR_EXISTS 2
+#define BMFS_ERR_NO_SPACE 3
+#define BMFS_ERR_INVALID 4
+#define BMFS_ERR_IO 5
+
+// Every request is one of these, in host byte order since the socket is local
+struct BMFSRequest
+{
+	u32 Op;
+	u32 Reserved;
+	u64 Size;
+	char Name[32];
+};
+
+// Every reply is one of these
+struct BMFSReply
+{
+	u32 Status;
+	u32 Reserved;
+	u64 Size;		// Bytes copied, or bytes of entries following a list
+	struct BMFSEntry Entry;	// The file the request was about
+};
+
+
+#ifndef _WIN32
+// Send a whole message, with a file descriptor attached if fd is not -1
+// Returns 0, or -1 if the connection failed
+static inline int bmfs_proto_send(int sock, const void *buf, size_t len, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t sent;
+
+	while (len > 0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (fd >= 0)
+		{
+			memset(&control, 0, sizeof(control));
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		sent = sendmsg(sock, &msg, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return -1;
+		buf = (const char *)buf + sent;
+		len -= sent;
+		fd = -1;			// The descriptor goes with the first byte
+	}
+	return 0;
+}
+
+
+// Receive what has arrived of a message, up to len bytes, and the file
+// descriptor sent with it (fd is set to -1 if there was none)
+// Returns the bytes received, 0 if the connection was closed, or -1 with
+// errno set, which is EAGAIN when a non-blocking socket has nothing yet
+static inline ssize_t bmfs_proto_recv_some(int sock, void *buf, size_t len, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t got;
+	int received;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if ((got = recvmsg(sock, &msg, 0)) < 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+			if (*fd < 0)
+				*fd = received;
+			else
+				close(received);
+		}
+	}
+	return got;
+}
+
+
+// Receive a whole message, and the file descriptor sent with it if fd is
+// not NULL (set to -1 if there was none)
+// Returns 0, or -1 if the connection failed or was closed
+static inline int bmfs_proto_recv(int sock, void *buf, size_t len, int *fd)
+{
+	ssize_t got;
+	int received;
+
+	if (fd != NULL)
+		*fd = -1;
+	while (len > 0)
+	{
+		got = bmfs_proto_recv_some(sock, buf, len, &received);
+		if (received >= 0)
+		{
+			if (fd != NULL && *fd < 0)
+				*fd = received;
+			else
+				close(received);
+		}
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		buf = (char *)buf + got;
+		len -= got;
+	}
+	return 0;
+}
+
+
+// Connect to a server listening on a socket path
+// Returns the socket, or -1
+static inline int bmfs_proto_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path) || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+
+// Send a request and wait for the reply
+// Returns the reply status, or -1 if the connection failed
+static inline int bmfs_proto_call(int sock, u32 op, const char *name, u64 size, int fd, struct BMFSReply *reply)
+{
+	struct BMFSRequest req;
+
+	memset(&req, 0, sizeof(req));
+	req.Op = op;
+	req.Size = size;
+	if (name != NULL)
+		strncpy(req.Name, name, sizeof(req.Name) - 1);
+	if (bmfs_proto_send(sock, &req, sizeof(req), fd) != 0 || bmfs_proto_recv(sock, reply, sizeof(struct BMFSReply), NULL) != 0)
+		return -1;
+	return (int)reply->Status;
+}
+#endif
+
+#endif
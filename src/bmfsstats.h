@@ -0,0 +1,304 @@
+/* BareMetal File System Statistics */
+/* Counters and phase timing for --stats, and the event trace for --trace,
+   shared by the BMFS utilities */
+
+#ifndef BMFSSTATS_H
+#define BMFSSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/* Global defines */
+#define BMFS_STATS_OFF 0
+#define BMFS_STATS_TEXT 1
+#define BMFS_STATS_JSON 2
+#define BMFS_STATS_PHASES 16
+
+// Where the time of a command went and how much I/O it did
+// Calls are counted where the utilities call into the C library, so buffered
+// stdio calls can be fewer system calls than counted
+struct BMFSStats
+{
+	int Mode;
+	const char *Phase[BMFS_STATS_PHASES];
+	double Wall[BMFS_STATS_PHASES];
+	double Cpu[BMFS_STATS_PHASES];
+	int Phases;
+	int Current;			// Phase being timed plus one, 0 for none
+	double PhaseWall;		// When the current phase started
+	double PhaseCpu;
+	uint64_t ImageRead, ImageReads;		// Bytes and calls
+	uint64_t ImageWritten, ImageWrites;
+	uint64_t HostRead, HostReads;
+	uint64_t HostWritten, HostWrites;
+	uint64_t Seeks;
+	uint64_t Syncs;
+	uint64_t Locks;
+	uint64_t DirectoryWrites;
+	uint64_t Allocations, AllocatedBytes;
+};
+
+// Chrome trace event output, which Perfetto and chrome://tracing can open
+// Only File is checked on the hot paths, so tracing costs a branch when off
+struct BMFSTrace
+{
+	FILE *File;
+	double Start;			// Wall clock time of timestamp 0
+	uint64_t Sample;		// Record one block I/O in this many
+	uint64_t Random;		// State for picking which ones
+};
+
+/* Global variables */
+static struct BMFSStats bmfsStats;
+static struct BMFSTrace bmfsTrace;
+
+
+// Monotonic wall clock in seconds
+static inline double bmfs_stats_wall(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+// Start time of a span, or 0 when tracing is off
+static inline double bmfs_trace_begin(void)
+{
+	return (bmfsTrace.File != NULL ? bmfs_stats_wall() : 0);
+}
+
+
+// Write a name as a JSON string
+static inline void bmfs_json_string(FILE *out, const char *str)
+{
+	putc('"', out);
+	for (; *str != '\0'; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			putc(*str, out);
+	}
+	putc('"', out);
+}
+
+
+// Record a span from begin until now, with the bytes moved if not 0
+static inline void bmfs_trace_span(const char *cat, const char *name, double begin, uint64_t bytes)
+{
+	double end;
+
+	if (bmfsTrace.File == NULL)
+		return;
+	end = bmfs_stats_wall();
+	fprintf(bmfsTrace.File, ",\n{\"name\": ");
+	bmfs_json_string(bmfsTrace.File, name);
+	fprintf(bmfsTrace.File, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f", cat, (begin - bmfsTrace.Start) * 1e6, (end - begin) * 1e6);
+	if (bytes != 0)
+		fprintf(bmfsTrace.File, ", \"args\": {\"bytes\": %llu}", (unsigned long long)bytes);
+	putc('}', bmfsTrace.File);
+}
+
+
+// Start time of a block I/O span, or 0 when it is not recorded
+// One in every Sample of them is picked at random, so sampling does not
+// favour one side of a copy loop that alternates reads and writes
+static inline double bmfs_trace_io_begin(void)
+{
+	if (bmfsTrace.File == NULL)
+		return 0;
+	if (bmfsTrace.Sample > 1)
+	{
+		bmfsTrace.Random = bmfsTrace.Random * 6364136223846793005ULL + 1442695040888963407ULL;
+		if ((bmfsTrace.Random >> 33) % bmfsTrace.Sample != 0)
+			return 0;
+	}
+	return bmfs_stats_wall();
+}
+
+
+// Record a block I/O span started by bmfs_trace_io_begin
+static inline void bmfs_trace_io(const char *name, double begin, uint64_t bytes)
+{
+	if (begin != 0)
+		bmfs_trace_span("io", name, begin, bytes);
+}
+
+
+// Allocation wrappers, called in place of malloc, calloc and realloc by the
+// core and the utilities so their buffers are counted
+static inline void *bmfs_stats_malloc(size_t size)
+{
+	bmfsStats.Allocations++;
+	bmfsStats.AllocatedBytes += size;
+	return malloc(size);
+}
+
+
+static inline void *bmfs_stats_calloc(size_t count, size_t size)
+{
+	bmfsStats.Allocations++;
+	bmfsStats.AllocatedBytes += count * size;
+	return calloc(count, size);
+}
+
+
+static inline void *bmfs_stats_realloc(void *ptr, size_t size)
+{
+	bmfsStats.Allocations++;
+	bmfsStats.AllocatedBytes += size;
+	return realloc(ptr, size);
+}
+
+
+// End the current phase and start the one given
+// The time of phases with the same name is added together
+static inline void bmfs_stats_phase(const char *name)
+{
+	double wall, cpu;
+	int tint;
+
+	if (bmfsStats.Mode == BMFS_STATS_OFF && bmfsTrace.File == NULL)
+		return;
+	wall = bmfs_stats_wall();
+	cpu = (double)clock() / CLOCKS_PER_SEC;
+	if (bmfsStats.Current > 0)
+	{
+		bmfsStats.Wall[bmfsStats.Current - 1] += wall - bmfsStats.PhaseWall;
+		bmfsStats.Cpu[bmfsStats.Current - 1] += cpu - bmfsStats.PhaseCpu;
+		bmfs_trace_span("phase", bmfsStats.Phase[bmfsStats.Current - 1], bmfsStats.PhaseWall, 0);
+	}
+	bmfsStats.PhaseWall = wall;
+	bmfsStats.PhaseCpu = cpu;
+	bmfsStats.Current = 0;
+	if (name == NULL)
+		return;
+	for (tint = 0; tint < bmfsStats.Phases && strcmp(bmfsStats.Phase[tint], name) != 0; tint++)
+		;
+	if (tint == bmfsStats.Phases && tint < BMFS_STATS_PHASES)
+	{
+		bmfsStats.Phase[tint] = name;
+		bmfsStats.Phases++;
+	}
+	if (tint < bmfsStats.Phases)
+		bmfsStats.Current = tint + 1;
+}
+
+
+// Peak resident set size in KiB, or 0 where it is not known
+static inline unsigned long long bmfs_stats_peak_rss(void)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;		// Bytes on macOS
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+
+// Print the report to stderr, so the output of the command is unchanged
+static inline void bmfs_stats_report(void)
+{
+	struct BMFSStats *s = &bmfsStats;
+	double wall = 0, cpu = 0;
+	int tint;
+
+	bmfs_stats_phase(NULL);
+	for (tint = 0; tint < s->Phases; tint++)
+	{
+		wall += s->Wall[tint];
+		cpu += s->Cpu[tint];
+	}
+	if (s->Mode == BMFS_STATS_JSON)
+	{
+		fprintf(stderr, "{\"phases\": [");
+		for (tint = 0; tint < s->Phases; tint++)
+			fprintf(stderr, "%s{\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f}", (tint ? ", " : ""), s->Phase[tint], s->Wall[tint] * 1000, s->Cpu[tint] * 1000);
+		fprintf(stderr, "], \"wall_ms\": %.3f, \"cpu_ms\": %.3f, ", wall * 1000, cpu * 1000);
+		fprintf(stderr, "\"image\": {\"read_bytes\": %llu, \"reads\": %llu, \"written_bytes\": %llu, \"writes\": %llu}, ", (unsigned long long)s->ImageRead, (unsigned long long)s->ImageReads, (unsigned long long)s->ImageWritten, (unsigned long long)s->ImageWrites);
+		fprintf(stderr, "\"host\": {\"read_bytes\": %llu, \"reads\": %llu, \"written_bytes\": %llu, \"writes\": %llu}, ", (unsigned long long)s->HostRead, (unsigned long long)s->HostReads, (unsigned long long)s->HostWritten, (unsigned long long)s->HostWrites);
+		fprintf(stderr, "\"seeks\": %llu, \"syncs\": %llu, \"locks\": %llu, \"directory_writes\": %llu, ", (unsigned long long)s->Seeks, (unsigned long long)s->Syncs, (unsigned long long)s->Locks, (unsigned long long)s->DirectoryWrites);
+		fprintf(stderr, "\"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_kib\": %llu}\n", (unsigned long long)s->Allocations, (unsigned long long)s->AllocatedBytes, bmfs_stats_peak_rss());
+		return;
+	}
+	fprintf(stderr, "%-16s %12s %12s\n", "Phase", "Wall (ms)", "CPU (ms)");
+	for (tint = 0; tint < s->Phases; tint++)
+		fprintf(stderr, "%-16s %12.3f %12.3f\n", s->Phase[tint], s->Wall[tint] * 1000, s->Cpu[tint] * 1000);
+	fprintf(stderr, "%-16s %12.3f %12.3f\n", "total", wall * 1000, cpu * 1000);
+	fprintf(stderr, "%-16s %16s %10s %16s %10s\n", "", "Read (B)", "Calls", "Written (B)", "Calls");
+	fprintf(stderr, "%-16s %16llu %10llu %16llu %10llu\n", "image", (unsigned long long)s->ImageRead, (unsigned long long)s->ImageReads, (unsigned long long)s->ImageWritten, (unsigned long long)s->ImageWrites);
+	fprintf(stderr, "%-16s %16llu %10llu %16llu %10llu\n", "host files", (unsigned long long)s->HostRead, (unsigned long long)s->HostReads, (unsigned long long)s->HostWritten, (unsigned long long)s->HostWrites);
+	fprintf(stderr, "Seeks %llu, syncs %llu, locks %llu, directory writes %llu\n", (unsigned long long)s->Seeks, (unsigned long long)s->Syncs, (unsigned long long)s->Locks, (unsigned long long)s->DirectoryWrites);
+	fprintf(stderr, "Allocations %llu (%llu bytes), peak RSS %llu KiB\n", (unsigned long long)s->Allocations, (unsigned long long)s->AllocatedBytes, bmfs_stats_peak_rss());
+}
+
+
+// Turn on the report for a mode given as text or json
+// Returns 0, or -1 if the mode is not known
+static inline int bmfs_stats_start(const char *mode)
+{
+	if (mode == NULL || *mode == '\0' || strcmp(mode, "1") == 0 || strcmp(mode, "text") == 0)
+		bmfsStats.Mode = BMFS_STATS_TEXT;
+	else if (strcmp(mode, "json") == 0)
+		bmfsStats.Mode = BMFS_STATS_JSON;
+	else if (strcmp(mode, "0") == 0)
+		bmfsStats.Mode = BMFS_STATS_OFF;
+	else
+		return -1;
+	return 0;
+}
+
+
+
+// Open the trace file, recording one in every sample block I/O spans
+// Returns 0, or -1 if the file could not be created
+static inline int bmfs_trace_start(const char *path, const char *process, uint64_t sample)
+{
+	if ((bmfsTrace.File = fopen(path, "w")) == NULL)
+		return -1;
+	bmfsTrace.Start = bmfs_stats_wall();
+	bmfsTrace.Sample = (sample > 0 ? sample : 1);
+	fprintf(bmfsTrace.File, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(bmfsTrace.File, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"%s\"}}", process);
+	return 0;
+}
+
+
+// End the current phase and finish the trace file
+static inline void bmfs_trace_stop(void)
+{
+	if (bmfsTrace.File == NULL)
+		return;
+	bmfs_stats_phase(NULL);
+	fprintf(bmfsTrace.File, "\n]}\n");
+	fclose(bmfsTrace.File);
+	bmfsTrace.File = NULL;
+}
+
+#endif
@@ -0,0 +1,656 @@
+/* BareMetal File System Striped Volumes */
+/* One volume spread round-robin over several member images or devices, */
+/* or mirrored to all of them at once */
+
+#ifndef BMFSSTRIPE_H
+#define BMFSSTRIPE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "bmfscore.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+/* Global defines */
+#define BMFS_STRIPE_MAGIC "bmfs-stripe"
+#define BMFS_STRIPE_MAX 32
+#define BMFS_STRIPE_SIZE (2 * 1024 * 1024)
+
+#ifndef _WIN32
+struct BMFSStripe;
+struct BMFSStripeJob;
+
+// A thread kept for the life of the volume that does the share of each
+// read and write that is on one member
+struct BMFSStripeWorker
+{
+	struct BMFSStripe *Stripe;
+	struct BMFSStripeJob *Job;	// Handed over and not finished yet, or NULL
+	pthread_t Thread;
+	pthread_cond_t Wake;
+	unsigned int Member;
+	int Started;
+};
+#endif
+
+// A striped volume. Stripe s of the volume is at byte (s / Count) * Size
+// of member s % Count, so every member holds one stripe of each row.
+struct BMFSStripe
+{
+	unsigned int Count;		// Members
+	u64 Size;			// Bytes in a stripe
+	u64 Length;			// Bytes in the volume
+	u64 Position;			// Of the stream, see bmfs_stripe_stream
+	int Writable;
+	int Grown;			// Written past the end, so members get trimmed to match
+	int Mirror;			// Every member holds the whole volume
+	int Fd[BMFS_STRIPE_MAX];
+	int Error[BMFS_STRIPE_MAX];	// errno of a mirror member that failed and was dropped
+	u64 Written[BMFS_STRIPE_MAX];	// Bytes written to each member
+	double Busy[BMFS_STRIPE_MAX];	// Seconds spent writing to each member
+	char Path[BMFS_STRIPE_MAX][1024];
+#ifndef _WIN32
+	pthread_mutex_t Lock;		// Guards the workers and the counts above
+	pthread_cond_t Done;		// A worker finished its job
+	int Stopping;
+	struct BMFSStripeWorker Worker[BMFS_STRIPE_MAX];
+#endif
+};
+
+
+// Tell a striped volume descriptor from a disk image by its first line
+// Returns 1 if path is a descriptor
+static inline int bmfs_stripe_check(const char *path)
+{
+	char line[32];
+	FILE *f;
+	int ret = 0;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return 0;
+	if (fgets(line, sizeof(line), f) != NULL)
+		ret = (strncmp(line, BMFS_STRIPE_MAGIC, strlen(BMFS_STRIPE_MAGIC)) == 0 && (line[strlen(BMFS_STRIPE_MAGIC)] == '\n' || line[strlen(BMFS_STRIPE_MAGIC)] == '\r' || line[strlen(BMFS_STRIPE_MAGIC)] == '\0'));
+	fclose(f);
+	return ret;
+}
+
+
+// Read a descriptor:
+//	bmfs-stripe
+//	stripe-size 2M		# optional
+//	member /mnt/a/volume.0
+//	member /mnt/b/volume.1
+// Member paths that are not absolute are relative to the descriptor
+// Returns 0, or -1 if it is not valid
+static inline int bmfs_stripe_parse(const char *path, struct BMFSStripe *stripe)
+{
+	char line[1024], *key, *arg, *comment, *unit;
+	size_t dirlen;
+	FILE *f;
+	int ret = 0;
+
+	memset(stripe, 0, sizeof(struct BMFSStripe));
+	stripe->Size = BMFS_STRIPE_SIZE;
+	dirlen = (strrchr(path, '/') != NULL ? (size_t)(strrchr(path, '/') - path + 1) : 0);
+	if ((f = fopen(path, "r")) == NULL || fgets(line, sizeof(line), f) == NULL)
+	{
+		if (f != NULL)
+			fclose(f);
+		return -1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), f) != NULL)
+	{
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		if ((key = strtok(line, " \t\r\n")) == NULL)
+			continue;
+		if ((arg = strtok(NULL, " \t\r\n")) == NULL)
+			ret = -1;
+		else if (strcmp(key, "stripe-size") == 0)
+		{
+			stripe->Size = strtoull(arg, &unit, 10);
+			if (toupper(*unit) == 'K')
+				stripe->Size *= 1024;
+			else if (toupper(*unit) == 'M')
+				stripe->Size *= 1024 * 1024;
+			// Whole 4KiB pages, so directory blocks never straddle members
+			if (stripe->Size < 4096 || (stripe->Size & (stripe->Size - 1)) != 0)
+				ret = -1;
+		}
+		else if (strcmp(key, "member") == 0 && stripe->Count < BMFS_STRIPE_MAX)
+		{
+			if (arg[0] == '/' || dirlen == 0)
+				snprintf(stripe->Path[stripe->Count], 1024, "%s", arg);
+			else
+				snprintf(stripe->Path[stripe->Count], 1024, "%.*s%s", (int)dirlen, path, arg);
+			stripe->Count++;
+		}
+		else
+			ret = -1;
+	}
+	fclose(f);
+	return (ret == 0 && stripe->Count > 0 ? 0 : -1);
+}
+
+
+#ifndef _WIN32
+// Bytes of the first length bytes of the volume that are on a member
+static inline u64 bmfs_stripe_member_length(const struct BMFSStripe *stripe, unsigned int member, u64 length)
+{
+	u64 row = stripe->Size * stripe->Count;
+	u64 tail = length % row;
+	u64 bytes = (length / row) * stripe->Size;
+
+	if (stripe->Mirror)
+		return length;
+	if (tail > member * stripe->Size)
+		bytes += (tail - member * stripe->Size < stripe->Size ? tail - member * stripe->Size : stripe->Size);
+	return bytes;
+}
+
+
+// Part of one read or write, for one member
+struct BMFSStripeJob
+{
+	struct BMFSStripe *Stripe;
+	char *Buffer;
+	u64 Length;
+	u64 Offset;
+	unsigned int Member;
+	int Writing;
+	int Result;
+};
+
+
+// Copy every stripe of a read or write that is on one member, or all of it
+// for a mirror. Result is set to 0, or to the errno of a failure.
+static inline void *bmfs_stripe_member_io(void *arg)
+{
+	struct BMFSStripeJob *job = arg;
+	struct BMFSStripe *stripe = job->Stripe;
+	u64 offset = job->Offset, done = 0, moved = 0, chunk, at;
+	double start = bmfs_stats_wall();
+	ssize_t got;
+
+	job->Result = 0;
+	while (done < job->Length)
+	{
+		chunk = (stripe->Mirror ? job->Length - done : stripe->Size - offset % stripe->Size);
+		if (chunk > job->Length - done)
+			chunk = job->Length - done;
+		if (stripe->Mirror || (offset / stripe->Size) % stripe->Count == job->Member)
+		{
+			at = (stripe->Mirror ? offset : (offset / stripe->Size / stripe->Count) * stripe->Size + offset % stripe->Size);
+			if (job->Writing)
+				got = pwrite(stripe->Fd[job->Member], job->Buffer + done, chunk, at);
+			else
+				got = pread(stripe->Fd[job->Member], job->Buffer + done, chunk, at);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+			{
+				job->Result = (got < 0 ? errno : EIO);
+				break;
+			}
+			chunk = got;
+			moved += got;
+		}
+		done += chunk;
+		offset += chunk;
+	}
+	if (job->Writing)
+	{
+		pthread_mutex_lock(&stripe->Lock);
+		stripe->Written[job->Member] += moved;
+		stripe->Busy[job->Member] += bmfs_stats_wall() - start;
+		pthread_mutex_unlock(&stripe->Lock);
+	}
+	return NULL;
+}
+
+
+// Run the jobs handed to one member until the volume is closed
+static inline void *bmfs_stripe_worker(void *arg)
+{
+	struct BMFSStripeWorker *worker = arg;
+	struct BMFSStripe *stripe = worker->Stripe;
+
+	pthread_mutex_lock(&stripe->Lock);
+	while (!stripe->Stopping)
+	{
+		if (worker->Job == NULL)
+		{
+			pthread_cond_wait(&worker->Wake, &stripe->Lock);
+			continue;
+		}
+		pthread_mutex_unlock(&stripe->Lock);
+		bmfs_stripe_member_io(worker->Job);
+		pthread_mutex_lock(&stripe->Lock);
+		worker->Job = NULL;
+		pthread_cond_broadcast(&stripe->Done);
+	}
+	pthread_mutex_unlock(&stripe->Lock);
+	return NULL;
+}
+
+
+// Start a worker for each member, once, when the volume is opened. A
+// member without one has its share done on the calling thread instead.
+static inline void bmfs_stripe_start(struct BMFSStripe *stripe)
+{
+	struct BMFSStripeWorker *worker;
+	unsigned int tint;
+
+	pthread_mutex_init(&stripe->Lock, NULL);
+	pthread_cond_init(&stripe->Done, NULL);
+	for (tint = 0; stripe->Count > 1 && tint < stripe->Count; tint++)
+	{
+		worker = &stripe->Worker[tint];
+		worker->Stripe = stripe;
+		worker->Member = tint;
+		if (stripe->Fd[tint] < 0)
+			continue;
+		pthread_cond_init(&worker->Wake, NULL);
+		worker->Started = (pthread_create(&worker->Thread, NULL, bmfs_stripe_worker, worker) == 0);
+		if (!worker->Started)
+			pthread_cond_destroy(&worker->Wake);
+	}
+}
+
+
+
+
+// Open the members of a volume with fopen style mode "rb", "r+b" or "wb"
+// A mirror member that cannot be opened is dropped
+// Returns 0, -2 if a member could not be opened, or -3 if the members do
+// not make up one volume
+static inline int bmfs_stripe_attach(struct BMFSStripe *stripe, const char *mode)
+{
+	char first[7168], other[7168];
+	unsigned int tint, healthy = 0;
+	ssize_t got = 0;
+	off_t end;
+	int flags = O_RDONLY, ret = 0;
+
+	if (mode[0] == 'w')
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	else if (strchr(mode, '+') != NULL)
+		flags = O_RDWR;
+	stripe->Writable = (flags != O_RDONLY);
+	for (tint = 0; tint < stripe->Count; tint++)
+		stripe->Fd[tint] = -1;
+	for (tint = 0; tint < stripe->Count; tint++)
+	{
+		if ((stripe->Fd[tint] = open(stripe->Path[tint], flags, 0644)) < 0)
+		{
+			if (stripe->Mirror)
+				stripe->Error[tint] = errno;
+			else
+				ret = -2;
+			continue;
+		}
+		// lseek rather than fstat so block devices have a size too
+		if ((end = lseek(stripe->Fd[tint], 0, SEEK_END)) < 0)
+			end = 0;
+		if (!stripe->Mirror)
+			stripe->Length += end;
+		else if (healthy++ == 0 || (u64)end < stripe->Length)
+			stripe->Length = end;
+	}
+	if (stripe->Mirror && healthy == 0)
+		ret = -2;
+	for (tint = 0, healthy = 0; ret == 0 && tint < stripe->Count; tint++)
+	{
+		if (!stripe->Mirror)
+		{
+			if (lseek(stripe->Fd[tint], 0, SEEK_END) != (off_t)bmfs_stripe_member_length(stripe, tint, stripe->Length))
+				ret = -3;
+		}
+		else if (stripe->Fd[tint] >= 0 && !(flags & O_TRUNC))
+		{
+			// Mirrors have to start out with the same disk information and directory
+			if (healthy++ == 0)
+				got = pread(stripe->Fd[tint], first, sizeof(first), 1024);
+			else if (got != pread(stripe->Fd[tint], other, sizeof(other), 1024) || (got > 0 && memcmp(first, other, got) != 0))
+				ret = -3;
+		}
+	}
+	if (ret != 0)
+	{
+		for (tint = 0; tint < stripe->Count; tint++)
+		{
+			if (stripe->Fd[tint] >= 0)
+				close(stripe->Fd[tint]);
+		}
+		return ret;
+	}
+	bmfs_stripe_start(stripe);
+	return 0;
+}
+
+
+// Open a striped volume from its descriptor
+// Returns 0, -1 if the descriptor is not valid, or an error of
+// bmfs_stripe_attach
+static inline int bmfs_stripe_open(const char *path, const char *mode, struct BMFSStripe **out)
+{
+	struct BMFSStripe *stripe;
+	int ret;
+
+	*out = NULL;
+	if ((stripe = bmfs_stats_malloc(sizeof(struct BMFSStripe))) == NULL)
+		return -1;
+	if (bmfs_stripe_parse(path, stripe) != 0)
+	{
+		free(stripe);
+		return -1;
+	}
+	if ((ret = bmfs_stripe_attach(stripe, mode)) != 0)
+	{
+		free(stripe);
+		return ret;
+	}
+	*out = stripe;
+	return 0;
+}
+
+
+// Open the same volume on every disk in a comma separated list
+// Returns 0, -1 if the list is not valid, or an error of bmfs_stripe_attach
+static inline int bmfs_stripe_mirror(const char *list, const char *mode, struct BMFSStripe **out)
+{
+	struct BMFSStripe *stripe;
+	size_t len;
+	int ret;
+
+	*out = NULL;
+	if ((stripe = bmfs_stats_malloc(sizeof(struct BMFSStripe))) == NULL)
+		return -1;
+	memset(stripe, 0, sizeof(struct BMFSStripe));
+	stripe->Size = BMFS_STRIPE_SIZE;
+	stripe->Mirror = 1;
+	while (*list != '\0')
+	{
+		len = strcspn(list, ",");
+		if (len == 0 || len >= sizeof(stripe->Path[0]) || stripe->Count == BMFS_STRIPE_MAX)
+		{
+			free(stripe);
+			return -1;
+		}
+		memcpy(stripe->Path[stripe->Count], list, len);
+		stripe->Path[stripe->Count++][len] = '\0';
+		list += len + (list[len] == ',');
+	}
+	ret = (stripe->Count > 0 ? bmfs_stripe_attach(stripe, mode) : -1);
+	if (ret != 0)
+	{
+		free(stripe);
+		return ret;
+	}
+	*out = stripe;
+	return 0;
+}
+
+
+// Read or write length bytes at a volume offset, on every member it
+// touches at once. A mirror reads from the first member that works and
+// writes to every member that works, dropping any that fail.
+// Returns 0, or -1 if the data could not be read or written
+static inline int bmfs_stripe_io(struct BMFSStripe *stripe, void *buf, u64 length, u64 offset, int writing)
+{
+	struct BMFSStripeJob jobs[BMFS_STRIPE_MAX];
+	struct BMFSStripeWorker *worker;
+	int handed[BMFS_STRIPE_MAX];
+	unsigned int tint, members = 0;
+	u64 spans;
+	int ret = 0;
+
+	if (length == 0)
+		return 0;
+	if (!stripe->Mirror)
+	{
+		spans = (offset % stripe->Size + length + stripe->Size - 1) / stripe->Size;
+		for (members = 0; members < spans && members < stripe->Count; members++)
+			jobs[members].Member = (unsigned int)((offset / stripe->Size + members) % stripe->Count);
+	}
+	else
+	{
+		for (tint = 0; tint < stripe->Count; tint++)
+		{
+			if (stripe->Error[tint] == 0 && (writing || members == 0))
+				jobs[members++].Member = tint;
+		}
+	}
+	if (members == 0)
+		return -1;
+	tint = 0;
+	do
+	{
+		jobs[tint].Stripe = stripe;
+		jobs[tint].Buffer = buf;
+		jobs[tint].Length = length;
+		jobs[tint].Offset = offset;
+		jobs[tint].Writing = writing;
+	} while (++tint < members);
+
+	// The first member's share is done on this thread, and so is that of
+	// any member whose worker is still busy with another caller's job
+	pthread_mutex_lock(&stripe->Lock);
+	for (handed[0] = 0, tint = 1; tint < members; tint++)
+	{
+		worker = &stripe->Worker[jobs[tint].Member];
+		handed[tint] = (worker->Started && worker->Job == NULL);
+		if (handed[tint])
+		{
+			worker->Job = &jobs[tint];
+			pthread_cond_signal(&worker->Wake);
+		}
+	}
+	pthread_mutex_unlock(&stripe->Lock);
+	for (tint = 0; tint < members; tint++)
+	{
+		if (!handed[tint])
+			bmfs_stripe_member_io(&jobs[tint]);
+	}
+	pthread_mutex_lock(&stripe->Lock);
+	for (tint = 1; tint < members; tint++)
+	{
+		while (handed[tint] && stripe->Worker[jobs[tint].Member].Job == &jobs[tint])
+			pthread_cond_wait(&stripe->Done, &stripe->Lock);
+	}
+	pthread_mutex_unlock(&stripe->Lock);
+	for (tint = 0; tint < members; tint++)
+	{
+		if (jobs[tint].Result == 0)
+			continue;
+		if (stripe->Mirror)
+			stripe->Error[jobs[tint].Member] = jobs[tint].Result;
+		else
+			ret = -1;
+	}
+	if (stripe->Mirror)
+	{
+		// A mirror carries on while any member works, and a failed read is
+		// tried again on the next one
+		for (ret = -1, tint = 0; tint < members; tint++)
+		{
+			if (jobs[tint].Result == 0)
+				ret = 0;
+		}
+		if (ret != 0 && !writing)
+			ret = bmfs_stripe_io(stripe, buf, length, offset, 0);
+	}
+	if (ret == 0 && writing && offset + length > stripe->Length)
+	{
+		stripe->Length = offset + length;
+		stripe->Grown = 1;
+	}
+	return ret;
+}
+
+
+// Flush every member to its device
+// Returns 0, or -1 if a member failed (every member, for a mirror)
+static inline int bmfs_stripe_sync(struct BMFSStripe *stripe)
+{
+	unsigned int tint;
+	int ret = 0, healthy = 0;
+
+	for (tint = 0; tint < stripe->Count; tint++)
+	{
+		if (stripe->Error[tint] != 0)
+			continue;
+		if (fsync(stripe->Fd[tint]) == 0)
+			healthy++;
+		else if (stripe->Mirror)
+			stripe->Error[tint] = errno;
+		else
+			ret = -1;
+	}
+	return (stripe->Mirror && healthy == 0 ? -1 : ret);
+}
+
+
+// Close a striped volume, trimming members of one that grew so their sizes
+// give the length of the volume the next time it is opened
+static inline int bmfs_stripe_close(struct BMFSStripe *stripe)
+{
+	struct stat st;
+	unsigned int tint;
+	int ret = 0;
+
+	pthread_mutex_lock(&stripe->Lock);
+	stripe->Stopping = 1;
+	for (tint = 0; tint < stripe->Count; tint++)
+	{
+		if (stripe->Worker[tint].Started)
+			pthread_cond_signal(&stripe->Worker[tint].Wake);
+	}
+	pthread_mutex_unlock(&stripe->Lock);
+	for (tint = 0; tint < stripe->Count; tint++)
+	{
+		if (!stripe->Worker[tint].Started)
+			continue;
+		pthread_join(stripe->Worker[tint].Thread, NULL);
+		pthread_cond_destroy(&stripe->Worker[tint].Wake);
+	}
+	pthread_cond_destroy(&stripe->Done);
+	pthread_mutex_destroy(&stripe->Lock);
+
+	for (tint = 0; tint < stripe->Count; tint++)
+	{
+		if (stripe->Fd[tint] < 0)
+			continue;
+		if (stripe->Grown && stripe->Error[tint] == 0 && fstat(stripe->Fd[tint], &st) == 0 && S_ISREG(st.st_mode))
+			ret |= ftruncate(stripe->Fd[tint], bmfs_stripe_member_length(stripe, tint, stripe->Length));
+		ret |= close(stripe->Fd[tint]);
+	}
+	free(stripe);
+	return ret;
+}
+
+
+// A stdio stream on a striped volume, so the code that reads and writes
+// a single disk image works unchanged. The stream buffer is one full row,
+// so each buffered read or write goes to every member at once (a mirror
+// gets one stripe, as each member takes all of every write anyway).
+// The stream owns the volume and closes it with fclose.
+static inline ssize_t bmfs_stripe_stream_read(void *cookie, char *buf, size_t size)
+{
+	struct BMFSStripe *stripe = cookie;
+
+	if (stripe->Position >= stripe->Length)
+		return 0;
+	if (size > stripe->Length - stripe->Position)
+		size = stripe->Length - stripe->Position;
+	if (bmfs_stripe_io(stripe, buf, size, stripe->Position, 0) != 0)
+		return -1;
+	stripe->Position += size;
+	return size;
+}
+
+static inline ssize_t bmfs_stripe_stream_write(void *cookie, const char *buf, size_t size)
+{
+	struct BMFSStripe *stripe = cookie;
+
+	if (bmfs_stripe_io(stripe, (char *)buf, size, stripe->Position, 1) != 0)
+		return (ssize_t)-1;
+	stripe->Position += size;
+	return size;
+}
+
+static inline int bmfs_stripe_stream_seek(void *cookie, long long *offset, int whence)
+{
+	struct BMFSStripe *stripe = cookie;
+	long long base = (whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (long long)stripe->Position : (long long)stripe->Length));
+
+	if (base + *offset < 0)
+		return -1;
+	stripe->Position = base + *offset;
+	*offset = stripe->Position;
+	return 0;
+}
+
+static inline int bmfs_stripe_stream_close(void *cookie)
+{
+	return bmfs_stripe_close(cookie);
+}
+
+#ifdef __linux__
+static inline int bmfs_stripe_stream_seek64(void *cookie, off64_t *offset, int whence)
+{
+	long long pos = *offset;
+	int ret = bmfs_stripe_stream_seek(cookie, &pos, whence);
+
+	*offset = pos;
+	return ret;
+}
+#else
+static inline int bmfs_stripe_stream_read32(void *cookie, char *buf, int size)
+{
+	return (int)bmfs_stripe_stream_read(cookie, buf, size);
+}
+
+static inline int bmfs_stripe_stream_write32(void *cookie, const char *buf, int size)
+{
+	return (int)bmfs_stripe_stream_write(cookie, buf, size);
+}
+
+static inline fpos_t bmfs_stripe_stream_seek32(void *cookie, fpos_t offset, int whence)
+{
+	long long pos = offset;
+
+	return (bmfs_stripe_stream_seek(cookie, &pos, whence) == 0 ? (fpos_t)pos : (fpos_t)-1);
+}
+#endif
+
+// Returns the stream, or NULL (the volume is closed either way on failure)
+static inline FILE *bmfs_stripe_stream(struct BMFSStripe *stripe)
+{
+	FILE *f;
+#ifdef __linux__
+	cookie_io_functions_t io = { bmfs_stripe_stream_read, bmfs_stripe_stream_write, bmfs_stripe_stream_seek64, bmfs_stripe_stream_close };
+
+	f = fopencookie(stripe, (stripe->Writable ? "r+" : "r"), io);
+#else
+	f = funopen(stripe, bmfs_stripe_stream_read32, (stripe->Writable ? bmfs_stripe_stream_write32 : NULL), bmfs_stripe_stream_seek32, bmfs_stripe_stream_close);
+#endif
+	if (f == NULL)
+	{
+		bmfs_stripe_close(stripe);
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, (stripe->Mirror ? stripe->Size : stripe->Size * stripe->Count));
+	return f;
+}
+#endif
+
+#endif
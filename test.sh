@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+
+# Runs every check in test/ against the programs in bin/ (build.sh first)
+# Exits with status 1 if any check failed
+
+status=0
+for t in test/*.sh; do
+	[ "$t" = test/lib.sh ] && continue
+	echo "== $t"
+	bash "$t" || status=1
+done
+exit $status
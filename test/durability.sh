@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+
+# Backup directory kept by --durability
+# After a batch write and a delete, the disk information and directory in
+# the last block must match those at the start of the disk byte for byte.
+# A change made without --durability must mark the backup as out of date.
+#
+# Usage: test/durability.sh
+
+. "$(dirname "$0")/lib.sh"
+SIZE=$((64 * 1048576))
+BACKUP=$((SIZE - 2 * 1048576))
+
+# Compare a range of the primary block 0 with the backup in the last block
+same() {
+	cmp -s <(dd if=disk.img bs=512 skip=$(($1 / 512)) count=$(($2 / 512)) 2> /dev/null) \
+		<(dd if=disk.img bs=512 skip=$(((BACKUP + $1) / 512)) count=$(($2 / 512)) 2> /dev/null)
+}
+
+"$BMFS" disk.img initialize 64M > /dev/null 2>&1 || exit 1
+head -c 3000000 /dev/urandom > a
+head -c 100000 /dev/urandom > b
+head -c 700000 /dev/urandom > c
+
+"$BMFS" disk.img write a b c --durability=batch > /dev/null
+check $? "batch write of three files"
+"$BMFS" disk.img list | grep -q '^c '
+check $? "files are in the directory"
+same 1024 512
+check $? "backup disk information matches after the batch write"
+same 4096 4096
+check $? "backup directory matches after the batch write"
+
+"$BMFS" disk.img delete b --durability=batch > /dev/null
+same 4096 4096
+check $? "backup directory matches after a delete"
+
+# Without --durability the backup goes stale, and must say so
+"$BMFS" disk.img delete c > /dev/null
+[ "$(dd if=disk.img bs=1 skip=$((BACKUP + 1024)) count=4 2> /dev/null | tr -d '\0')" != BMFS ]
+check $? "a change without durability clears the backup tag"
+"$BMFS" disk.img delete a --durability=batch > /dev/null
+same 1024 512 && same 4096 4096
+check $? "the next batch command writes the backup again"
+
+"$BMFS" disk.img fsck > /dev/null 2>&1
+check $? "disk checks clean"
+
+exit $FAILED
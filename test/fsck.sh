@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+
+# fsck finds and repairs injected damage
+# Two files are made to overlap by editing the directory by hand. fsck must
+# report it, fsck --repair must fix it without touching the data of the
+# file that keeps its blocks, and the disk must then check clean.
+#
+# Usage: test/fsck.sh
+
+. "$(dirname "$0")/lib.sh"
+
+# Set the starting block of a directory entry (little endian, below 256)
+set_start() {
+	printf "$(printf '\\%03o' "$3")\0\0\0\0\0\0\0" | dd of="$1" bs=1 seek=$((4096 + $2 * 64 + 32)) conv=notrunc 2> /dev/null
+}
+
+"$BMFS" disk.img initialize 64M > /dev/null 2>&1 || exit 1
+head -c 3000000 /dev/urandom > a
+head -c 100000 /dev/urandom > b
+head -c 100000 /dev/urandom > c
+"$BMFS" disk.img write a b c > /dev/null
+"$BMFS" disk.img fsck > /dev/null
+check $? "fresh disk checks clean"
+
+# b (entry 1) moved into the second block of a, which a needs all of
+set_start disk.img 1 2
+"$BMFS" disk.img fsck > out 2>&1
+check $(( $? == 4 ? 0 : 1 )) "fsck reports the overlap with exit status 4"
+grep -q -i "overlap" out
+check $? "fsck names the problem"
+
+"$BMFS" disk.img fsck --repair > /dev/null 2>&1
+check $(( $? == 1 ? 0 : 1 )) "fsck --repair fixes it with exit status 1"
+"$BMFS" disk.img fsck > /dev/null 2>&1
+check $? "repaired disk checks clean"
+
+mkdir out.d && cd out.d || exit 1
+"$BMFS" ../disk.img read a c > /dev/null 2>&1
+cmp -s a ../a && cmp -s c ../c
+check $? "files that keep their blocks read back unchanged"
+"$BMFS" ../disk.img list | grep -q '^b '
+check $(( $? == 0 ? 1 : 0 )) "the overlapping file is removed"
+cd ..
+
+exit $FAILED
@@ -0,0 +1,26 @@
+# Shared setup for the scripts in test/, sourced first by each of them
+# BMFS is the program under test (bin/bmfs unless set), and the script
+# runs in a fresh work directory that is removed when it exits. check
+# prints each result and FAILED becomes the exit status.
+
+BMFS=${BMFS:-$(pwd)/bin/bmfs}
+WORK=$(mktemp -d)
+FAILED=0
+
+# Scripts that leave something running redefine this to stop it
+at_exit() {
+	:
+}
+
+trap 'at_exit; rm -rf "$WORK"' EXIT
+
+check() {
+	if [ "$1" = 0 ]; then
+		echo "ok   $2"
+	else
+		echo "FAIL $2"
+		FAILED=1
+	fi
+}
+
+cd "$WORK" || exit 1
@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+
+# diff and patch round trips
+# A patch applied to the old image must give the new image byte for byte,
+# be recognised as applied afterwards, and be refused on another image.
+#
+# Usage: test/patch.sh
+
+. "$(dirname "$0")/lib.sh"
+
+"$BMFS" old.img initialize 64M > /dev/null 2>&1 || exit 1
+head -c 3000000 /dev/urandom > a
+head -c 100000 /dev/urandom > b
+head -c 5000000 /dev/urandom > c
+for f in a b c; do
+	"$BMFS" old.img write $f > /dev/null
+done
+
+# Files deleted, changed and added
+cp old.img new.img
+printf 'X' | dd of=c bs=1 seek=4000000 conv=notrunc 2> /dev/null
+head -c 700000 /dev/urandom > d
+"$BMFS" new.img delete b > /dev/null
+"$BMFS" new.img write c > /dev/null
+"$BMFS" new.img create d 1 > /dev/null
+"$BMFS" new.img write d > /dev/null
+"$BMFS" old.img diff new.img p.bin > /dev/null
+check $? "diff"
+cp old.img t.img
+"$BMFS" t.img patch p.bin > /dev/null
+check $? "patch"
+cmp -s t.img new.img
+check $? "patched image is the new image"
+"$BMFS" t.img patch p.bin | grep -q "already applied"
+check $? "patch again is already applied"
+"$BMFS" t.img fsck --deep > /dev/null
+check $? "patched image passes fsck --deep"
+
+# Only file data changes, so the directory of both images is the same
+cp old.img same.img
+head -c 3000000 /dev/urandom > a
+"$BMFS" same.img write a > /dev/null
+"$BMFS" old.img diff same.img s.bin > /dev/null
+cp old.img t2.img
+"$BMFS" t2.img patch s.bin | grep -q "already applied"
+check $(( ! $? )) "same-size rewrite is not taken as applied"
+cmp -s t2.img same.img
+check $? "same-size rewrite patches the file data"
+
+# A different image of the same size is refused and left alone
+"$BMFS" x.img initialize 64M > /dev/null 2>&1
+"$BMFS" x.img write b > /dev/null
+cp x.img x0.img
+"$BMFS" x.img patch s.bin > /dev/null
+check $(( $? != 1 )) "patch refuses another image"
+cmp -s x.img x0.img
+check $? "refused image is unchanged"
+
+# The image grows; free space is not shipped, so compare the files
+"$BMFS" big.img initialize 96M > /dev/null 2>&1
+"$BMFS" big.img write d > /dev/null
+"$BMFS" old.img diff big.img g.bin > /dev/null
+cp old.img t3.img
+mv d d.orig
+"$BMFS" t3.img patch g.bin > /dev/null && [ "$(stat -c %s t3.img 2> /dev/null || stat -f %z t3.img)" = 100663296 ] && "$BMFS" t3.img read d > /dev/null && cmp -s d d.orig && [ "$("$BMFS" t3.img list)" = "$("$BMFS" big.img list)" ]
+check $? "patch grows the image"
+
+exit $FAILED
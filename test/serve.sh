@@ -0,0 +1,108 @@
+#!/usr/bin/env bash
+
+# serve round trips against the command line
+# Files written through serve must read back with bmfs and the other way
+# round, deletes must show in the directory, and a client that stalls part
+# way through a request must not hold up the others.
+#
+# Usage: test/serve.sh
+
+. "$(dirname "$0")/lib.sh"
+SERVER=
+
+at_exit() {
+	[ -n "$SERVER" ] && kill $SERVER 2> /dev/null
+}
+
+if ! command -v python3 > /dev/null; then
+	echo "skip serve checks need python3"
+	exit 0
+fi
+
+"$BMFS" disk.img initialize 64M > /dev/null 2>&1 || exit 1
+head -c 3000000 /dev/urandom > cli.bin
+head -c 1234567 /dev/urandom > served.bin
+head -c 1000 /dev/urandom > gone.bin
+"$BMFS" disk.img write cli.bin > /dev/null
+"$BMFS" disk.img create gone.bin 1 > /dev/null
+"$BMFS" disk.img write gone.bin > /dev/null
+
+"$BMFS" disk.img serve --socket="$WORK/disk.sock" > serve.log &
+SERVER=$!
+for i in $(seq 50); do
+	[ -S disk.sock ] && break
+	sleep 0.1
+done
+
+# The client sends requests as laid out in src/bmfsproto.h
+python3 - "$WORK" << 'PY'
+import os, socket, struct, sys
+
+work = sys.argv[1]
+OK, LIST, FIND, CREATE, READ, WRITE, DELETE = 0, 1, 2, 3, 4, 5, 6
+
+def connect():
+	s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	s.settimeout(5)
+	s.connect(os.path.join(work, "disk.sock"))
+	return s
+
+def recv(s, n):
+	data = b""
+	while len(data) < n:
+		part = s.recv(n - len(data))
+		if not part:
+			raise EOFError
+		data += part
+	return data
+
+def call(s, op, name, size=0, fd=None):
+	req = struct.pack("=IIQ32s", op, 0, size, name.encode())
+	if fd is None:
+		s.sendall(req)
+	else:
+		socket.send_fds(s, [req], [fd])
+	status, _, size = struct.unpack("=IIQ", recv(s, 16))
+	recv(s, 64)
+	return status, (recv(s, size) if op == LIST else size)
+
+def result(ok, what):
+	print(("ok   " if ok else "FAIL ") + what)
+	return ok
+
+passed = True
+stalled = connect()
+stalled.sendall(b"\x05\x00\x00\x00\x00")	# Part of a request, never finished
+s = connect()
+with open(os.path.join(work, "served.bin"), "rb") as f:
+	passed &= result(call(s, WRITE, "served.bin", 1234567, f.fileno())[0] == OK, "serve writes a file while another client stalls")
+with open(os.path.join(work, "cli.out"), "w+b") as f:
+	passed &= result(call(s, READ, "cli.bin", 0, f.fileno())[0] == OK, "serve reads a file written by bmfs")
+passed &= result(call(s, CREATE, "empty.bin", 4096)[0] == OK, "serve creates a file")
+passed &= result(call(s, DELETE, "gone.bin")[0] == OK, "serve deletes a file")
+status, entries = call(s, LIST, "")
+names = sorted(entries[i:i + 32].rstrip(b"\0").decode() for i in range(0, len(entries), 64))
+passed &= result(names == ["cli.bin", "empty.bin", "served.bin"], "serve lists the directory")
+r, w = os.pipe()
+passed &= result(call(s, WRITE, "pipe.bin", 10, r)[0] != OK, "serve refuses a pipe")
+os.close(r)
+os.close(w)
+stalled.close()
+sys.exit(0 if passed else 1)
+PY
+check $? "serve client"
+
+kill $SERVER
+wait $SERVER 2> /dev/null
+SERVER=
+cmp -s cli.bin cli.out
+check $? "file read through serve matches"
+mv served.bin served.orig
+"$BMFS" disk.img read served.bin > /dev/null && cmp -s served.bin served.orig
+check $? "file written through serve reads back with bmfs"
+"$BMFS" disk.img list | grep -q gone.bin
+check $(( ! $? )) "file deleted through serve is gone"
+"$BMFS" disk.img fsck > /dev/null
+check $? "disk passes fsck after serve"
+
+exit $FAILED
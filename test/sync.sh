@@ -0,0 +1,103 @@
+#!/usr/bin/env bash
+
+# sync keeps a disk in step with a host directory
+# Unchanged files are skipped, changed files rewritten, grown files grown
+# in place or moved, and removed files deleted. A file placed in the same
+# pass as a move must not reuse the blocks the moved file left.
+#
+# Usage: test/sync.sh
+
+. "$(dirname "$0")/lib.sh"
+
+# Starting block of a file on the disk, from its directory entry
+start_of() {
+	local slot name
+	for slot in $(seq 0 63); do
+		name=$(dd if=disk.img bs=1 skip=$((4096 + slot * 64)) count=32 2> /dev/null | tr -d '\0')
+		if [ "$name" = "$1" ]; then
+			od -An -tu8 -j$((4096 + slot * 64 + 32)) -N8 disk.img | tr -d ' '
+			return
+		fi
+	done
+}
+
+# Every file in the host directory reads back from the disk unchanged
+same_files() {
+	local f ret=0
+	rm -rf out && mkdir out && cd out || return 1
+	for f in ../host/*; do
+		"$BMFS" ../disk.img read "$(basename "$f")" > /dev/null 2>&1 && cmp -s "$f" "$(basename "$f")" || ret=1
+	done
+	cd ..
+	return $ret
+}
+
+"$BMFS" disk.img initialize 64M > /dev/null 2>&1 || exit 1
+mkdir host
+
+# One file per pass, so they sit on the disk in the order a, b, c
+for f in a b c; do
+	head -c 1000 /dev/urandom > host/$f
+	"$BMFS" disk.img sync host > out.txt
+done
+grep -q "1 written (1000 bytes), 2 current" out.txt && same_files
+check $? "new files are written"
+
+"$BMFS" disk.img sync host > out.txt
+grep -q "0 written (0 bytes), 3 current" out.txt
+check $? "unchanged files are skipped"
+
+printf 'XYZ' | dd of=host/a bs=1 seek=10 conv=notrunc 2> /dev/null
+"$BMFS" disk.img sync host > out.txt
+grep -q "1 written (1000 bytes)" out.txt && same_files
+check $? "a changed file of the same size is rewritten"
+
+# c is last on the disk, so the blocks after it are free
+before=$(start_of c)
+head -c 3000000 /dev/urandom > host/c
+"$BMFS" disk.img sync host > /dev/null
+[ "$(start_of c)" = "$before" ] && same_files
+check $? "a grown file with free blocks after it grows in place"
+
+# b has c right after it, so it has to move
+before=$(start_of b)
+head -c 3000000 /dev/urandom > host/b
+"$BMFS" disk.img sync host > /dev/null
+[ "$(start_of b)" != "$before" ] && same_files
+check $? "a grown file with no room after it is moved"
+
+rm host/b
+"$BMFS" disk.img sync host > out.txt
+grep -q "1 deleted" out.txt && ! "$BMFS" disk.img list | grep -q '^b '
+check $? "a file removed from the host is deleted"
+
+# Four files that all have to move, and new files in the same pass that
+# must not land where any of them was. The order files are synced in is
+# the host directory's, so with several of each some new file comes after
+# some move whatever that order is.
+rm -f disk.img host/*
+"$BMFS" disk.img initialize 64M > /dev/null 2>&1 || exit 1
+for f in m1 m2 m3 m4; do
+	head -c 1000 /dev/urandom > host/$f
+	"$BMFS" disk.img sync host > /dev/null
+done
+old=" $(start_of m1) $(start_of m2) $(start_of m3) $(start_of m4) "
+for f in m1 m2 m3 m4; do
+	head -c 3000000 /dev/urandom > host/$f
+done
+for n in 1 2 3 4 5 6 7 8; do
+	head -c 1000 /dev/urandom > host/z$n
+done
+"$BMFS" disk.img sync host > /dev/null
+reused=0
+for f in m1 m2 m3 m4 z1 z2 z3 z4 z5 z6 z7 z8; do
+	case "$old" in
+	*" $(start_of $f) "*) reused=1 ;;
+	esac
+done
+[ $reused = 0 ]
+check $? "blocks left by moved files are not reused in the same pass"
+"$BMFS" disk.img fsck --deep > /dev/null 2>&1 && same_files
+check $? "disk checks clean and every file reads back"
+
+exit $FAILED